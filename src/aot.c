@@ -0,0 +1,372 @@
+#include "aot.h"
+
+#include <dlfcn.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "memory.h"
+
+// Ahead-of-time compilation. emit_c() writes each function of a script as a C
+// function over the VM's own stack, much like the JIT's templates: locals,
+// constants, number arithmetic and branches are plain C, globals, properties,
+// upvalues and printing call the VM's helpers, and everything else, calls and
+// returns among them, leaves to the interpreter. It enters the C again after
+// the next call, return or backward branch, as it does the JIT's code.
+//
+// The generated file includes the VM's headers, so it is built against the
+// same Value representation, into a shared object that load_aot() opens and
+// matches up with the functions of the script compiled again from source.
+// Constants are read from those functions at run time, so only the bytecode
+// itself has to be the same, which a checksum of each function confirms.
+
+typedef struct {
+	ObjFunction **functions;
+	int count;
+	int capacity;
+} FunctionList;
+
+static void add_function(FunctionList *list, ObjFunction *function) {
+	if (list->capacity < list->count + 1) {
+		int old_capacity = list->capacity;
+		list->capacity   = GROW_CAPACITY(old_capacity);
+		list->functions  = GROW_ARRAY(ObjFunction *, list->functions, old_capacity, list->capacity);
+	}
+	list->functions[list->count++] = function;
+}
+
+// Number functions breadth first, compiling the bodies that were deferred,
+// since all of them are needed up front. False if one doesn't compile. The
+// caller keeps `script`, and so every function in it, reachable meanwhile.
+static bool collect(ObjFunction *script, FunctionList *list) {
+	add_function(list, script);
+	for (int i = 0; i < list->count; i++) {
+		ObjFunction *function = list->functions[i];
+		if (function->source != NULL && !compile_body(function)) {
+			fprintf(stderr, "Could not compile body of %s().\n", function->name->chars);
+			return false;
+		}
+		for (int j = 0; j < function->chunk.constants.count; j++) {
+			Value value = function->chunk.constants.values[j];
+			if (IS_FUNCTION(value)) add_function(list, AS_FUNCTION(value));
+		}
+	}
+	return true;
+}
+
+static void free_list(FunctionList *list) {
+	FREE_ARRAY(ObjFunction *, list->functions, list->capacity);
+}
+
+// FNV-1a over the code.
+static uint64_t checksum(ObjFunction *function) {
+	uint64_t hash = 0xcbf29ce484222325u;
+	for (int i = 0; i < function->chunk.count; i++) {
+		hash ^= function->chunk.code[i];
+		hash *= 0x100000001b3u;
+	}
+	return hash;
+}
+
+static uint8_t opcode_at(Chunk *chunk, int offset) {
+	uint8_t op = chunk->code[offset];
+	return op == OP_WIDE ? chunk->code[offset + 1] : op;
+}
+
+static uint32_t operand_at(Chunk *chunk, int offset) {
+	if (chunk->code[offset] != OP_WIDE) return chunk->code[offset + 1];
+	return chunk->code[offset + 2] | (chunk->code[offset + 3] << 8) | (chunk->code[offset + 4] << 16);
+}
+
+static int jump_target(Chunk *chunk, int offset) {
+	int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+	return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+// Whether the C for the instruction runs it, rather than leaving to the
+// interpreter.
+static bool inline_op(uint8_t op) {
+	switch (op) {
+		case OP_CONSTANT:
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_POP:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_DEFINE_GLOBAL:
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+		case OP_EQUAL:
+		case OP_GREATER:
+		case OP_LESS:
+		case OP_NEGATE:
+		case OP_PRINT:
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_TRUE:
+		case OP_LOOP:
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+		case OP_NOT:
+		case OP_ADD_NUMBER:
+		case OP_SUBTRACT_NUMBER:
+		case OP_MULTIPLY_NUMBER:
+		case OP_DIVIDE_NUMBER:
+		case OP_NEGATE_NUMBER:
+		case OP_GREATER_NUMBER:
+		case OP_LESS_NUMBER:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static const char prelude[] =
+    "#include \"aot.h\"\n"
+    "\n"
+    "static const AotRuntime *rt;\n"
+    "\n"
+    "#define LEAVE(offset) return rt->helpers.leave(top, offset)\n"
+    "#define HELPER(name, operand, offset)                        \\\n"
+    "\tdo {                                                     \\\n"
+    "\t\tValue *next = rt->helpers.name(top, operand, frame); \\\n"
+    "\t\tif (next == NULL) LEAVE(offset);                     \\\n"
+    "\t\ttop = next;                                          \\\n"
+    "\t} while (0)\n"
+    "#define NAME(index)     ((uintptr_t)AS_OBJ(constants[index]))\n"
+    "#define FALSEY(value)   (IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)))\n"
+    "#define NUMBERS(offset)                                                \\\n"
+    "\tdo {                                                               \\\n"
+    "\t\tif (!IS_NUMBER(top[-2]) || !IS_NUMBER(top[-1])) LEAVE(offset); \\\n"
+    "\t} while (0)\n"
+    "#define BINARY(value_type, op)                                          \\\n"
+    "\tdo {                                                                \\\n"
+    "\t\ttop[-2] = value_type(AS_NUMBER(top[-2]) op AS_NUMBER(top[-1])); \\\n"
+    "\t\ttop--;                                                          \\\n"
+    "\t} while (0)\n"
+    "#define SAFEPOINT(offset)                    \\\n"
+    "\tdo {                                     \\\n"
+    "\t\tif (--*rt->fuel <= 0) LEAVE(offset); \\\n"
+    "\t} while (0)\n";
+
+static void emit_instruction(FILE *out, Chunk *chunk, int offset) {
+	uint8_t op     = opcode_at(chunk, offset);
+	uint32_t index = instruction_length(chunk, offset) > 1 ? operand_at(chunk, offset) : 0;
+	static const char *const binary[] = {
+	    [OP_GREATER] = "BOOL_VAL, >",
+	    [OP_LESS] = "BOOL_VAL, <",
+	    [OP_ADD] = "NUMBER_VAL, +",
+	    [OP_SUBTRACT] = "NUMBER_VAL, -",
+	    [OP_MULTIPLY] = "NUMBER_VAL, *",
+	    [OP_DIVIDE] = "NUMBER_VAL, /",
+	    [OP_GREATER_NUMBER] = "BOOL_VAL, >",
+	    [OP_LESS_NUMBER] = "BOOL_VAL, <",
+	    [OP_ADD_NUMBER] = "NUMBER_VAL, +",
+	    [OP_SUBTRACT_NUMBER] = "NUMBER_VAL, -",
+	    [OP_MULTIPLY_NUMBER] = "NUMBER_VAL, *",
+	    [OP_DIVIDE_NUMBER] = "NUMBER_VAL, /",
+	};
+	static const char *const helpers[] = {
+	    [OP_DEFINE_GLOBAL] = "define_global",
+	    [OP_GET_GLOBAL] = "get_global",
+	    [OP_SET_GLOBAL] = "set_global",
+	    [OP_GET_PROPERTY] = "get_property",
+	    [OP_SET_PROPERTY] = "set_property",
+	    [OP_GET_UPVALUE] = "get_upvalue",
+	    [OP_SET_UPVALUE] = "set_upvalue",
+	};
+	switch (op) {
+		case OP_CONSTANT:
+			fprintf(out, "\t*top++ = constants[%u];\n", index);
+			break;
+		case OP_NIL:
+			fprintf(out, "\t*top++ = NIL_VAL;\n");
+			break;
+		case OP_TRUE:
+		case OP_FALSE:
+			fprintf(out, "\t*top++ = BOOL_VAL(%s);\n", op == OP_TRUE ? "true" : "false");
+			break;
+		case OP_POP:
+			fprintf(out, "\ttop--;\n");
+			break;
+		case OP_GET_LOCAL:
+			fprintf(out, "\t*top++ = slots[%u];\n", index);
+			break;
+		case OP_SET_LOCAL:
+			fprintf(out, "\tslots[%u] = top[-1];\n", index);
+			break;
+		case OP_DEFINE_GLOBAL:
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+			fprintf(out, "\tHELPER(%s, NAME(%u), %d);\n", helpers[op], index, offset);
+			break;
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+			fprintf(out, "\tHELPER(%s, %u, %d);\n", helpers[op], index, offset);
+			break;
+		case OP_EQUAL:
+			fprintf(out, "\tHELPER(equal, 0, %d);\n", offset);
+			break;
+		case OP_PRINT:
+			fprintf(out, "\tHELPER(print, 0, %d);\n", offset);
+			break;
+		case OP_GREATER:
+		case OP_LESS:
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+			// Strings are concatenated by the interpreter.
+			fprintf(out, "\tNUMBERS(%d);\n", offset);
+			// Fall through.
+		case OP_GREATER_NUMBER:
+		case OP_LESS_NUMBER:
+		case OP_ADD_NUMBER:
+		case OP_SUBTRACT_NUMBER:
+		case OP_MULTIPLY_NUMBER:
+		case OP_DIVIDE_NUMBER:
+			fprintf(out, "\tBINARY(%s);\n", binary[op]);
+			break;
+		case OP_NEGATE:
+			fprintf(out, "\tif (!IS_NUMBER(top[-1])) LEAVE(%d);\n", offset);
+			// Fall through.
+		case OP_NEGATE_NUMBER:
+			fprintf(out, "\ttop[-1] = NUMBER_VAL(-AS_NUMBER(top[-1]));\n");
+			break;
+		case OP_NOT:
+			fprintf(out, "\ttop[-1] = BOOL_VAL(FALSEY(top[-1]));\n");
+			break;
+		case OP_JUMP:
+			fprintf(out, "\tgoto L%d;\n", jump_target(chunk, offset));
+			break;
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_TRUE:
+			fprintf(out, "\tif (%sFALSEY(top[-1])) goto L%d;\n", op == OP_JUMP_IF_TRUE ? "!" : "",
+			        jump_target(chunk, offset));
+			break;
+		case OP_LOOP:
+			fprintf(out, "\tSAFEPOINT(%d);\n", offset);
+			fprintf(out, "\tgoto L%d;\n", jump_target(chunk, offset));
+			break;
+		default:
+			fprintf(out, "\tLEAVE(%d);\n", offset);
+			break;
+	}
+}
+
+// The C function for `function`. It can be entered at its start, after an
+// instruction it leaves to the interpreter for, or at a jump target; anywhere
+// else it hands the offset straight back.
+static void emit_function(FILE *out, ObjFunction *function, int number) {
+	Chunk *chunk = &function->chunk;
+	bool *labels = ALLOCATE(bool, chunk->count + 1);
+	for (int i = 0; i <= chunk->count; i++) labels[i] = i == 0;
+	for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+		uint8_t op = opcode_at(chunk, offset);
+		if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE || op == OP_LOOP) {
+			labels[jump_target(chunk, offset)] = true;
+		}
+		if (!inline_op(op)) labels[offset + instruction_length(chunk, offset)] = true;
+	}
+
+	fprintf(out, "\n// %s\n", function->name != NULL ? function->name->chars : "<script>");
+	fprintf(out, "static int f%d(CallFrame *frame, Value *slots, Value *top, int offset) {\n", number);
+	fprintf(out, "\tValue *constants = frame->closure->function->chunk.constants.values;\n");
+	fprintf(out, "\tswitch (offset) {\n");
+	for (int offset = 0; offset < chunk->count; offset++) {
+		if (labels[offset]) fprintf(out, "\t\tcase %d: goto L%d;\n", offset, offset);
+	}
+	fprintf(out, "\t\tdefault: return offset;\n");
+	fprintf(out, "\t}\n");
+	for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+		if (labels[offset]) fprintf(out, "L%d:\n", offset);
+		emit_instruction(out, chunk, offset);
+	}
+	fprintf(out, "}\n");
+	FREE_ARRAY(bool, labels, chunk->count + 1);
+}
+
+// Write `script` and every function in it as C, to be built into a shared
+// object for load_aot(). False if a deferred body fails to compile.
+bool emit_c(ObjFunction *script, FILE *out) {
+	FunctionList list = {NULL, 0, 0};
+	push(OBJ_VAL(script));
+	if (!collect(script, &list)) {
+		free_list(&list);
+		pop();
+		return false;
+	}
+	fprintf(out, "// Generated by clox --emit-c. Build it against the clox sources with\n");
+	fprintf(out, "//   cc -O2 -shared -fPIC -I<clox>/src -o program.so program.c\n");
+	fprintf(out, "// and run the same script with clox --aot program.so.\n");
+	fputs(prelude, out);
+	for (int i = 0; i < list.count; i++) {
+		emit_function(out, list.functions[i], i);
+	}
+	fprintf(out, "\nstatic const AotFunction functions[] = {\n");
+	for (int i = 0; i < list.count; i++) {
+		fprintf(out, "\t{0x%016llxull, f%d},\n", (unsigned long long)checksum(list.functions[i]), i);
+	}
+	fprintf(out, "};\n");
+	fprintf(out, "\nstatic void bind(const AotRuntime *runtime) {\n\trt = runtime;\n}\n");
+	fprintf(out, "\nconst AotLibrary clox_aot = {%d, sizeof(Value), %d, functions, bind};\n", AOT_VERSION, list.count);
+	free_list(&list);
+	pop();
+	return true;
+}
+
+// Open the library at `path` and have each function of `script` run its C.
+// Nothing changes if the library is missing, was built for another VM or from
+// other code, and the script runs as bytecode.
+bool load_aot(const char *path, ObjFunction *script) {
+	void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL) {
+		fprintf(stderr, "Could not load \"%s\": %s\n", path, dlerror());
+		return false;
+	}
+	const AotLibrary *library = (const AotLibrary *)dlsym(handle, "clox_aot");
+	if (library == NULL || library->version != AOT_VERSION || library->value_size != (int)sizeof(Value)) {
+		fprintf(stderr, "\"%s\" was not built for this clox.\n", path);
+		dlclose(handle);
+		return false;
+	}
+	FunctionList list = {NULL, 0, 0};
+	push(OBJ_VAL(script));
+	bool matches = collect(script, &list) && list.count == library->count;
+	pop();
+	for (int i = 0; matches && i < list.count; i++) {
+		matches = checksum(list.functions[i]) == library->functions[i].checksum;
+	}
+	if (!matches) {
+		fprintf(stderr, "\"%s\" was built from another version of the script.\n", path);
+		free_list(&list);
+		dlclose(handle);
+		return false;
+	}
+
+	static AotRuntime runtime;
+	runtime.helpers = g_helpers;
+	runtime.fuel    = &g_vm.fuel;
+	library->bind(&runtime);
+	for (int i = 0; i < list.count; i++) {
+		list.functions[i]->aot     = library->functions[i].entry;
+		list.functions[i]->hotness = -1;  // the JIT has nothing to add
+	}
+	free_list(&list);
+	return true;
+}
+
+// Run the frame's C from `ip`. Returns the offset of the instruction the
+// interpreter goes on from.
+int run_aot(ObjFunction *function, CallFrame *frame, uint8_t *ip) {
+	return function->aot(frame, &g_vm.stack[frame->base], &g_vm.stack[g_vm.stackCount],
+	                     (int)(ip - function->chunk.code));
+}
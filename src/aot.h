@@ -0,0 +1,43 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "jit.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// Bumped whenever the C that emit_c() writes, or what it expects of the VM,
+// changes; libraries built for another version aren't loaded.
+#define AOT_VERSION 1
+
+typedef int (*AotEntry)(CallFrame *frame, Value *slots, Value *top, int offset);
+
+// What a library calls back into, handed over when it is loaded.
+typedef struct {
+	Helpers helpers;
+	int *fuel;
+} AotRuntime;
+
+typedef struct {
+	uint64_t checksum;  // of the bytecode it was compiled from
+	AotEntry entry;
+} AotFunction;
+
+// The symbol a library exports as `clox_aot`. Functions come in the order
+// emit_c() numbers them, breadth first from the script.
+typedef struct {
+	int version;
+	int value_size;
+	int count;
+	const AotFunction *functions;
+	void (*bind)(const AotRuntime *runtime);
+} AotLibrary;
+
+bool emit_c(ObjFunction *script, FILE *out);
+bool load_aot(const char *path, ObjFunction *script);
+int run_aot(ObjFunction *function, CallFrame *frame, uint8_t *ip);
+
+#endif
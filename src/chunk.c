@@ -4,6 +4,8 @@
 #include <stdlib.h>
 
 #include "memory.h"
+#include "module.h"
+#include "object.h"
 #include "vm.h"
 
 void init_chunk(Chunk *chunk) {
@@ -21,19 +23,147 @@ void write_chunk(Chunk *chunk, uint8_t byte, int line) {
 		chunk->code     = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
 	}
 	chunk->code[chunk->count] = byte;
-	writeLines(&chunk->lines, line);
 	chunk->count++;
+	// Most bytes continue the current run.
+	Lignes *lines = &chunk->lines;
+	if (lines->count >= 0 && lines->runs[lines->count].lineNumber == line) {
+		lines->runs[lines->count].runLength++;
+	} else {
+		writeLines(lines, line);
+	}
+}
+
+// Drop every byte from `count` on, along with its line information.
+void rewind_chunk(Chunk *chunk, int count) {
+	int drop = chunk->count - count;
+	while (drop > 0) {
+		Run *run = &chunk->lines.runs[chunk->lines.count];
+		int n    = run->runLength < drop ? run->runLength : drop;
+		run->runLength -= n;
+		drop -= n;
+		if (run->runLength == 0) chunk->lines.count--;
+	}
+	chunk->count = count;
+}
+
+// The line of the instruction at `offset`, or -1 when it isn't known.
+int chunk_line(Chunk *chunk, int offset) {
+	if (chunk->lines.stripped != NULL) load_stripped_lines(&chunk->lines);
+	return getLineByNumber(&chunk->lines, offset);
+}
+
+// Size in bytes of the instruction at `offset`, counting an OP_WIDE prefix.
+int instruction_length(Chunk *chunk, int offset) {
+	bool wide   = chunk->code[offset] == OP_WIDE;
+	int start   = wide ? offset + 1 : offset;
+	int operand = wide ? 3 : 1;
+	int prefix  = start - offset;
+	switch (chunk->code[start]) {
+		case OP_CONSTANT:
+		case OP_GET_LOCAL:
+		case OP_SET_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_DEFINE_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+		case OP_GET_SUPER:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_IMPORT:
+		case OP_IS_NUMBER:
+			return prefix + 1 + operand;
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+			return prefix + 2 + operand;
+		case OP_CALL:
+		case OP_BUILD_STRING:
+			return 2;
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_TRUE:
+		case OP_LOOP:
+			return 3;
+		case OP_CLOSURE: {
+			uint32_t index = chunk->code[start + 1];
+			if (wide) index |= (chunk->code[start + 2] << 8) | (chunk->code[start + 3] << 16);
+			ObjFunction *function = AS_FUNCTION(chunk->constants.values[index]);
+			return prefix + 1 + operand + function->upvalue_count * (1 + operand);
+		}
+		default:
+			return 1;
+	}
+}
+
+// Net change in stack depth made by the instruction at `offset`. OP_RETURN
+// leaves the frame, so its effect only counts the result it pops.
+int stack_effect(Chunk *chunk, int offset) {
+	bool wide   = chunk->code[offset] == OP_WIDE;
+	int start   = wide ? offset + 1 : offset;
+	int operand = wide ? 3 : 1;
+	switch (chunk->code[start]) {
+		case OP_CONSTANT:
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_GET_LOCAL:
+		case OP_GET_GLOBAL:
+		case OP_GET_UPVALUE:
+		case OP_CLOSURE:
+		case OP_CLASS:
+		case OP_IMPORT:
+		case OP_IS_NUMBER:
+			return 1;
+		case OP_POP:
+		case OP_DEFINE_GLOBAL:
+		case OP_SET_PROPERTY:
+		case OP_GET_SUPER:
+		case OP_EQUAL:
+		case OP_GREATER:
+		case OP_LESS:
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+		case OP_PRINT:
+		case OP_CLOSE_UPVALUE:
+		case OP_RETURN:
+		case OP_INHERIT:
+		case OP_METHOD:
+		case OP_ADD_NUMBER:
+		case OP_SUBTRACT_NUMBER:
+		case OP_MULTIPLY_NUMBER:
+		case OP_DIVIDE_NUMBER:
+		case OP_GREATER_NUMBER:
+		case OP_LESS_NUMBER:
+			return -1;
+		case OP_CALL:
+			return -chunk->code[start + 1];
+		case OP_INVOKE:
+			return -chunk->code[start + 1 + operand];
+		case OP_SUPER_INVOKE:
+			return -chunk->code[start + 1 + operand] - 1;
+		case OP_BUILD_STRING:
+			return 1 - chunk->code[start + 1];
+		default:
+			return 0;
+	}
 }
 
 int add_constant(Chunk *chunk, Value value) {
-	push(value);
+	// Only the VM's own thread collects, or may touch its stack.
+	bool root = g_heap == NULL;
+	if (root) push(value);
 	write_value_array(&chunk->constants, value);
-	pop();
+	if (root) pop();
 	return chunk->constants.count - 1;
 }
 
 void free_chunk(Chunk *chunk) {
-	FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+	// Code loaded from a mapped image has no capacity and isn't ours.
+	if (chunk->capacity != 0) FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
 	freeLines(&chunk->lines);
 	free_value_array(&chunk->constants);
 	init_chunk(chunk);
@@ -4,6 +4,10 @@
 #include "common.h"
 #include "value.h"
 
+// Bump whenever opcodes or their encoding change; bytecode cached on disk
+// records it and is recompiled on a mismatch.
+#define BYTECODE_VERSION 3
+
 typedef enum {
 	OP_CONSTANT,
 	OP_NIL,
@@ -23,11 +27,12 @@ typedef enum {
 	OP_EQUAL,
 	OP_GREATER,
 	OP_LESS,
-	OP_CONSTANT_LONG,
+	OP_WIDE,  // next instruction takes a 24-bit index, low byte first
 	OP_NEGATE,
 	OP_PRINT,
 	OP_JUMP,
 	OP_JUMP_IF_FALSE,
+	OP_JUMP_IF_TRUE,
 	OP_LOOP,
 	OP_CALL,
 	OP_INVOKE,
@@ -43,6 +48,19 @@ typedef enum {
 	OP_CLASS,
 	OP_INHERIT,
 	OP_METHOD,
+	OP_IMPORT,
+	OP_BUILD_STRING,  // joins the top n values, stringified, into one string
+	// Unchecked forms, emitted where the compiler has inferred both operands
+	// to be numbers.
+	OP_ADD_NUMBER,
+	OP_SUBTRACT_NUMBER,
+	OP_MULTIPLY_NUMBER,
+	OP_DIVIDE_NUMBER,
+	OP_NEGATE_NUMBER,
+	OP_GREATER_NUMBER,
+	OP_LESS_NUMBER,
+	OP_IS_NUMBER,  // pushes whether a local is a number; only the optimizing tier emits it
+	OP_NEW,        // replaces a class with a new instance of it, not initialized; likewise
 } OpCode;
 
 typedef struct {
@@ -55,6 +73,10 @@ typedef struct {
 
 void init_chunk(Chunk *chunk);
 void write_chunk(Chunk *chunk, uint8_t byte, int line);
+void rewind_chunk(Chunk *chunk, int count);
+int instruction_length(Chunk *chunk, int offset);
+int stack_effect(Chunk *chunk, int offset);
+int chunk_line(Chunk *chunk, int offset);
 int add_constant(Chunk *chunk, Value value);
 void free_chunk(Chunk *chunk);
 
@@ -7,18 +7,12 @@
 
 #define NAN_BOXING
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
-#define DEBUG_STRESS_GC
-#define DEBUG_LOG_GC
 #define UINT8_COUNT (UINT8_MAX + 1)
+// Operands behind OP_WIDE are 24 bits wide.
+#define UINT24_COUNT (1 << 24)
 
 #define OPT
 
-#undef DEBUG_TRACE_EXECUTION
-// #undef DEBUG_PRINT_CODE
-#undef DEBUG_STRESS_GC
-#undef DEBUG_LOG_GC
 // #undef OPT
 #undef NAN_BOXING
 #endif
@@ -1,5 +1,7 @@
 #include "compiler.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,18 +9,14 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "debug.h"
 #include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "value.h"
 #include "vm.h"
 
-#define THREE_BYTE_MAX 16777216  // 2^24
-
-#ifdef DEBUG_PRINT_CODE
-#include "debug.h"
-#endif
-
 typedef struct {
 	Token previous;
 	Token current;
@@ -52,13 +50,36 @@ typedef struct {
 	Token name;
 	int depth;
 	bool is_captured;
+	uint64_t depends;  // number slots its values were computed from
 } Local;
 
 typedef struct {
-	uint8_t index;
+	int index;
 	bool is_local;
 } Upvalue;
 
+// Maps the numbers and strings already in a chunk's constant pool back to
+// their index, so that repeated literals and names share one entry.
+typedef struct {
+	Value value;
+	uint32_t hash;
+	int index;  // -1 for an empty slot
+} ConstantSlot;
+
+typedef struct {
+	int count;
+	int capacity;
+	ConstantSlot *slots;
+} ConstantIndex;
+
+// An unchecked arithmetic or comparison op emitted because its operands were
+// inferred to be numbers, assuming the locals in `deps` only ever hold numbers.
+typedef struct {
+	int offset;
+	uint8_t op;  // the checked op to put back if that turns out false
+	uint64_t deps;
+} TypedOp;
+
 typedef enum {
 	TYPE_FUNCTION,
 	TYPE_INITIALIZER,
@@ -70,10 +91,23 @@ typedef struct Compiler {
 	struct Compiler *enclosing;
 	ObjFunction *function;
 	FunctionType type;
-	Local locals[UINT8_COUNT];
+	Local *locals;
 	int local_count;
-	Upvalue upvalues[UINT8_COUNT];
+	int local_capacity;
+	Upvalue *upvalues;
+	int upvalue_capacity;
 	int scope_depth;
+	ConstantIndex constants;
+	int operand_start;  // where the left operand of the infix being parsed begins
+	int numeric_end;    // offset right after the last op known to leave a number
+	int jump_target;    // furthest offset a forward jump has been patched to
+	// Which of the first 64 local slots only ever hold numbers, as far as the
+	// code seen so far shows, and the number fact at numeric_end relies on.
+	uint64_t number_slots;
+	uint64_t numeric_deps;
+	TypedOp *typed_ops;
+	int typed_count;
+	int typed_capacity;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -81,17 +115,28 @@ typedef struct ClassCompiler {
 	bool has_superclass;
 } ClassCompiler;
 
-Parser parser;
-Compiler *g_current            = NULL;
-ClassCompiler *g_current_class = NULL;
+// Everything a single compilation mutates. Each compile() and compile_body()
+// runs in its own context, reached through a thread-local pointer, so compiles
+// nest and run on several threads at once.
+typedef struct CompileContext {
+	struct CompileContext *enclosing;
+	Scanner scanner;
+	Parser parser;
+	Compiler *current;
+	ClassCompiler *current_class;
+	bool eager;     // compile every body now, see defer_function()
+	Table *consts;  // the script's, see const_declaration()
+} CompileContext;
+
+static _Thread_local CompileContext *g_ctx = NULL;
 
 static Chunk *current_chunk() {
-	return &g_current->function->chunk;
+	return &g_ctx->current->function->chunk;
 }
 
 static void error_at(Token *token, const char *msg) {
-	if (parser.panic_mode) return;
-	parser.panic_mode = true;
+	if (g_ctx->parser.panic_mode) return;
+	g_ctx->parser.panic_mode = true;
 	fprintf(stderr, "[line %d] Error", token->line);
 	if (token->type == TOKEN_EOF) {
 		fprintf(stderr, " at end");
@@ -101,28 +146,28 @@ static void error_at(Token *token, const char *msg) {
 		fprintf(stderr, " at '%.*s", token->length, token->start);
 	}
 	fprintf(stderr, ": %s\n", msg);
-	parser.had_err = true;
+	g_ctx->parser.had_err = true;
 }
 
 static void error_at_current(const char *msg) {
-	error_at(&parser.current, msg);
+	error_at(&g_ctx->parser.current, msg);
 }
 
 static void error(const char *msg) {
-	error_at(&parser.previous, msg);
+	error_at(&g_ctx->parser.previous, msg);
 }
 
 static void advance() {
-	parser.previous = parser.current;
+	g_ctx->parser.previous = g_ctx->parser.current;
 	for (;;) {
-		parser.current = scan_token();
-		if (parser.current.type != TOKEN_ERROR) break;
-		error_at_current(parser.current.start);
+		g_ctx->parser.current = scan_token(&g_ctx->scanner);
+		if (g_ctx->parser.current.type != TOKEN_ERROR) break;
+		error_at_current(g_ctx->parser.current.start);
 	}
 }
 
 static void consume(TokenType type, const char *msg) {
-	if (parser.current.type == type) {
+	if (g_ctx->parser.current.type == type) {
 		advance();
 		return;
 	}
@@ -130,7 +175,7 @@ static void consume(TokenType type, const char *msg) {
 }
 
 static bool check(TokenType type) {
-	return parser.current.type == type;
+	return g_ctx->parser.current.type == type;
 }
 
 static bool match(TokenType type) {
@@ -140,7 +185,7 @@ static bool match(TokenType type) {
 }
 
 static void emit_byte(uint8_t byte) {
-	write_chunk(current_chunk(), byte, parser.previous.line);
+	write_chunk(current_chunk(), byte, g_ctx->parser.previous.line);
 }
 
 static void emit_bytes(uint8_t byte1, uint8_t byte2) {
@@ -148,6 +193,25 @@ static void emit_bytes(uint8_t byte1, uint8_t byte2) {
 	emit_byte(byte2);
 }
 
+static void emit_operand(int index, bool wide) {
+	if (wide) {
+		emit_byte(index & 0xff);
+		emit_byte((index >> 8) & 0xff);
+		emit_byte((index >> 16) & 0xff);
+	} else {
+		emit_byte((uint8_t)index);
+	}
+}
+
+// Emit an instruction whose first operand is an index, prefixed by OP_WIDE
+// when the index does not fit in a byte.
+static void emit_indexed(uint8_t instruction, int index) {
+	bool wide = index > UINT8_MAX;
+	if (wide) emit_byte(OP_WIDE);
+	emit_byte(instruction);
+	emit_operand(index, wide);
+}
+
 static void emit_loop(int loop_start) {
 	emit_byte(OP_LOOP);
 
@@ -166,37 +230,192 @@ static int emit_jump(uint8_t instruction) {
 }
 
 static void emit_return() {
-	if (g_current->type == TYPE_INITIALIZER) {
-		emit_bytes(OP_GET_LOCAL, 0);
+	if (g_ctx->current->type == TYPE_INITIALIZER) {
+		emit_indexed(OP_GET_LOCAL, 0);
 	} else {
 		emit_byte(OP_NIL);
 	}
 	emit_byte(OP_RETURN);
 }
 
-static uint8_t make_constant(Value value) {
-	int constant = add_constant(current_chunk(), value);
-	return (uint8_t)constant;
+#define CONSTANT_INDEX_MAX_LOAD 0.75
+
+static uint32_t hash_number(double number) {
+	uint64_t bits;
+	memcpy(&bits, &number, sizeof(bits));
+	bits ^= bits >> 32;
+	return (uint32_t)bits * 0x9e3779b1u;
+}
+
+// Numbers are matched bit for bit, so 0 and -0 keep separate entries. Strings
+// are interned, so matching them by identity is matching them by value.
+static bool same_constant(Value a, Value b) {
+	if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		double x = AS_NUMBER(a), y = AS_NUMBER(b);
+		return memcmp(&x, &y, sizeof(double)) == 0;
+	}
+	return IS_STRING(a) && IS_STRING(b) && AS_STRING(a) == AS_STRING(b);
+}
+
+static ConstantSlot *find_constant_slot(ConstantSlot *slots, int capacity, Value value, uint32_t hash) {
+	uint32_t index = hash & (capacity - 1);
+	for (;;) {
+		ConstantSlot *slot = &slots[index];
+		if (slot->index == -1 || (slot->hash == hash && same_constant(slot->value, value))) return slot;
+		index = (index + 1) & (capacity - 1);
+	}
 }
 
-static void writeConstant(Chunk *chunk, Value value, int line) {
-	uint32_t idx = (uint32_t)add_constant(chunk, value);
-	if (idx > THREE_BYTE_MAX) {
+static void grow_constant_index(ConstantIndex *constants) {
+	int capacity        = GROW_CAPACITY(constants->capacity);
+	ConstantSlot *slots = ALLOCATE(ConstantSlot, capacity);
+	for (int i = 0; i < capacity; i++) slots[i].index = -1;
+	for (int i = 0; i < constants->capacity; i++) {
+		ConstantSlot *slot = &constants->slots[i];
+		if (slot->index == -1) continue;
+		*find_constant_slot(slots, capacity, slot->value, slot->hash) = *slot;
+	}
+	FREE_ARRAY(ConstantSlot, constants->slots, constants->capacity);
+	constants->slots    = slots;
+	constants->capacity = capacity;
+}
+
+static int make_constant(Value value) {
+	bool indexed  = IS_NUMBER(value) || IS_STRING(value);
+	uint32_t hash = 0;
+	if (indexed) {
+		hash               = IS_NUMBER(value) ? hash_number(AS_NUMBER(value)) : AS_STRING(value)->hash;
+		ConstantIndex *idx = &g_ctx->current->constants;
+		if (idx->count > 0) {
+			ConstantSlot *slot = find_constant_slot(idx->slots, idx->capacity, value, hash);
+			if (slot->index != -1) return slot->index;
+		}
+	}
+	int constant = add_constant(current_chunk(), value);
+	if (constant >= UINT24_COUNT) {
 		error("Too many constants in one chunk. Maximum allowed are 2^24.");
+		return 0;
+	}
+	if (indexed) {
+		ConstantIndex *idx = &g_ctx->current->constants;
+		if (idx->count + 1 > idx->capacity * CONSTANT_INDEX_MAX_LOAD) grow_constant_index(idx);
+		ConstantSlot *slot = find_constant_slot(idx->slots, idx->capacity, value, hash);
+		slot->value        = value;
+		slot->hash         = hash;
+		slot->index        = constant;
+		idx->count++;
+	}
+	return constant;
+}
+
+// Like make_constant() for a string, but a name already in the pool is found
+// from its characters without going through copyString() again.
+static int string_constant(const char *chars, int length) {
+	ConstantIndex *idx = &g_ctx->current->constants;
+	if (idx->count > 0) {
+		uint32_t hash  = hashString(chars, length);
+		uint32_t index = hash & (idx->capacity - 1);
+		for (;;) {
+			ConstantSlot *slot = &idx->slots[index];
+			if (slot->index == -1) break;
+			if (slot->hash == hash && IS_STRING(slot->value)) {
+				ObjString *string = AS_STRING(slot->value);
+				if (string->length == length && memcmp(string->chars, chars, length) == 0) return slot->index;
+			}
+			index = (index + 1) & (idx->capacity - 1);
+		}
 	}
-	// use >> &0xff devide 8 8 8
-	emit_bytes(OP_CONSTANT_LONG, (uint8_t)(idx & 0xff));
-	emit_bytes((uint8_t)((idx >> 8) & 0xff), (uint8_t)((idx >> 16) & 0xff));
+	return make_constant(OBJ_VAL(copyString(chars, length)));
 }
 
-static void emit_constant(Value value) {
-	if (current_chunk()->constants.count > UINT8_MAX) {
-		writeConstant(current_chunk(), value, parser.previous.line);
+// Numbers are inferred for the first 64 local slots. A slot is assumed to
+// only hold numbers from the moment a number is stored in it, and unchecked
+// ops are emitted on that assumption. Once anything else may be stored, the
+// checked ops are put back into every instruction that relied on it.
+static uint64_t slot_bit(int slot) {
+	return slot < 64 ? (uint64_t)1 << slot : 0;
+}
+
+// The expression ending at `end` leaves a number, provided the locals in
+// *deps keep only holding numbers.
+static bool leaves_number(int end, uint64_t *deps) {
+	Compiler *current = g_ctx->current;
+	if (current->numeric_end != end || current->jump_target >= end) return false;
+	if ((current->numeric_deps & ~current->number_slots) != 0) return false;
+	*deps = current->numeric_deps;
+	return true;
+}
+
+static void left_number(uint64_t deps) {
+	g_ctx->current->numeric_end  = current_chunk()->count;
+	g_ctx->current->numeric_deps = deps;
+}
+
+// Drop the code from `count` on, and with it what inference knew about it:
+// a number fact for an op that is gone would otherwise match whatever gets
+// emitted to end at the same offset.
+static void rewind_code(int count) {
+	Compiler *current = g_ctx->current;
+	rewind_chunk(current_chunk(), count);
+	if (current->numeric_end > count) {
+		current->numeric_end  = -1;
+		current->numeric_deps = 0;
+	}
+	while (current->typed_count > 0 && current->typed_ops[current->typed_count - 1].offset >= count) {
+		current->typed_count--;
+	}
+}
+
+static void emit_typed(uint8_t op, uint8_t unchecked, bool numbers, uint64_t deps) {
+	Compiler *current = g_ctx->current;
+	if (!numbers) {
+		emit_byte(op);
+		return;
+	}
+	if (deps != 0) {
+		if (current->typed_capacity < current->typed_count + 1) {
+			int old_capacity        = current->typed_capacity;
+			current->typed_capacity = GROW_CAPACITY(old_capacity);
+			current->typed_ops      = GROW_ARRAY(TypedOp, current->typed_ops, old_capacity, current->typed_capacity);
+		}
+		current->typed_ops[current->typed_count++] = (TypedOp){current_chunk()->count, op, deps};
+	}
+	emit_byte(unchecked);
+}
+
+static void forget_number(Compiler *compiler, int slot) {
+	uint64_t bit = slot_bit(slot);
+	if ((compiler->number_slots & bit) == 0) return;
+	compiler->number_slots &= ~bit;
+	uint8_t *code = compiler->function->chunk.code;
+	for (int i = 0; i < compiler->typed_count; i++) {
+		if (compiler->typed_ops[i].deps & bit) code[compiler->typed_ops[i].offset] = compiler->typed_ops[i].op;
+	}
+	for (int i = 0; i < compiler->local_count; i++) {
+		if (compiler->locals[i].depends & bit) forget_number(compiler, i);
+	}
+}
+
+// The value just stored in local `slot` was left by the expression ending here.
+static void stored_local(int slot) {
+	uint64_t deps;
+	Compiler *current = g_ctx->current;
+	if (!leaves_number(current_chunk()->count, &deps)) {
+		forget_number(current, slot);
+	} else if (current->locals[slot].depth == -1) {
+		// Declared just now, so this is the first value it holds.
+		current->locals[slot].depends = deps;
+		current->number_slots |= slot_bit(slot);
 	} else {
-		emit_bytes(OP_CONSTANT, make_constant(value));
+		current->locals[slot].depends |= deps;
 	}
 }
 
+static void emit_constant(Value value) {
+	emit_indexed(OP_CONSTANT, make_constant(value));
+	if (IS_NUMBER(value)) left_number(0);
+}
+
 static void patch_jump(int offset) {
 	int jump = current_chunk()->count - offset - 2;
 	if (jump > UINT16_MAX) {
@@ -204,20 +423,42 @@ static void patch_jump(int offset) {
 	}
 	current_chunk()->code[offset]     = (jump >> 8) & 0xff;
 	current_chunk()->code[offset + 1] = jump & 0xff;
-}
-
-static void init_compiler(Compiler *compiler, FunctionType type) {
-	compiler->enclosing   = g_current;
-	compiler->function    = NULL;
-	compiler->type        = type;
-	compiler->local_count = 0;
-	compiler->scope_depth = 0;
-	compiler->function    = new_function();
-	g_current             = compiler;
-	if (type != TYPE_SCRIPT) g_current->function->name = copyString(parser.previous.start, parser.previous.length);
-	Local *local       = &g_current->locals[g_current->local_count++];
-	local->depth       = 0;
-	local->is_captured = false;
+	g_ctx->current->jump_target       = current_chunk()->count;
+}
+
+// `function` is NULL for a new function, or a deferred one to compile.
+static void init_compiler(Compiler *compiler, FunctionType type, ObjFunction *function) {
+	compiler->enclosing          = g_ctx->current;
+	compiler->function           = NULL;
+	compiler->type               = type;
+	compiler->locals             = NULL;
+	compiler->local_count        = 0;
+	compiler->local_capacity     = 0;
+	compiler->upvalues           = NULL;
+	compiler->upvalue_capacity   = 0;
+	compiler->scope_depth        = 0;
+	compiler->constants.count    = 0;
+	compiler->constants.capacity = 0;
+	compiler->constants.slots    = NULL;
+	compiler->operand_start      = 0;
+	compiler->numeric_end        = -1;
+	compiler->jump_target        = 0;
+	compiler->number_slots       = 0;
+	compiler->numeric_deps       = 0;
+	compiler->typed_ops          = NULL;
+	compiler->typed_count        = 0;
+	compiler->typed_capacity     = 0;
+	compiler->function           = function != NULL ? function : new_function();
+	g_ctx->current               = compiler;
+	if (function == NULL && type != TYPE_SCRIPT) {
+		g_ctx->current->function->name = copyString(g_ctx->parser.previous.start, g_ctx->parser.previous.length);
+	}
+	compiler->local_capacity = GROW_CAPACITY(0);
+	compiler->locals         = GROW_ARRAY(Local, NULL, 0, compiler->local_capacity);
+	Local *local             = &g_ctx->current->locals[g_ctx->current->local_count++];
+	local->depth             = 0;
+	local->is_captured       = false;
+	local->depends           = 0;
 	if (type != TYPE_FUNCTION) {
 		local->name.start  = "this";
 		local->name.length = 4;
@@ -229,29 +470,49 @@ static void init_compiler(Compiler *compiler, FunctionType type) {
 
 static ObjFunction *end_compiler() {
 	emit_return();
-	ObjFunction *function = g_current->function;
-#ifdef DEBUG_PRINT_CODE
-	if (!parser.had_err) {
-		disassemble_chunk(current_chunk(), function->name != NULL ? function->name->chars : "<script>");
+	ObjFunction *function = g_ctx->current->function;
+	if (!g_debug.no_peephole && !g_ctx->parser.had_err) optimize_chunk(current_chunk());
+	finish_lines(&current_chunk()->lines);
+	const char *name = function->name != NULL ? function->name->chars : "<script>";
+	if (!g_ctx->parser.had_err) {
+		// Calls reserve this much stack up front, so pushes in the body never grow
+		// it. Code whose depths don't add up has no bound to trust, and is a bug
+		// in the compiler, so it never runs; CLOX_VERIFY_STACK says where.
+		int bad;
+		function->max_stack = max_stack_depth(current_chunk(), function->arity + 1, &bad);
+		if (bad >= 0) {
+			if (g_debug.verify_stack) fprintf(stderr, "Stack check failed in %s at %04d.\n", name, bad);
+			error("Internal error: inconsistent stack depth.");
+		}
 	}
-#endif
-	g_current = g_current->enclosing;
+	if (g_debug.print_code && !g_ctx->parser.had_err) disassemble_chunk(current_chunk(), name);
+	// A body compiled on its first call fills in a function that may be old.
+	write_barrier((Obj *)function);
+	g_ctx->current = g_ctx->current->enclosing;
 	return function;
 }
 
+static void free_compiler(Compiler *compiler) {
+	FREE_ARRAY(Local, compiler->locals, compiler->local_capacity);
+	FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalue_capacity);
+	FREE_ARRAY(ConstantSlot, compiler->constants.slots, compiler->constants.capacity);
+	FREE_ARRAY(TypedOp, compiler->typed_ops, compiler->typed_capacity);
+}
+
 static void begin_scope() {
-	g_current->scope_depth++;
+	g_ctx->current->scope_depth++;
 }
 
 static void end_scope() {
-	g_current->scope_depth--;
-	while (g_current->local_count > 0 && g_current->locals[g_current->local_count - 1].depth > g_current->scope_depth) {
-		if (g_current->locals[g_current->local_count - 1].depth > g_current->scope_depth) {
+	Compiler *current = g_ctx->current;
+	current->scope_depth--;
+	while (current->local_count > 0 && current->locals[current->local_count - 1].depth > current->scope_depth) {
+		if (current->locals[current->local_count - 1].depth > current->scope_depth) {
 			emit_byte(OP_CLOSE_UPVALUE);
 		} else {
 			emit_byte(OP_POP);
 		}
-		g_current->local_count--;
+		current->local_count--;
 	}
 }
 
@@ -262,8 +523,8 @@ static ParseRule *get_rule(TokenType type);
 static void parse_precedence(Precedence precedence);
 static void block();
 
-static uint8_t identifier_constant(Token *name) {
-	return make_constant(OBJ_VAL(copyString(name->start, name->length)));
+static int identifier_constant(Token *name) {
+	return string_constant(name->start, name->length);
 }
 
 static bool identifier_equal(Token *a, Token *b) {
@@ -272,14 +533,22 @@ static bool identifier_equal(Token *a, Token *b) {
 }
 
 static void add_local(Token name) {
-	if (g_current->local_count == UINT8_COUNT) {
-		error("Too amny local variables in function.");
+	Compiler *current = g_ctx->current;
+	if (current->local_count == UINT24_COUNT) {
+		error("Too many local variables in function.");
 		return;
 	}
-	Local *local       = &g_current->locals[g_current->local_count++];
+	if (current->local_capacity < current->local_count + 1) {
+		int old_capacity        = current->local_capacity;
+		current->local_capacity = GROW_CAPACITY(old_capacity);
+		current->locals         = GROW_ARRAY(Local, current->locals, old_capacity, current->local_capacity);
+	}
+	Local *local       = &current->locals[current->local_count++];
 	local->name        = name;
 	local->depth       = -1;
 	local->is_captured = false;
+	local->depends     = 0;
+	current->number_slots &= ~slot_bit(current->local_count - 1);
 }
 
 static int resolve_local(Compiler *compiler, Token *name) {
@@ -295,7 +564,7 @@ static int resolve_local(Compiler *compiler, Token *name) {
 	return -1;
 }
 
-static int add_upvalue(Compiler *compiler, uint8_t index, bool is_local) {
+static int add_upvalue(Compiler *compiler, int index, bool is_local) {
 	int upvalue_count = compiler->function->upvalue_count;
 	for (int i = 0; i < upvalue_count; i++) {
 		Upvalue *upvalue = &compiler->upvalues[i];
@@ -303,6 +572,15 @@ static int add_upvalue(Compiler *compiler, uint8_t index, bool is_local) {
 			return i;
 		}
 	}
+	if (upvalue_count == UINT24_COUNT) {
+		error("Too many closure variables in function.");
+		return 0;
+	}
+	if (compiler->upvalue_capacity < upvalue_count + 1) {
+		int old_capacity           = compiler->upvalue_capacity;
+		compiler->upvalue_capacity = GROW_CAPACITY(old_capacity);
+		compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues, old_capacity, compiler->upvalue_capacity);
+	}
 	compiler->upvalues[upvalue_count].is_local = is_local;
 	compiler->upvalues[upvalue_count].index    = index;
 	return compiler->function->upvalue_count++;
@@ -312,22 +590,24 @@ static int resolve_upvalue(Compiler *compiler, Token *name) {
 	if (compiler->enclosing == NULL) return -1;
 	int local = resolve_local(compiler->enclosing, name);
 	if (local != -1) {
+		// The closure may store anything in it.
 		compiler->enclosing->locals[local].is_captured = true;
-		return add_upvalue(compiler, (uint8_t)local, true);
+		forget_number(compiler->enclosing, local);
+		return add_upvalue(compiler, local, true);
 	}
 	int upvalue = resolve_upvalue(compiler->enclosing, name);
 	if (upvalue != -1) {
-		return add_upvalue(compiler, (uint8_t)upvalue, false);
+		return add_upvalue(compiler, upvalue, false);
 	}
 	return -1;
 }
 
 static void declare_variable() {
-	if (g_current->scope_depth == 0) return;
-	Token *name = &parser.previous;
-	for (int i = g_current->local_count - 1; i >= 0; i--) {
-		Local *local = &g_current->locals[i];
-		if (local->depth != -1 && local->depth < g_current->scope_depth) {
+	if (g_ctx->current->scope_depth == 0) return;
+	Token *name = &g_ctx->parser.previous;
+	for (int i = g_ctx->current->local_count - 1; i >= 0; i--) {
+		Local *local = &g_ctx->current->locals[i];
+		if (local->depth != -1 && local->depth < g_ctx->current->scope_depth) {
 			break;
 		}
 		if (identifier_equal(name, &local->name)) {
@@ -337,24 +617,40 @@ static void declare_variable() {
 	add_local(*name);
 }
 
-static uint8_t parse_variable(const char *err_msg) {
+static bool find_const_in(Table *consts, Token *name, Value *value) {
+	if (consts == NULL || consts->count == 0) return false;
+	ObjString *key = tableFindString(consts, name->start, name->length, hashString(name->start, name->length));
+	return key != NULL && tableGet(consts, key, value);
+}
+
+// A const declared by the script being compiled, or by one the VM has run.
+// Its value is nil when it wasn't known at compile time, and the global has
+// to be read instead. Workers only read g_vm.consts, which nothing changes
+// while they run.
+static bool find_const(Token *name, Value *value) {
+	return find_const_in(g_ctx->consts, name, value) || find_const_in(&g_vm.consts, name, value);
+}
+
+static int parse_variable(const char *err_msg) {
 	consume(TOKEN_IDENTIFIER, err_msg);
 	declare_variable();
-	if (g_current->scope_depth > 0) return 0;
-	return identifier_constant(&parser.previous);
+	if (g_ctx->current->scope_depth > 0) return 0;
+	Value value;
+	if (find_const(&g_ctx->parser.previous, &value)) error("Already a constant with this name.");
+	return identifier_constant(&g_ctx->parser.previous);
 }
 
 static void mark_initialized() {
-	if (g_current->scope_depth == 0) return;
-	g_current->locals[g_current->local_count - 1].depth = g_current->scope_depth;
+	if (g_ctx->current->scope_depth == 0) return;
+	g_ctx->current->locals[g_ctx->current->local_count - 1].depth = g_ctx->current->scope_depth;
 }
 
-static void define_variable(uint8_t global) {
-	if (g_current->scope_depth > 0) {
+static void define_variable(int global) {
+	if (g_ctx->current->scope_depth > 0) {
 		mark_initialized();
 		return;
 	}
-	emit_bytes(OP_DEFINE_GLOBAL, global);
+	emit_indexed(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argument_list() {
@@ -377,10 +673,133 @@ static void and_(bool can_assign) {
 	patch_jump(end_jump);
 }
 
+// True when code[start, end) is exactly one instruction pushing a constant
+// that no jump lands inside of or right after.
+static bool constant_at(int start, int end, Value *value) {
+	if (g_ctx->current->jump_target > start) return false;
+	uint8_t *code = current_chunk()->code + start;
+	Value *pool   = current_chunk()->constants.values;
+	switch (end - start) {
+		case 1:
+			if (code[0] == OP_NIL) {
+				*value = NIL_VAL;
+			} else if (code[0] == OP_TRUE || code[0] == OP_FALSE) {
+				*value = BOOL_VAL(code[0] == OP_TRUE);
+			} else {
+				return false;
+			}
+			return true;
+		case 2:
+			if (code[0] != OP_CONSTANT) return false;
+			*value = pool[code[1]];
+			return true;
+		case 5:
+			if (code[0] != OP_WIDE || code[1] != OP_CONSTANT) return false;
+			*value = pool[code[2] | (code[3] << 8) | (code[4] << 16)];
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool is_falsey(Value value) {
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static void emit_value(Value value) {
+	if (IS_NIL(value)) {
+		emit_byte(OP_NIL);
+	} else if (IS_BOOL(value)) {
+		emit_byte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+	} else {
+		emit_constant(value);
+	}
+}
+
+// Replace both operands by the result when they are literals. The arithmetic
+// is the same C double arithmetic run() would do, so results match bit for bit.
+// Operations that would raise a runtime error are left alone.
+// `lhs_number` is whether the left operand is a number without assuming
+// anything about locals.
+static bool fold_binary(TokenType operator_type, int lhs_start, int rhs_start, bool lhs_number) {
+	Value a, b;
+	int end = current_chunk()->count;
+	if (!constant_at(rhs_start, end, &b)) return false;
+	if (!constant_at(lhs_start, rhs_start, &a)) {
+		// x * 1, x / 1 and x - 0 give back x unchanged for every number, but the
+		// op is only dropped when x is known to be one, to keep the type error.
+		if (!IS_NUMBER(b) || !lhs_number) return false;
+		double y = AS_NUMBER(b), zero = 0;
+		bool identity = ((operator_type == TOKEN_STAR || operator_type == TOKEN_SLASH) && y == 1) ||
+		                (operator_type == TOKEN_MINUS && memcmp(&y, &zero, sizeof(double)) == 0);
+		if (!identity) return false;
+		rewind_code(rhs_start);
+		left_number(0);
+		return true;
+	}
+
+	Value result;
+	if (operator_type == TOKEN_EQUAL_EQUAL || operator_type == TOKEN_BANG_EQUAL) {
+		result = BOOL_VAL(values_equal(a, b) == (operator_type == TOKEN_EQUAL_EQUAL));
+	} else if (operator_type == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+		ObjString *x = AS_STRING(a);
+		ObjString *y = AS_STRING(b);
+		int length   = x->length + y->length;
+		char *chars  = ALLOCATE(char, length + 1);
+		memcpy(chars, x->chars, x->length);
+		memcpy(chars + x->length, y->chars, y->length);
+		chars[length] = '\0';
+		result        = OBJ_VAL(takeString(chars, length));
+	} else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+		double x = AS_NUMBER(a), y = AS_NUMBER(b);
+		switch (operator_type) {
+			case TOKEN_GREATER:
+				result = BOOL_VAL(x > y);
+				break;
+			case TOKEN_GREATER_EQUAL:
+				result = BOOL_VAL(!(x < y));
+				break;
+			case TOKEN_LESS:
+				result = BOOL_VAL(x < y);
+				break;
+			case TOKEN_LESS_EQUAL:
+				result = BOOL_VAL(!(x > y));
+				break;
+			case TOKEN_PLUS:
+				result = NUMBER_VAL(x + y);
+				break;
+			case TOKEN_MINUS:
+				result = NUMBER_VAL(x - y);
+				break;
+			case TOKEN_STAR:
+				result = NUMBER_VAL(x * y);
+				break;
+			case TOKEN_SLASH:
+				result = NUMBER_VAL(x / y);
+				break;
+			default:
+				return false;
+		}
+	} else {
+		return false;
+	}
+	rewind_code(lhs_start);
+	emit_value(result);
+	return true;
+}
+
 static void binary(bool can_assign) {
-	TokenType operator_type = parser.previous.type;
+	TokenType operator_type = g_ctx->parser.previous.type;
 	ParseRule *rule         = get_rule(operator_type);
+	int lhs_start           = g_ctx->current->operand_start;
+	int rhs_start           = current_chunk()->count;
+	uint64_t lhs_deps       = 0;
+	bool lhs_number         = leaves_number(rhs_start, &lhs_deps);
 	parse_precedence((Precedence)(rule->precedence + 1));
+	if (fold_binary(operator_type, lhs_start, rhs_start, lhs_number && lhs_deps == 0)) return;
+	uint64_t rhs_deps = 0;
+	bool numbers      = lhs_number && leaves_number(current_chunk()->count, &rhs_deps);
+	uint64_t deps     = lhs_deps | rhs_deps;
 	switch (operator_type) {
 		case TOKEN_BANG_EQUAL:
 			emit_bytes(OP_EQUAL, OP_NOT);
@@ -389,28 +808,36 @@ static void binary(bool can_assign) {
 			emit_byte(OP_EQUAL);
 			break;
 		case TOKEN_GREATER:
-			emit_byte(OP_GREATER);
+			emit_typed(OP_GREATER, OP_GREATER_NUMBER, numbers, deps);
 			break;
 		case TOKEN_GREATER_EQUAL:
-			emit_bytes(OP_LESS, OP_NOT);
+			emit_typed(OP_LESS, OP_LESS_NUMBER, numbers, deps);
+			emit_byte(OP_NOT);
 			break;
 		case TOKEN_LESS:
-			emit_byte(OP_LESS);
+			emit_typed(OP_LESS, OP_LESS_NUMBER, numbers, deps);
 			break;
 		case TOKEN_LESS_EQUAL:
-			emit_bytes(OP_GREATER, OP_NOT);
+			emit_typed(OP_GREATER, OP_GREATER_NUMBER, numbers, deps);
+			emit_byte(OP_NOT);
 			break;
 		case TOKEN_PLUS:
-			emit_byte(OP_ADD);
+			// Two strings are concatenated, so the result is only a number if the
+			// operands are.
+			emit_typed(OP_ADD, OP_ADD_NUMBER, numbers, deps);
+			if (numbers) left_number(deps);
 			break;
 		case TOKEN_MINUS:
-			emit_byte(OP_SUBTRACT);
+			emit_typed(OP_SUBTRACT, OP_SUBTRACT_NUMBER, numbers, deps);
+			left_number(0);
 			break;
 		case TOKEN_STAR:
-			emit_byte(OP_MULTIPLY);
+			emit_typed(OP_MULTIPLY, OP_MULTIPLY_NUMBER, numbers, deps);
+			left_number(0);
 			break;
 		case TOKEN_SLASH:
-			emit_byte(OP_DIVIDE);
+			emit_typed(OP_DIVIDE, OP_DIVIDE_NUMBER, numbers, deps);
+			left_number(0);
 			break;
 		default:
 			return;
@@ -424,22 +851,22 @@ static void call(bool can_assign) {
 
 static void dot(bool can_assign) {
 	consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-	uint8_t name = identifier_constant(&parser.previous);
+	int name = identifier_constant(&g_ctx->parser.previous);
 
 	if (can_assign && match(TOKEN_EQUAL)) {
 		expression();
-		emit_bytes(OP_SET_PROPERTY, name);
+		emit_indexed(OP_SET_PROPERTY, name);
 	} else if (match(TOKEN_LEFT_BRACE)) {
 		uint8_t arg_count = argument_list();
-		emit_bytes(OP_INVOKE, name);
+		emit_indexed(OP_INVOKE, name);
 		emit_byte(arg_count);
 	} else {
-		emit_bytes(OP_GET_PROPERTY, name);
+		emit_indexed(OP_GET_PROPERTY, name);
 	}
 }
 
 static void literal(bool can_assign) {
-	switch (parser.previous.type) {
+	switch (g_ctx->parser.previous.type) {
 		case TOKEN_FALSE:
 			emit_byte(OP_FALSE);
 			break;
@@ -460,7 +887,7 @@ static void grouping(bool can_assign) {
 }
 
 static void number(bool can_assign) {
-	double value = strtod(parser.previous.start, NULL);
+	double value = token_number(&g_ctx->parser.previous);
 	emit_constant(NUMBER_VAL(value));
 }
 
@@ -474,18 +901,54 @@ static void or_(bool can_assign) {
 }
 
 static void string(bool can_assign) {
-	emit_constant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+	emit_indexed(OP_CONSTANT, string_constant(g_ctx->parser.previous.start + 1, g_ctx->parser.previous.length - 2));
+}
+
+// Pushes the text of a string part, dropping its delimiters: the opening '"'
+// or '}', and the closing '"' or "${". Empty parts push nothing.
+static int string_part(Token *part) {
+	int trailing = part->type == TOKEN_INTERPOLATION ? 2 : 1;
+	int length   = part->length - 1 - trailing;
+	if (length == 0) return 0;
+	emit_indexed(OP_CONSTANT, string_constant(part->start + 1, length));
+	return 1;
+}
+
+// "a ${b} c" pushes each part and joins them with a single OP_BUILD_STRING,
+// rather than concatenating intermediate strings.
+static void interpolation(bool can_assign) {
+	int count = 0;
+	do {
+		count += string_part(&g_ctx->parser.previous);
+		expression();
+		count++;
+	} while (match(TOKEN_INTERPOLATION));
+	consume(TOKEN_STRING, "Expect '\"' after interpolated expression.");
+	if (g_ctx->parser.previous.type == TOKEN_STRING) count += string_part(&g_ctx->parser.previous);
+	if (count > 255) error("Can't interpolate more than 255 parts.");
+	emit_bytes(OP_BUILD_STRING, count);
 }
 
 static void named_variable(Token name, bool can_assign) {
 	uint8_t getOp, setOp;
-	int arg = resolve_local(g_current, &name);
+	Value value;
+	int arg = resolve_local(g_ctx->current, &name);
 	if (arg != -1) {
 		getOp = OP_GET_LOCAL;
 		setOp = OP_SET_LOCAL;
-	} else if ((arg = resolve_upvalue(g_current, &name)) != -1) {
+	} else if ((arg = resolve_upvalue(g_ctx->current, &name)) != -1) {
 		getOp = OP_GET_UPVALUE;
 		setOp = OP_SET_UPVALUE;
+	} else if (find_const(&name, &value)) {
+		if (can_assign && check(TOKEN_EQUAL)) {
+			error("Can't assign to a constant.");
+		} else if (!IS_NIL(value)) {
+			emit_value(value);
+			return;
+		}
+		arg   = identifier_constant(&name);
+		getOp = OP_GET_GLOBAL;
+		setOp = OP_SET_GLOBAL;
 	} else {
 		arg   = identifier_constant(&name);
 		getOp = OP_GET_GLOBAL;
@@ -493,14 +956,19 @@ static void named_variable(Token name, bool can_assign) {
 	}
 	if (can_assign && match(TOKEN_EQUAL)) {
 		expression();
-		emit_bytes(setOp, arg);
+		uint64_t deps = 0;
+		bool number   = getOp == OP_GET_LOCAL && leaves_number(current_chunk()->count, &deps);
+		if (getOp == OP_GET_LOCAL) stored_local(arg);
+		emit_indexed(setOp, arg);
+		if (number) left_number(deps);
 	} else {
-		emit_bytes(getOp, arg);
+		emit_indexed(getOp, arg);
+		if (getOp == OP_GET_LOCAL && (g_ctx->current->number_slots & slot_bit(arg))) left_number(slot_bit(arg));
 	}
 }
 
 static void variable(bool can_assign) {
-	named_variable(parser.previous, can_assign);
+	named_variable(g_ctx->parser.previous, can_assign);
 }
 
 static Token synthetic_token(const char *text) {
@@ -511,28 +979,28 @@ static Token synthetic_token(const char *text) {
 }
 
 static void super_(bool can_assign) {
-	if (g_current_class == NULL) {
+	if (g_ctx->current_class == NULL) {
 		error("Cannot use 'super' outside of a class.");
-	} else if (!g_current_class->has_superclass) {
+	} else if (!g_ctx->current_class->has_superclass) {
 		error("Cannot use 'super' in a class with no superclass.");
 	}
 	consume(TOKEN_DOT, "Expect '.' after 'super'.");
 	consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-	uint8_t name = identifier_constant(&parser.previous);
+	int name = identifier_constant(&g_ctx->parser.previous);
 	named_variable(synthetic_token("this"), false);
 	if (match(TOKEN_LEFT_PAREN)) {
 		uint8_t arg_count = argument_list();
 		named_variable(synthetic_token("super"), false);
-		emit_bytes(OP_SUPER_INVOKE, name);
+		emit_indexed(OP_SUPER_INVOKE, name);
 		emit_byte(arg_count);
 	} else {
 		named_variable(synthetic_token("super"), false);
-		emit_bytes(OP_GET_SUPER, name);
+		emit_indexed(OP_GET_SUPER, name);
 	}
 }
 
 static void this_(bool can_assign) {
-	if (g_current_class == NULL) {
+	if (g_ctx->current_class == NULL) {
 		error("Can't use 'this' outside of a class.");
 		return;
 	}
@@ -540,14 +1008,31 @@ static void this_(bool can_assign) {
 }
 
 static void unary(bool can_assign) {
-	TokenType operator_type = parser.previous.type;
+	TokenType operator_type = g_ctx->parser.previous.type;
+	int start               = current_chunk()->count;
 	parse_precedence(PREC_UNARY);
+	uint64_t deps = 0;
+	bool number   = leaves_number(current_chunk()->count, &deps);
+	Value value;
+	if (constant_at(start, current_chunk()->count, &value)) {
+		if (operator_type == TOKEN_BANG) {
+			rewind_code(start);
+			emit_value(BOOL_VAL(is_falsey(value)));
+			return;
+		}
+		if (operator_type == TOKEN_MINUS && IS_NUMBER(value)) {
+			rewind_code(start);
+			emit_constant(NUMBER_VAL(-AS_NUMBER(value)));
+			return;
+		}
+	}
 	switch (operator_type) {
 		case TOKEN_BANG:
 			emit_byte(OP_NOT);
 			break;
 		case TOKEN_MINUS:
-			emit_byte(OP_NEGATE);
+			emit_typed(OP_NEGATE, OP_NEGATE_NUMBER, number, deps);
+			left_number(0);
 			break;
 		default:
 			return;
@@ -555,60 +1040,65 @@ static void unary(bool can_assign) {
 }
 
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL      },
-    [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL      },
-    [TOKEN_MINUS]         = {unary,    binary, PREC_TERM      },
-    [TOKEN_PLUS]          = {NULL,     binary, PREC_TERM      },
-    [TOKEN_SEMICOLON]     = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR    },
-    [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR    },
-    [TOKEN_BANG]          = {unary,    NULL,   PREC_NONE      },
-    [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_EQUALITY  },
-    [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_EQUAL_EQUAL]   = {NULL,     binary, PREC_EQUALITY  },
-    [TOKEN_GREATER]       = {NULL,     binary, PREC_COMPARISON},
-    [TOKEN_GREATER_EQUAL] = {NULL,     binary, PREC_COMPARISON},
-    [TOKEN_LESS]          = {NULL,     binary, PREC_COMPARISON},
-    [TOKEN_LESS_EQUAL]    = {NULL,     binary, PREC_COMPARISON},
-    [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE      },
-    [TOKEN_STRING]        = {string,   NULL,   PREC_NONE      },
-    [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE      },
-    [TOKEN_AND]           = {NULL,     and_,   PREC_AND       },
-    [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE      },
-    [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_NIL]           = {literal,  NULL,   PREC_NONE      },
-    [TOKEN_OR]            = {NULL,     or_,    PREC_OR        },
-    [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_SUPER]         = {super_,   NULL,   PREC_NONE      },
-    [TOKEN_THIS]          = {this_,    NULL,   PREC_NONE      },
-    [TOKEN_TRUE]          = {literal,  NULL,   PREC_NONE      },
-    [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_ERROR]         = {NULL,     NULL,   PREC_NONE      },
-    [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE      },
+    [TOKEN_LEFT_PAREN]    = {grouping,      call,   PREC_CALL      },
+    [TOKEN_RIGHT_PAREN]   = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_LEFT_BRACE]    = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_RIGHT_BRACE]   = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_COMMA]         = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_DOT]           = {NULL,          dot,    PREC_CALL      },
+    [TOKEN_MINUS]         = {unary,         binary, PREC_TERM      },
+    [TOKEN_PLUS]          = {NULL,          binary, PREC_TERM      },
+    [TOKEN_SEMICOLON]     = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_SLASH]         = {NULL,          binary, PREC_FACTOR    },
+    [TOKEN_STAR]          = {NULL,          binary, PREC_FACTOR    },
+    [TOKEN_BANG]          = {unary,         NULL,   PREC_NONE      },
+    [TOKEN_BANG_EQUAL]    = {NULL,          binary, PREC_EQUALITY  },
+    [TOKEN_EQUAL]         = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_EQUAL_EQUAL]   = {NULL,          binary, PREC_EQUALITY  },
+    [TOKEN_GREATER]       = {NULL,          binary, PREC_COMPARISON},
+    [TOKEN_GREATER_EQUAL] = {NULL,          binary, PREC_COMPARISON},
+    [TOKEN_LESS]          = {NULL,          binary, PREC_COMPARISON},
+    [TOKEN_LESS_EQUAL]    = {NULL,          binary, PREC_COMPARISON},
+    [TOKEN_IDENTIFIER]    = {variable,      NULL,   PREC_NONE      },
+    [TOKEN_STRING]        = {string,        NULL,   PREC_NONE      },
+    [TOKEN_INTERPOLATION] = {interpolation, NULL,   PREC_NONE      },
+    [TOKEN_NUMBER]        = {number,        NULL,   PREC_NONE      },
+    [TOKEN_AND]           = {NULL,          and_,   PREC_AND       },
+    [TOKEN_CLASS]         = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_CONST]         = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_ELSE]          = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_FALSE]         = {literal,       NULL,   PREC_NONE      },
+    [TOKEN_FOR]           = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_FUN]           = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_IF]            = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_IMPORT]        = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_NIL]           = {literal,       NULL,   PREC_NONE      },
+    [TOKEN_OR]            = {NULL,          or_,    PREC_OR        },
+    [TOKEN_PRINT]         = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_RETURN]        = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_SUPER]         = {super_,        NULL,   PREC_NONE      },
+    [TOKEN_THIS]          = {this_,         NULL,   PREC_NONE      },
+    [TOKEN_TRUE]          = {literal,       NULL,   PREC_NONE      },
+    [TOKEN_VAR]           = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_WHILE]         = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_ERROR]         = {NULL,          NULL,   PREC_NONE      },
+    [TOKEN_EOF]           = {NULL,          NULL,   PREC_NONE      },
 };
 
 static void parse_precedence(Precedence precedence) {
 	advance();
-	ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
+	ParseFn prefix_rule = get_rule(g_ctx->parser.previous.type)->prefix;
 	if (prefix_rule == NULL) {
 		error("Expect expression.");
 		return;
 	}
 	bool can_assign = precedence <= PREC_ASSIGNMENT;
+	int start       = current_chunk()->count;
 	prefix_rule(can_assign);
-	while (precedence <= get_rule(parser.current.type)->precedence) {
+	while (precedence <= get_rule(g_ctx->parser.current.type)->precedence) {
 		advance();
-		ParseFn infix_rule = get_rule(parser.previous.type)->infix;
+		ParseFn infix_rule       = get_rule(g_ctx->parser.previous.type)->infix;
+		g_ctx->current->operand_start = start;
 		infix_rule(can_assign);
 	}
 	if (can_assign && match(TOKEN_EQUAL)) {
@@ -624,6 +1114,16 @@ static void expression() {
 	parse_precedence(PREC_ASSIGNMENT);
 }
 
+// The module leaves its result on the stack like a call, nil if it was
+// already loaded.
+static void import_statement() {
+	consume(TOKEN_STRING, "Expect module path after 'import'.");
+	Token *path = &g_ctx->parser.previous;
+	emit_indexed(OP_IMPORT, string_constant(path->start + 1, path->length - 2));
+	consume(TOKEN_SEMICOLON, "Expect ';' after module path.");
+	emit_byte(OP_POP);
+}
+
 static void print_statement() {
 	expression();
 	consume(TOKEN_SEMICOLON, "Expect ';' after value.");
@@ -631,13 +1131,13 @@ static void print_statement() {
 }
 
 static void return_statement() {
-	if (g_current->type == TYPE_SCRIPT) {
+	if (g_ctx->current->type == TYPE_SCRIPT) {
 		error("Can't return from top-level code.");
 	}
 	if (match(TOKEN_SEMICOLON)) {
 		emit_return();
 	} else {
-		if (g_current->type == TYPE_INITIALIZER) {
+		if (g_ctx->current->type == TYPE_INITIALIZER) {
 			error("Can't return a value from a initializer.");
 		}
 		expression();
@@ -660,15 +1160,17 @@ static void while_statement() {
 }
 
 static void synchronize() {
-	parser.panic_mode = false;
-	while (parser.current.type != TOKEN_EOF) {
-		if (parser.previous.type == TOKEN_SEMICOLON) return;
-		switch (parser.current.type) {
+	g_ctx->parser.panic_mode = false;
+	while (g_ctx->parser.current.type != TOKEN_EOF) {
+		if (g_ctx->parser.previous.type == TOKEN_SEMICOLON) return;
+		switch (g_ctx->parser.current.type) {
 			case TOKEN_CLASS:
+			case TOKEN_CONST:
 			case TOKEN_FUN:
 			case TOKEN_VAR:
 			case TOKEN_FOR:
 			case TOKEN_IF:
+			case TOKEN_IMPORT:
 			case TOKEN_WHILE:
 			case TOKEN_PRINT:
 			case TOKEN_RETURN:
@@ -680,9 +1182,10 @@ static void synchronize() {
 }
 
 static void var_declaration() {
-	uint8_t global = parse_variable("Expect variable name");
+	int global = parse_variable("Expect variable name");
 	if (match(TOKEN_EQUAL)) {
 		expression();
+		if (g_ctx->current->scope_depth > 0) stored_local(g_ctx->current->local_count - 1);
 	} else {
 		emit_byte(OP_NIL);
 	}
@@ -690,62 +1193,140 @@ static void var_declaration() {
 	define_variable(global);
 }
 
-static void function(FunctionType type) {
-	Compiler compiler;
-	init_compiler(&compiler, type);
-	begin_scope();
+// Skip to the '}' closing a block whose '{' was just consumed.
+static void skip_block() {
+	for (int depth = 1; depth > 0 && !check(TOKEN_EOF);) {
+		if (check(TOKEN_LEFT_BRACE)) depth++;
+		if (check(TOKEN_RIGHT_BRACE)) depth--;
+		advance();
+	}
+}
 
+// After an error in a function's header, skip its body whole, so parsing goes
+// on from the next declaration or method.
+static void skip_body() {
+	if (g_ctx->parser.previous.type != TOKEN_LEFT_BRACE) {
+		while (!check(TOKEN_LEFT_BRACE) && !check(TOKEN_EOF)) advance();
+		if (!match(TOKEN_LEFT_BRACE)) return;
+	}
+	skip_block();
+}
+
+static void function_body() {
+	begin_scope();
 	consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 	if (!check(TOKEN_RIGHT_PAREN)) {
 		do {
-			g_current->function->arity++;
-			if (g_current->function->arity > 255) {
+			g_ctx->current->function->arity++;
+			if (g_ctx->current->function->arity > 255) {
 				error_at_current("Can't have more than 255 parameters.");
 			}
-			uint8_t constant = parse_variable("Expect paramter name.");
+			int constant = parse_variable("Expect paramter name.");
 			define_variable(constant);
 		} while (match(TOKEN_COMMA));
 	}
 	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
 	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+	if (g_ctx->parser.panic_mode) {
+		skip_body();
+		return;
+	}
 	block();
+}
+
+// A function declared at the top level of the script has no enclosing locals
+// to capture, so its body can wait until the first call. Check the parameter
+// list, skip the body by brace matching and keep a copy of its source.
+static bool defer_function(FunctionType type) {
+	if (g_ctx->eager || g_ctx->current->type != TYPE_SCRIPT || g_ctx->current->scope_depth != 0) return false;
+	if (!check(TOKEN_LEFT_PAREN)) return false;
+	Token name            = g_ctx->parser.previous;
+	const char *start     = g_ctx->parser.current.start;
+	int line              = g_ctx->parser.current.line;
+	ObjFunction *function = new_function();
+	int constant          = make_constant(OBJ_VAL(function));
+	function->name        = copyString(name.start, name.length);
+	function->kind        = type;
+	function->script      = g_ctx->current->function;
+	write_barrier((Obj *)function);
+
+	consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+	if (!check(TOKEN_RIGHT_PAREN)) {
+		int arity = 0;
+		do {
+			if (++arity > 255) error_at_current("Can't have more than 255 parameters.");
+			consume(TOKEN_IDENTIFIER, "Expect paramter name.");
+		} while (match(TOKEN_COMMA));
+	}
+	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+	if (g_ctx->parser.panic_mode) {
+		skip_body();
+		return true;
+	}
+	skip_block();
+	if (g_ctx->parser.previous.type != TOKEN_RIGHT_BRACE) error_at_current("Expect '}' after block.");
+
+	function->source_length = (int)(g_ctx->parser.previous.start + g_ctx->parser.previous.length - start);
+	function->source_line   = line;
+	function->source        = ALLOCATE(char, function->source_length + 1);
+	memcpy(function->source, start, function->source_length);
+	function->source[function->source_length] = '\0';
+	emit_indexed(OP_CLOSURE, constant);
+	return true;
+}
+
+static void function(FunctionType type) {
+	if (defer_function(type)) return;
+	Compiler compiler;
+	init_compiler(&compiler, type, NULL);
+	function_body();
 
 	ObjFunction *function = end_compiler();
-	emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+	int constant          = make_constant(OBJ_VAL(function));
+	bool wide             = constant > UINT8_MAX;
+	for (int i = 0; i < function->upvalue_count; i++) {
+		if (compiler.upvalues[i].index > UINT8_MAX) wide = true;
+	}
+	// OP_WIDE widens the upvalue indexes along with the constant.
+	if (wide) emit_byte(OP_WIDE);
+	emit_byte(OP_CLOSURE);
+	emit_operand(constant, wide);
 	for (int i = 0; i < function->upvalue_count; i++) {
 		emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-		emit_byte(compiler.upvalues[i].index);
+		emit_operand(compiler.upvalues[i].index, wide);
 	}
+	free_compiler(&compiler);
 }
 
 static void method() {
 	consume(TOKEN_IDENTIFIER, "Expect method name.");
-	uint8_t constant  = identifier_constant(&parser.previous);
+	int constant      = identifier_constant(&g_ctx->parser.previous);
 	FunctionType type = TYPE_METHOD;
-	if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+	if (g_ctx->parser.previous.length == 4 && memcmp(g_ctx->parser.previous.start, "init", 4) == 0) {
 		type = TYPE_INITIALIZER;
 	}
 	// printf("%u", type);
 	function(type);
-	emit_bytes(OP_METHOD, constant);
+	emit_indexed(OP_METHOD, constant);
 }
 
 static void class_declaration() {
 	consume(TOKEN_IDENTIFIER, "Expect class name.");
-	Token class_name   = parser.previous;
-	uint8_t name_const = identifier_constant(&parser.previous);
+	Token class_name   = g_ctx->parser.previous;
+	int name_const     = identifier_constant(&g_ctx->parser.previous);
 	declare_variable();
 
-	emit_bytes(OP_CLASS, name_const);
+	emit_indexed(OP_CLASS, name_const);
 	define_variable(name_const);
 	ClassCompiler class_compiler;
 	class_compiler.has_superclass = false;
-	class_compiler.enclosing      = g_current_class;
-	g_current_class               = &class_compiler;
+	class_compiler.enclosing      = g_ctx->current_class;
+	g_ctx->current_class          = &class_compiler;
 	if (match(TOKEN_LESS)) {
 		consume(TOKEN_IDENTIFIER, "Expect superclass name.");
 		variable(false);
-		if (identifier_equal(&class_name, &parser.previous)) {
+		if (identifier_equal(&class_name, &g_ctx->parser.previous)) {
 			error("A class cannot inherit from itself.");
 		}
 		begin_scope();
@@ -766,19 +1347,41 @@ static void class_declaration() {
 	if (class_compiler.has_superclass) {
 		end_scope();
 	}
-	g_current_class = g_current_class->enclosing;
+	g_ctx->current_class = g_ctx->current_class->enclosing;
 }
 
 static void fun_declaration() {
-	uint8_t global = parse_variable("Expect function name.");
+	int global = parse_variable("Expect function name.");
 	mark_initialized();
 	function(TYPE_FUNCTION);
 	define_variable(global);
 }
 
+// const NAME = expression; at the top level of a script. The name can't be
+// assigned again. It is still defined as a global, but when the initializer
+// folds to a literal, uses are compiled to the literal itself.
+static void const_declaration() {
+	if (g_ctx->current->type != TYPE_SCRIPT || g_ctx->current->scope_depth > 0) {
+		error("Can only declare constants at the top level.");
+		return;
+	}
+	int global = parse_variable("Expect constant name.");
+	Value value;
+	ObjString *name = AS_STRING(current_chunk()->constants.values[global]);
+	consume(TOKEN_EQUAL, "Expect '=' after constant name.");
+	int start = current_chunk()->count;
+	expression();
+	if (!constant_at(start, current_chunk()->count, &value)) value = NIL_VAL;
+	consume(TOKEN_SEMICOLON, "Expect ';' after constant declaration.");
+	define_variable(global);
+	if (g_ctx->consts != NULL) tableSet(g_ctx->consts, name, value);
+}
+
 static void declaration() {
 	if (match(TOKEN_CLASS)) {
 		class_declaration();
+	} else if (match(TOKEN_CONST)) {
+		const_declaration();
 	} else if (match(TOKEN_FUN)) {
 		fun_declaration();
 	} else if (match(TOKEN_VAR)) {
@@ -786,7 +1389,7 @@ static void declaration() {
 	} else {
 		statement();
 	}
-	if (parser.panic_mode) synchronize();
+	if (g_ctx->parser.panic_mode) synchronize();
 }
 
 static void block() {
@@ -860,6 +1463,8 @@ static void if_statement() {
 static void statement() {
 	if (match(TOKEN_PRINT)) {
 		print_statement();
+	} else if (match(TOKEN_IMPORT)) {
+		import_statement();
 	} else if (match(TOKEN_FOR)) {
 		for_statement();
 	} else if (match(TOKEN_IF)) {
@@ -877,24 +1482,213 @@ static void statement() {
 	}
 }
 
-ObjFunction *compile(const char *src) {
-	init_scanner(src);
+static void begin_context(CompileContext *ctx, const char *src, size_t length, int line) {
+	init_scanner(&ctx->scanner, src, length, line);
+	ctx->parser.had_err    = false;
+	ctx->parser.panic_mode = false;
+	ctx->current           = NULL;
+	ctx->current_class     = NULL;
+	ctx->eager             = g_debug.eager_compile;
+	ctx->consts            = NULL;
+	ctx->enclosing         = g_ctx;
+	g_ctx                  = ctx;
+}
+
+static void end_context() {
+	g_ctx = g_ctx->enclosing;
+}
+
+static ObjFunction *compile_script(const char *src, size_t length, int line, bool eager) {
+	CompileContext ctx;
+	begin_context(&ctx, src, length, line);
+	ctx.eager = ctx.eager || eager;
 	Compiler compiler;
-	init_compiler(&compiler, TYPE_SCRIPT);
-	parser.had_err    = false;
-	parser.panic_mode = false;
+	init_compiler(&compiler, TYPE_SCRIPT, NULL);
+	ctx.consts = &compiler.function->consts;
 	advance();
 	while (!match(TOKEN_EOF)) {
 		declaration();
 	}
 	ObjFunction *function = end_compiler();
-	return parser.had_err ? NULL : function;
+	free_compiler(&compiler);
+	end_context();
+	return ctx.parser.had_err ? NULL : function;
+}
+
+// `line` is where `src` starts, for a source that arrives in parts.
+ObjFunction *compile(const char *src, size_t length, int line) {
+	return compile_script(src, length, line, false);
+}
+
+// For code about to be cached, where deferring bodies would only push their
+// compilation into every later run.
+ObjFunction *compile_eager(const char *src, size_t length) {
+	return compile_script(src, length, 1, true);
+}
+
+// How much of `src` is whole top-level declarations, for compiling a stream
+// as it arrives. A declaration ends at a ';' or '}' outside any brackets. If
+// it has an `if` at that level, an `else` may still follow, so the next token
+// decides. A token running into the end of what has arrived may be cut off;
+// at the end of the stream everything counts.
+size_t complete_declarations(const char *src, size_t length, bool final) {
+	if (final) return length;
+	Scanner scanner;
+	init_scanner(&scanner, src, length, 1);
+	const char *end = src + length;
+	size_t complete = 0;
+	int depth       = 0;
+	bool has_if     = false;
+	bool pending    = false;  // at a boundary, unless an else follows
+	for (;;) {
+		Token token = scan_token(&scanner);
+		// An error here may be a string or comment cut off mid-way.
+		if (token.type == TOKEN_EOF || token.type == TOKEN_ERROR) break;
+		bool cut = token.start + token.length == end;
+		if (cut && token.type != TOKEN_SEMICOLON && token.type != TOKEN_RIGHT_BRACE) break;
+		if (pending) {
+			pending = false;
+			if (token.type != TOKEN_ELSE) {
+				complete = token.start - src;
+				has_if   = false;
+			}
+		}
+		bool boundary = false;
+		switch (token.type) {
+			case TOKEN_LEFT_PAREN:
+			case TOKEN_LEFT_BRACE:
+				depth++;
+				break;
+			case TOKEN_RIGHT_PAREN:
+				depth--;
+				break;
+			case TOKEN_RIGHT_BRACE:
+				boundary = --depth == 0;
+				break;
+			case TOKEN_SEMICOLON:
+				boundary = depth == 0;
+				break;
+			case TOKEN_IF:
+				if (depth == 0) has_if = true;
+				break;
+			default:;
+		}
+		if (boundary && has_if) {
+			pending = true;
+		} else if (boundary) {
+			complete = token.start + token.length - src;
+		}
+	}
+	return complete;
+}
+
+// Compile a body skipped by defer_function(), on its first call. Errors in
+// the body are only reported then, as a runtime error of the call, and not at
+// all for a function never called. A script compiled for the bytecode cache
+// has every body compiled up front, see compile_cached(), so run from a file
+// with the cache on the same errors stop it from compiling instead.
+bool compile_body(ObjFunction *function) {
+	CompileContext ctx;
+	begin_context(&ctx, function->source, function->source_length, function->source_line);
+	if (function->script != NULL) ctx.consts = &function->script->consts;
+	ClassCompiler class_compiler;
+	class_compiler.enclosing      = NULL;
+	class_compiler.has_superclass = false;
+	FunctionType type             = (FunctionType)function->kind;
+	if (type == TYPE_METHOD || type == TYPE_INITIALIZER) ctx.current_class = &class_compiler;
+	function->arity = 0;
+	Compiler compiler;
+	init_compiler(&compiler, type, function);
+	advance();
+	function_body();
+	end_compiler();
+	free_compiler(&compiler);
+	end_context();
+	if (ctx.parser.had_err) {
+		free_chunk(&function->chunk);
+		return false;
+	}
+	FREE_ARRAY(char, function->source, function->source_length + 1);
+	function->source = NULL;
+	return true;
+}
+
+typedef struct {
+	const char **sources;
+	const size_t *lengths;
+	ObjFunction **functions;
+	int count;
+	atomic_int next;
+} CompileBatch;
+
+typedef struct {
+	CompileBatch *batch;
+	Heap heap;
+	pthread_t thread;
+} CompileWorker;
+
+static void *compile_worker(void *arg) {
+	CompileWorker *worker = (CompileWorker *)arg;
+	CompileBatch *batch   = worker->batch;
+	g_heap                = &worker->heap;
+	for (;;) {
+		int i = atomic_fetch_add(&batch->next, 1);
+		if (i >= batch->count) break;
+		batch->functions[i] = compile(batch->sources[i], batch->lengths[i], 1);
+	}
+	g_heap = NULL;
+	return NULL;
+}
+
+// Compile `count` sources on up to `threads` threads, the calling one included.
+// Each worker allocates into a private heap, which is merged into the VM once
+// all of them are done; the VM must stay idle until then, since workers read
+// its intern table. Fails if any source does; functions[i] is NULL for those.
+bool compile_all(const char **sources, const size_t *lengths, int count, ObjFunction **functions, int threads) {
+	CompileBatch batch;
+	batch.sources   = sources;
+	batch.lengths   = lengths;
+	batch.functions = functions;
+	batch.count     = count;
+	atomic_init(&batch.next, 0);
+	if (threads > count) threads = count;
+	if (threads < 1) threads = 1;
+
+	// Nor may the intern table hold strings a sweep is about to free.
+	finish_collection();
+	CompileWorker *workers = (CompileWorker *)malloc(sizeof(CompileWorker) * threads);
+	if (workers == NULL) exit(1);
+	int started = 1;
+	for (int i = 0; i < threads; i++) {
+		workers[i].batch = &batch;
+		init_heap(&workers[i].heap);
+	}
+	// A thread that fails to start just leaves more work for the others.
+	for (; started < threads; started++) {
+		if (pthread_create(&workers[started].thread, NULL, compile_worker, &workers[started]) != 0) break;
+	}
+	compile_worker(&workers[0]);
+	for (int i = 1; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	for (int i = 0; i < threads; i++) {
+		merge_heap(&workers[i].heap);
+	}
+	free(workers);
+
+	bool ok = true;
+	for (int i = 0; i < count; i++) {
+		if (functions[i] == NULL) ok = false;
+	}
+	return ok;
 }
 
 void mark_compiler_roots() {
-	Compiler *compiler = g_current;
-	while (compiler != NULL) {
-		mark_object((Obj *)compiler->function);
-		compiler = compiler->enclosing;
+	for (CompileContext *ctx = g_ctx; ctx != NULL; ctx = ctx->enclosing) {
+		for (Compiler *compiler = ctx->current; compiler != NULL; compiler = compiler->enclosing) {
+			// Written to all through compiling, so a minor collection traces them too.
+			write_barrier((Obj *)compiler->function);
+			mark_object((Obj *)compiler->function);
+		}
 	}
 }
@@ -4,7 +4,11 @@
 #include "object.h"
 #include "vm.h"
 
-ObjFunction *compile(const char *src);
+ObjFunction *compile(const char *src, size_t length, int line);
+ObjFunction *compile_eager(const char *src, size_t length);
+size_t complete_declarations(const char *src, size_t length, bool final);
+bool compile_body(ObjFunction *function);
+bool compile_all(const char **sources, const size_t *lengths, int count, ObjFunction **functions, int threads);
 void mark_compiler_roots();
 
 #endif
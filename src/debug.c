@@ -2,11 +2,43 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "chunk.h"
 #include "object.h"
 #include "value.h"
 
+DebugFlags g_debug;
+
+static bool env_flag(const char *name) {
+	const char *value = getenv(name);
+	return value != NULL && value[0] != '\0' && value[0] != '0';
+}
+
+static int env_number(const char *name, int otherwise) {
+	const char *value = getenv(name);
+	int number        = value != NULL ? atoi(value) : 0;
+	return number > 0 ? number : otherwise;
+}
+
+void init_debug_flags() {
+	g_debug.print_code      = env_flag("CLOX_PRINT_CODE");
+	g_debug.trace_execution = env_flag("CLOX_TRACE_EXECUTION");
+	g_debug.stress_gc       = env_flag("CLOX_STRESS_GC");
+	g_debug.log_gc          = env_flag("CLOX_LOG_GC");
+	g_debug.no_peephole     = env_flag("CLOX_NO_PEEPHOLE");
+	g_debug.eager_compile   = env_flag("CLOX_EAGER_COMPILE");
+	g_debug.no_cache        = env_flag("CLOX_NO_CACHE");
+	g_debug.strip_debug     = env_flag("CLOX_STRIP_DEBUG");
+	g_debug.verify_stack    = env_flag("CLOX_VERIFY_STACK");
+	g_debug.no_jit          = env_flag("CLOX_NO_JIT");
+	g_debug.no_trace        = env_flag("CLOX_NO_TRACE");
+	g_debug.no_opt          = env_flag("CLOX_NO_OPT");
+	g_debug.gc_stats        = env_flag("CLOX_GC_STATS");
+	g_debug.gc_budget       = env_number("CLOX_GC_BUDGET", 1000);
+	g_debug.threads         = env_number("CLOX_THREADS", 0);
+}
+
 void disassemble_chunk(Chunk *chunk, const char *name) {
 	printf("==%s==\n", name);
 
@@ -15,30 +47,31 @@ void disassemble_chunk(Chunk *chunk, const char *name) {
 	}
 }
 
-static int constant_instruction(const char *name, Chunk *chunk, int offset) {
-	uint8_t const_idx = chunk->code[offset + 1];
+// Index operands are one byte, or three bytes low byte first behind OP_WIDE.
+static uint32_t read_operand(Chunk *chunk, int offset, bool wide) {
+	if (!wide) return chunk->code[offset];
+	return chunk->code[offset] | (chunk->code[offset + 1] << 8) | (chunk->code[offset + 2] << 16);
+}
+
+static int operand_size(bool wide) {
+	return wide ? 3 : 1;
+}
+
+static int constant_instruction(const char *name, Chunk *chunk, int offset, bool wide) {
+	uint32_t const_idx = read_operand(chunk, offset + 1, wide);
 	printf("%s\t%4d '", name, const_idx);
 	print_value(chunk->constants.values[const_idx]);
 	printf("'\n");
-	return offset + 2;
+	return offset + 1 + operand_size(wide);
 }
 
-static int invoke_instruction(const char *name, Chunk *chunk, int offset) {
-	uint8_t constant  = chunk->code[offset + 1];
-	uint8_t arg_count = chunk->code[offset + 2];
+static int invoke_instruction(const char *name, Chunk *chunk, int offset, bool wide) {
+	uint32_t constant = read_operand(chunk, offset + 1, wide);
+	uint8_t arg_count = chunk->code[offset + 1 + operand_size(wide)];
 	printf("%-16s (%d args) %4d '", name, arg_count, constant);
 	print_value(chunk->constants.values[constant]);
 	printf("\n");
-	return offset + 3;
-}
-
-static int constantLongInstruction(const char *name, Chunk *chunk, int offset) {
-	// merge 3 parts
-	uint32_t const_idx = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8) | (chunk->code[offset + 3] << 16);
-	printf("%s\t%4d '", name, const_idx);
-	print_value(chunk->constants.values[const_idx]);
-	printf("'\n");
-	return offset + 4;
+	return offset + 2 + operand_size(wide);
 }
 
 static int simple_instruction(const char *name, int offset) {
@@ -46,10 +79,10 @@ static int simple_instruction(const char *name, int offset) {
 	return offset + 1;
 }
 
-static int byte_instruction(const char *name, Chunk *chunk, int offset) {
-	uint8_t slot = chunk->code[offset + 1];
+static int byte_instruction(const char *name, Chunk *chunk, int offset, bool wide) {
+	uint32_t slot = read_operand(chunk, offset + 1, wide);
 	printf("%-16s %4d\n", name, slot);
-	return offset + 2;
+	return offset + 1 + operand_size(wide);
 }
 
 static int jump_instruction(const char *name, int sign, Chunk *chunk, int offset) {
@@ -62,18 +95,21 @@ static int jump_instruction(const char *name, int sign, Chunk *chunk, int offset
 int disassemble_instruction(Chunk *chunk, int offset) {
 	printf("%04d ", offset);
 
-	int curLine = getLineByNumber(&chunk->lines, offset);
-	if (offset > 0 && curLine == getLineByNumber(&chunk->lines, offset - 1)) {
+	int curLine = chunk_line(chunk, offset);
+	if (offset > 0 && curLine == chunk_line(chunk, offset - 1)) {
 		printf("\t| ");
 	} else {
 		printf("%4d ", curLine);
 	}
 	uint8_t instruction = chunk->code[offset];
+	bool wide           = instruction == OP_WIDE;
+	if (wide) {
+		printf("OP_WIDE ");
+		instruction = chunk->code[++offset];
+	}
 	switch (instruction) {
 		case OP_CONSTANT:
-			return constant_instruction("OP_CONSTANT", chunk, offset);
-		case OP_CONSTANT_LONG:
-			return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
+			return constant_instruction("OP_CONSTANT", chunk, offset, wide);
 		case OP_NIL:
 			return simple_instruction("OP_NIL", offset);
 		case OP_TRUE:
@@ -83,25 +119,25 @@ int disassemble_instruction(Chunk *chunk, int offset) {
 		case OP_POP:
 			return simple_instruction("OP_POP", offset);
 		case OP_GET_LOCAL:
-			return byte_instruction("OP_GET_LOCAL", chunk, offset);
+			return byte_instruction("OP_GET_LOCAL", chunk, offset, wide);
 		case OP_SET_LOCAL:
-			return byte_instruction("OP_SET_LOCAL", chunk, offset);
+			return byte_instruction("OP_SET_LOCAL", chunk, offset, wide);
 		case OP_GET_GLOBAL:
-			return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+			return constant_instruction("OP_GET_GLOBAL", chunk, offset, wide);
 		case OP_DEFINE_GLOBAL:
-			return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+			return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset, wide);
 		case OP_SET_GLOBAL:
-			return constant_instruction("OP_SET_GLOBAl", chunk, offset);
+			return constant_instruction("OP_SET_GLOBAl", chunk, offset, wide);
 		case OP_GET_UPVALUE:
-			return byte_instruction("OP_GET_UPVALUE", chunk, offset);
+			return byte_instruction("OP_GET_UPVALUE", chunk, offset, wide);
 		case OP_SET_UPVALUE:
-			return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+			return byte_instruction("OP_SET_UPVALUE", chunk, offset, wide);
 		case OP_GET_PROPERTY:
-			return constant_instruction("OP_GET_PROPERTY", chunk, offset);
+			return constant_instruction("OP_GET_PROPERTY", chunk, offset, wide);
 		case OP_SET_PROPERTY:
-			return constant_instruction("OP_SET_PROPERTY", chunk, offset);
+			return constant_instruction("OP_SET_PROPERTY", chunk, offset, wide);
 		case OP_GET_SUPER:
-			return constant_instruction("OP_GET_SUPER", chunk, offset);
+			return constant_instruction("OP_GET_SUPER", chunk, offset, wide);
 		case OP_EQUAL:
 			return simple_instruction("OP_EQUAL", offset);
 		case OP_GREATER:
@@ -126,25 +162,30 @@ int disassemble_instruction(Chunk *chunk, int offset) {
 			return jump_instruction("OP_JUMP", 1, chunk, offset);
 		case OP_JUMP_IF_FALSE:
 			return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+		case OP_JUMP_IF_TRUE:
+			return jump_instruction("OP_JUMP_IF_TRUE", 1, chunk, offset);
 		case OP_LOOP:
 			return jump_instruction("OP_LOOP", -1, chunk, offset);
 		case OP_CALL:
-			return byte_instruction("OP_CALL", chunk, offset);
+			return byte_instruction("OP_CALL", chunk, offset, wide);
 		case OP_INVOKE:
-			return invoke_instruction("OP_INVOKE", chunk, offset);
+			return invoke_instruction("OP_INVOKE", chunk, offset, wide);
 		case OP_SUPER_INVOKE:
-			return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+			return invoke_instruction("OP_SUPER_INVOKE", chunk, offset, wide);
 		case OP_CLOSURE: {
 			offset++;
-			uint8_t constant = chunk->code[offset++];
+			uint32_t constant = read_operand(chunk, offset, wide);
+			offset += operand_size(wide);
 			printf("%-16s %4d ", "OP_CLOSURE", constant);
 			print_value(chunk->constants.values[constant]);
 			printf("\n");
 			ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
 			for (int j = 0; j < function->upvalue_count; j++) {
+				int start    = offset;
 				int is_local = chunk->code[offset++];
-				int index    = chunk->code[offset++];
-				printf("%04d	|		%s %d\n", offset - 2, is_local ? "local" : "upvalue", index);
+				int index    = read_operand(chunk, offset, wide);
+				offset += operand_size(wide);
+				printf("%04d	|		%s %d\n", start, is_local ? "local" : "upvalue", index);
 			}
 			return offset;
 		}
@@ -153,11 +194,33 @@ int disassemble_instruction(Chunk *chunk, int offset) {
 		case OP_RETURN:
 			return simple_instruction("OP_RETURN", offset);
 		case OP_CLASS:
-			return constant_instruction("OP_CLASS", chunk, offset);
+			return constant_instruction("OP_CLASS", chunk, offset, wide);
 		case OP_INHERIT:
 			return simple_instruction("OP_INHERIT", offset);
 		case OP_METHOD:
-			return constant_instruction("OP_METHOD", chunk, offset);
+			return constant_instruction("OP_METHOD", chunk, offset, wide);
+		case OP_IMPORT:
+			return constant_instruction("OP_IMPORT", chunk, offset, wide);
+		case OP_BUILD_STRING:
+			return byte_instruction("OP_BUILD_STRING", chunk, offset, wide);
+		case OP_ADD_NUMBER:
+			return simple_instruction("OP_ADD_NUMBER", offset);
+		case OP_SUBTRACT_NUMBER:
+			return simple_instruction("OP_SUBTRACT_NUMBER", offset);
+		case OP_MULTIPLY_NUMBER:
+			return simple_instruction("OP_MULTIPLY_NUMBER", offset);
+		case OP_DIVIDE_NUMBER:
+			return simple_instruction("OP_DIVIDE_NUMBER", offset);
+		case OP_NEGATE_NUMBER:
+			return simple_instruction("OP_NEGATE_NUMBER", offset);
+		case OP_GREATER_NUMBER:
+			return simple_instruction("OP_GREATER_NUMBER", offset);
+		case OP_LESS_NUMBER:
+			return simple_instruction("OP_LESS_NUMBER", offset);
+		case OP_IS_NUMBER:
+			return byte_instruction("OP_IS_NUMBER", chunk, offset, wide);
+		case OP_NEW:
+			return simple_instruction("OP_NEW", offset);
 		default:
 			printf("Unknow opcode %d\n", instruction);
 			return offset + 1;
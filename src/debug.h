@@ -3,6 +3,28 @@
 
 #include "chunk.h"
 
+// Switched at run time, see init_debug_flags() for the environment variables.
+typedef struct {
+	bool print_code;
+	bool trace_execution;
+	bool stress_gc;
+	bool log_gc;
+	bool no_peephole;
+	bool eager_compile;
+	bool no_cache;
+	bool strip_debug;   // write cached bytecode with its line tables on the side
+	bool verify_stack;  // check stack depths as functions are compiled and run
+	bool no_jit;
+	bool no_trace;
+	bool no_opt;
+	bool gc_stats;  // print a histogram of collection pauses on exit
+	int gc_budget;  // objects a step of a major collection marks or sweeps
+	int threads;    // compiling several files, 0 means one per CPU
+} DebugFlags;
+
+extern DebugFlags g_debug;
+
+void init_debug_flags();
 void disassemble_chunk(Chunk *chunk, const char *name);
 int disassemble_instruction(Chunk *chunk, int offset);
 
@@ -0,0 +1,1144 @@
+#include "jit.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "table.h"
+#include "value.h"
+
+// Helpers for instructions that native code, from the JIT or compiled ahead of
+// time, doesn't run inline. They return the new stack top, or NULL when
+// they'd need anything but the fast path. The interpreter then runs that
+// instruction from the start, so a helper that gives up must not have changed
+// anything yet.
+
+static Value *sync_stack(Value *top) {
+	g_vm.stackCount = (int)(top - g_vm.stack);
+	return top;
+}
+
+static int leave(Value *top, int offset) {
+	sync_stack(top);
+	return offset;
+}
+
+static bool falsey(Value value) {
+	return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static Value *get_global(Value *top, uintptr_t name, CallFrame *frame) {
+	if (!tableGet(&g_vm.globals, (ObjString *)name, top)) return NULL;
+	return top + 1;
+}
+
+static Value *set_global(Value *top, uintptr_t name, CallFrame *frame) {
+	if (is_const((Obj *)name)) return NULL;
+	sync_stack(top);
+	if (tableSet(&g_vm.globals, (ObjString *)name, top[-1])) {
+		tableDel(&g_vm.globals, (ObjString *)name);
+		return NULL;
+	}
+	return top;
+}
+
+// A script's consts are declared by the interpreter, see declare_const().
+static Value *define_global(Value *top, uintptr_t name, CallFrame *frame) {
+	if (is_const((Obj *)name) || frame->closure->function->consts.count > 0) return NULL;
+	sync_stack(top);
+	tableSet(&g_vm.globals, (ObjString *)name, top[-1]);
+	return top - 1;
+}
+
+static Value *get_upvalue(Value *top, uintptr_t index, CallFrame *frame) {
+	*top = *frame->closure->upvalues[index]->location;
+	return top + 1;
+}
+
+static Value *set_upvalue(Value *top, uintptr_t index, CallFrame *frame) {
+	ObjUpValue *upvalue = frame->closure->upvalues[index];
+	*upvalue->location  = top[-1];
+	write_barrier((Obj *)upvalue);
+	return top;
+}
+
+// Fields only, binding a method is left to the interpreter.
+static Value *get_property(Value *top, uintptr_t name, CallFrame *frame) {
+	if (!IS_INSTANCE(top[-1])) return NULL;
+	return tableGet(&AS_INSTANCE(top[-1])->fields, (ObjString *)name, &top[-1]) ? top : NULL;
+}
+
+static Value *set_property(Value *top, uintptr_t name, CallFrame *frame) {
+	if (!IS_INSTANCE(top[-2])) return NULL;
+	sync_stack(top);
+	tableSet(&AS_INSTANCE(top[-2])->fields, (ObjString *)name, top[-1]);
+	write_barrier(AS_OBJ(top[-2]));
+	top[-2] = top[-1];
+	return top - 1;
+}
+
+static Value *new_object(Value *top, uintptr_t operand, CallFrame *frame) {
+	sync_stack(top);
+	top[-1] = OBJ_VAL(new_instance(AS_CLASS(top[-1])));
+	return top;
+}
+
+static Value *equal(Value *top, uintptr_t operand, CallFrame *frame) {
+	top[-2] = BOOL_VAL(values_equal(top[-2], top[-1]));
+	return top - 1;
+}
+
+// Strings are concatenated by the interpreter.
+#define NUMBERS(name, value_type, op)                                   \
+	static Value *name(Value *top, uintptr_t operand, CallFrame *frame) { \
+		if (!IS_NUMBER(top[-2]) || !IS_NUMBER(top[-1])) return NULL;        \
+		top[-2] = value_type(AS_NUMBER(top[-2]) op AS_NUMBER(top[-1]));     \
+		return top - 1;                                                     \
+	}
+NUMBERS(greater, BOOL_VAL, >)
+NUMBERS(less, BOOL_VAL, <)
+NUMBERS(add, NUMBER_VAL, +)
+NUMBERS(subtract, NUMBER_VAL, -)
+NUMBERS(multiply, NUMBER_VAL, *)
+NUMBERS(divide, NUMBER_VAL, /)
+#undef NUMBERS
+
+static Value *not(Value *top, uintptr_t operand, CallFrame *frame) {
+	top[-1] = BOOL_VAL(falsey(top[-1]));
+	return top;
+}
+
+static Value *negate(Value *top, uintptr_t operand, CallFrame *frame) {
+	if (!IS_NUMBER(top[-1])) return NULL;
+	top[-1] = NUMBER_VAL(-AS_NUMBER(top[-1]));
+	return top;
+}
+
+static Value *print(Value *top, uintptr_t operand, CallFrame *frame) {
+	print_value(top[-1]);
+	printf("\n");
+	return top - 1;
+}
+
+const Helpers g_helpers = {get_global,   set_global, define_global, get_upvalue, set_upvalue,
+                           get_property, set_property, equal,      print,       leave};
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+// Each instruction becomes a fixed template. Moves between slots and the
+// stack, unchecked number arithmetic and branches are inline; other supported
+// instructions call a helper above; the rest, calls and returns among them,
+// leave to the interpreter, which runs them and enters again after the next
+// call, return or backward branch.
+//
+// While native code runs, r12 holds slot zero, r13 the stack top and r14 the
+// frame. g_vm.stackCount only catches up on the way out and before helpers
+// that may collect.
+
+enum { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7, R12 = 12, R13 = 13, R14 = 14 };
+
+#define SLOTS R12
+#define TOP   R13
+#define FRAME R14
+
+#define VALUE_SIZE ((int32_t)sizeof(Value))
+#ifdef NAN_BOXING
+#define NUMBER_OFFSET 0
+#else
+#define NUMBER_OFFSET ((int32_t)offsetof(Value, as.number))
+#endif
+
+typedef int (*NativeEntry)(uint8_t *target, CallFrame *frame, Value *slots, Value *top);
+
+// A rel32 field still to be filled, with the native offset of a bytecode
+// instruction, or with the exit stub that leaves to it.
+typedef struct {
+	int at;
+	int target;
+	bool exit;
+} Patch;
+
+typedef struct {
+	uint8_t *code;
+	int count;
+	int capacity;
+	Patch *patches;
+	int patch_count;
+	int patch_capacity;
+} Assembler;
+
+static Value literals[3];  // nil, false and true, for templates to copy
+
+static void emit(Assembler *as, uint8_t byte) {
+	if (as->capacity < as->count + 1) {
+		int old_capacity = as->capacity;
+		as->capacity     = GROW_CAPACITY(old_capacity);
+		as->code         = GROW_ARRAY(uint8_t, as->code, old_capacity, as->capacity);
+	}
+	as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler *as, uint32_t value) {
+	for (int i = 0; i < 4; i++) emit(as, (value >> (8 * i)) & 0xff);
+}
+
+static void emit64(Assembler *as, uint64_t value) {
+	for (int i = 0; i < 8; i++) emit(as, (value >> (8 * i)) & 0xff);
+}
+
+static void patch32(Assembler *as, int at, int32_t value) {
+	for (int i = 0; i < 4; i++) as->code[at + i] = ((uint32_t)value >> (8 * i)) & 0xff;
+}
+
+// An instruction whose operand is [base + disp32]: an optional legacy prefix,
+// REX when needed, one or two opcode bytes, ModRM and SIB for r12.
+static void emit_mem(Assembler *as, uint8_t prefix, bool wide, uint32_t op, int reg, int base, int32_t disp) {
+	if (prefix != 0) emit(as, prefix);
+	uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) >> 1) | ((base & 8) >> 3);
+	if (rex != 0x40) emit(as, rex);
+	if (op > 0xff) emit(as, op >> 8);
+	emit(as, op & 0xff);
+	emit(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == 4) emit(as, 0x24);
+	emit32(as, (uint32_t)disp);
+}
+
+static void mov_imm(Assembler *as, int reg, uint64_t value) {
+	emit(as, 0x48 | ((reg & 8) >> 3));
+	emit(as, 0xb8 + (reg & 7));
+	emit64(as, value);
+}
+
+static void mov_reg(Assembler *as, int dst, int src) {
+	emit(as, 0x48 | ((src & 8) >> 1) | ((dst & 8) >> 3));
+	emit(as, 0x89);
+	emit(as, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// add or sub r13, imm8
+static void move_top(Assembler *as, int values) {
+	emit(as, 0x49);
+	emit(as, 0x83);
+	emit(as, values > 0 ? 0xc5 : 0xed);
+	emit(as, (uint8_t)(VALUE_SIZE * (values > 0 ? values : -values)));
+}
+
+// A whole Value goes through xmm0.
+static void load_value(Assembler *as, int base, int32_t disp) {
+	emit_mem(as, VALUE_SIZE == 8 ? 0xf2 : 0, false, 0x0f10, 0, base, disp);
+}
+
+static void store_value(Assembler *as, int base, int32_t disp) {
+	emit_mem(as, VALUE_SIZE == 8 ? 0xf2 : 0, false, 0x0f11, 0, base, disp);
+}
+
+static void push_from(Assembler *as, int base, int32_t disp) {
+	load_value(as, base, disp);
+	store_value(as, TOP, 0);
+	move_top(as, 1);
+}
+
+static void push_literal(Assembler *as, int index) {
+	mov_imm(as, RAX, (uint64_t)(uintptr_t)&literals[index]);
+	push_from(as, RAX, 0);
+}
+
+// A jump or jcc with its rel32 left open; returns where that is.
+static int jump(Assembler *as, int cc) {
+	if (cc < 0) {
+		emit(as, 0xe9);
+	} else {
+		emit(as, 0x0f);
+		emit(as, 0x80 | cc);
+	}
+	emit32(as, 0);
+	return as->count - 4;
+}
+
+enum { CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_LE = 0xe, JMP = -1 };
+
+static void bind(Assembler *as, int at) {
+	patch32(as, at, as->count - (at + 4));
+}
+
+static void add_patch(Assembler *as, int at, int target, bool exit) {
+	if (as->patch_capacity < as->patch_count + 1) {
+		int old_capacity   = as->patch_capacity;
+		as->patch_capacity = GROW_CAPACITY(old_capacity);
+		as->patches        = GROW_ARRAY(Patch, as->patches, old_capacity, as->patch_capacity);
+	}
+	as->patches[as->patch_count++] = (Patch){at, target, exit};
+}
+
+static void jump_to(Assembler *as, int cc, int target) {
+	add_patch(as, jump(as, cc), target, false);
+}
+
+static void exit_to(Assembler *as, int cc, int offset) {
+	add_patch(as, jump(as, cc), offset, true);
+}
+
+// Branch to `target` when the value on top is falsey, or truthy when `when`
+// is true, without popping it. With `exit`, to the exit stub that leaves to
+// the interpreter there instead.
+static void branch_on(Assembler *as, bool when, int target, bool exit) {
+#ifdef NAN_BOXING
+	emit_mem(as, 0, true, 0x8b, RAX, TOP, -VALUE_SIZE);
+	int skip = -1;
+	for (int i = 0; i < 2; i++) {
+		mov_imm(as, RCX, i == 0 ? NIL_VAL : FALSE_VAL);
+		emit(as, 0x48);  // cmp rax, rcx
+		emit(as, 0x39);
+		emit(as, 0xc8);
+		if (!when) {
+			add_patch(as, jump(as, CC_E), target, exit);
+		} else if (i == 0) {
+			skip = jump(as, CC_E);
+		} else {
+			add_patch(as, jump(as, CC_NE), target, exit);
+		}
+	}
+	if (skip >= 0) bind(as, skip);
+#else
+	emit_mem(as, 0, false, 0x8b, RAX, TOP, -VALUE_SIZE + (int32_t)offsetof(Value, type));
+	emit(as, 0x83);  // cmp eax, VAL_NIL
+	emit(as, 0xf8);
+	emit(as, VAL_NIL);
+	int skip = -1;
+	if (when) {
+		skip = jump(as, CC_E);
+	} else {
+		add_patch(as, jump(as, CC_E), target, exit);
+	}
+	emit(as, 0x83);  // cmp eax, VAL_BOOL
+	emit(as, 0xf8);
+	emit(as, VAL_BOOL);
+	if (when) {
+		add_patch(as, jump(as, CC_NE), target, exit);
+	} else {
+		int other = jump(as, CC_NE);
+		if (skip < 0) skip = other;
+	}
+	emit_mem(as, 0, false, 0x80, 7, TOP, -VALUE_SIZE + (int32_t)offsetof(Value, as.boolean));
+	emit(as, 0);
+	add_patch(as, jump(as, when ? CC_NE : CC_E), target, exit);
+	if (skip >= 0) bind(as, skip);
+#endif
+}
+
+// Call `helper` with the top, `operand` and the frame; if it gives up, leave
+// to the interpreter at `offset`.
+static void call_helper(Assembler *as, Helper helper, uintptr_t operand, int offset) {
+	mov_reg(as, RDI, TOP);
+	mov_imm(as, RSI, operand);
+	mov_reg(as, RDX, FRAME);
+	mov_imm(as, RAX, (uint64_t)(uintptr_t)helper);
+	emit(as, 0xff);  // call rax
+	emit(as, 0xd0);
+	emit(as, 0x48);  // test rax, rax
+	emit(as, 0x85);
+	emit(as, 0xc0);
+	exit_to(as, CC_E, offset);
+	mov_reg(as, TOP, RAX);
+}
+
+static void numbers(Assembler *as, uint8_t op) {
+	emit_mem(as, 0xf2, false, 0x0f10, 0, TOP, NUMBER_OFFSET - 2 * VALUE_SIZE);
+	emit_mem(as, 0xf2, false, 0x0f00 | op, 0, TOP, NUMBER_OFFSET - VALUE_SIZE);
+	emit_mem(as, 0xf2, false, 0x0f11, 0, TOP, NUMBER_OFFSET - 2 * VALUE_SIZE);
+	move_top(as, -1);
+}
+
+// a > b, or b > a for `less`, as false or true copied over a.
+static void compare_numbers(Assembler *as, bool less) {
+	int32_t a = NUMBER_OFFSET - 2 * VALUE_SIZE;
+	int32_t b = NUMBER_OFFSET - VALUE_SIZE;
+	emit_mem(as, 0xf2, false, 0x0f10, 0, TOP, less ? b : a);
+	emit_mem(as, 0x66, false, 0x0f2e, 0, TOP, less ? a : b);  // ucomisd
+	mov_imm(as, RAX, (uint64_t)(uintptr_t)&literals[1]);
+	mov_imm(as, RCX, (uint64_t)(uintptr_t)&literals[2]);
+	emit(as, 0x48);  // cmova rax, rcx
+	emit(as, 0x0f);
+	emit(as, 0x47);
+	emit(as, 0xc1);
+	move_top(as, -1);
+	load_value(as, RAX, 0);
+	store_value(as, TOP, -VALUE_SIZE);
+}
+
+// Push whether the value at [base + disp] is a number, as true or false.
+static void test_number(Assembler *as, int base, int32_t disp) {
+#ifdef NAN_BOXING
+	emit_mem(as, 0, true, 0x8b, RAX, base, disp);
+	mov_imm(as, RCX, QNAN);
+	emit(as, 0x48);  // and rax, rcx
+	emit(as, 0x21);
+	emit(as, 0xc8);
+	emit(as, 0x48);  // cmp rax, rcx
+	emit(as, 0x39);
+	emit(as, 0xc8);
+	uint8_t cc = CC_NE;
+#else
+	emit_mem(as, 0, false, 0x83, 7, base, disp + (int32_t)offsetof(Value, type));  // cmp dword, imm8
+	emit(as, VAL_NUMBER);
+	uint8_t cc = CC_E;
+#endif
+	mov_imm(as, RAX, (uint64_t)(uintptr_t)&literals[1]);
+	mov_imm(as, RCX, (uint64_t)(uintptr_t)&literals[2]);
+	emit(as, 0x48);  // cmovcc rax, rcx
+	emit(as, 0x0f);
+	emit(as, 0x40 | cc);
+	emit(as, 0xc1);
+	push_from(as, RAX, 0);
+}
+
+static void leave_at(Assembler *as, int offset) {
+	emit(as, 0xbe);  // mov esi, offset
+	emit32(as, (uint32_t)offset);
+	exit_to(as, JMP, -1);
+}
+
+// Once the fuel runs out the interpreter takes the backward branch at `offset`.
+static void safepoint(Assembler *as, int offset) {
+	mov_imm(as, RAX, (uint64_t)(uintptr_t)&g_vm.fuel);
+	emit(as, 0xff);  // dec dword [rax]
+	emit(as, 0x08);
+	exit_to(as, CC_LE, offset);
+}
+
+static Trace *find_trace(ObjFunction *function, int header) {
+	for (Trace *trace = function->traces; trace != NULL; trace = trace->next) {
+		if (trace->header == header) return trace->code != NULL ? trace : NULL;
+	}
+	return NULL;
+}
+
+static uint32_t operand_at(Chunk *chunk, int offset, bool wide) {
+	uint32_t index = chunk->code[offset];
+	if (wide) index |= (chunk->code[offset + 1] << 8) | (chunk->code[offset + 2] << 16);
+	return index;
+}
+
+static int jump_target(Chunk *chunk, int offset) {
+	int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+	return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+static void translate(Assembler *as, ObjFunction *function, int offset) {
+	Chunk *chunk   = &function->chunk;
+	bool wide      = chunk->code[offset] == OP_WIDE;
+	int start      = wide ? offset + 1 : offset;
+	uint32_t index = instruction_length(chunk, offset) > 1 ? operand_at(chunk, start + 1, wide) : 0;
+	Value *values  = chunk->constants.values;
+	switch (chunk->code[start]) {
+		case OP_CONSTANT:
+			mov_imm(as, RAX, (uint64_t)(uintptr_t)&values[index]);
+			push_from(as, RAX, 0);
+			break;
+		case OP_NIL:
+			push_literal(as, 0);
+			break;
+		case OP_FALSE:
+			push_literal(as, 1);
+			break;
+		case OP_TRUE:
+			push_literal(as, 2);
+			break;
+		case OP_POP:
+			move_top(as, -1);
+			break;
+		case OP_GET_LOCAL:
+			push_from(as, SLOTS, (int32_t)index * VALUE_SIZE);
+			break;
+		case OP_SET_LOCAL:
+			load_value(as, TOP, -VALUE_SIZE);
+			store_value(as, SLOTS, (int32_t)index * VALUE_SIZE);
+			break;
+		case OP_GET_GLOBAL:
+			call_helper(as, get_global, (uintptr_t)AS_OBJ(values[index]), offset);
+			break;
+		case OP_SET_GLOBAL:
+			call_helper(as, set_global, (uintptr_t)AS_OBJ(values[index]), offset);
+			break;
+		case OP_DEFINE_GLOBAL:
+			call_helper(as, define_global, (uintptr_t)AS_OBJ(values[index]), offset);
+			break;
+		case OP_GET_UPVALUE:
+			call_helper(as, get_upvalue, index, offset);
+			break;
+		case OP_SET_UPVALUE:
+			call_helper(as, set_upvalue, index, offset);
+			break;
+		case OP_GET_PROPERTY:
+			call_helper(as, get_property, (uintptr_t)AS_OBJ(values[index]), offset);
+			break;
+		case OP_SET_PROPERTY:
+			call_helper(as, set_property, (uintptr_t)AS_OBJ(values[index]), offset);
+			break;
+		case OP_EQUAL:
+			call_helper(as, equal, 0, offset);
+			break;
+		case OP_GREATER:
+			call_helper(as, greater, 0, offset);
+			break;
+		case OP_LESS:
+			call_helper(as, less, 0, offset);
+			break;
+		case OP_ADD:
+			call_helper(as, add, 0, offset);
+			break;
+		case OP_SUBTRACT:
+			call_helper(as, subtract, 0, offset);
+			break;
+		case OP_MULTIPLY:
+			call_helper(as, multiply, 0, offset);
+			break;
+		case OP_DIVIDE:
+			call_helper(as, divide, 0, offset);
+			break;
+		case OP_NOT:
+			call_helper(as, not, 0, offset);
+			break;
+		case OP_NEGATE:
+			call_helper(as, negate, 0, offset);
+			break;
+		case OP_PRINT:
+			call_helper(as, print, 0, offset);
+			break;
+		case OP_ADD_NUMBER:
+			numbers(as, 0x58);
+			break;
+		case OP_SUBTRACT_NUMBER:
+			numbers(as, 0x5c);
+			break;
+		case OP_MULTIPLY_NUMBER:
+			numbers(as, 0x59);
+			break;
+		case OP_DIVIDE_NUMBER:
+			numbers(as, 0x5e);
+			break;
+		case OP_NEGATE_NUMBER:
+			// Flip the sign bit.
+			emit_mem(as, 0, false, 0x80, 6, TOP, NUMBER_OFFSET - VALUE_SIZE + 7);
+			emit(as, 0x80);
+			break;
+		case OP_GREATER_NUMBER:
+			compare_numbers(as, false);
+			break;
+		case OP_LESS_NUMBER:
+			compare_numbers(as, true);
+			break;
+		case OP_IS_NUMBER:
+			test_number(as, SLOTS, (int32_t)index * VALUE_SIZE);
+			break;
+		case OP_NEW:
+			call_helper(as, new_object, 0, offset);
+			break;
+		case OP_JUMP:
+			jump_to(as, JMP, jump_target(chunk, offset));
+			break;
+		case OP_JUMP_IF_FALSE:
+			branch_on(as, false, jump_target(chunk, offset), false);
+			break;
+		case OP_JUMP_IF_TRUE:
+			branch_on(as, true, jump_target(chunk, offset), false);
+			break;
+		case OP_LOOP:
+			// Loops with a trace are left to the interpreter, which runs it.
+			if (find_trace(function, jump_target(chunk, offset)) != NULL) {
+				leave_at(as, offset);
+				break;
+			}
+			safepoint(as, offset);
+			jump_to(as, JMP, jump_target(chunk, offset));
+			break;
+		default:
+			leave_at(as, offset);
+			break;
+	}
+}
+
+// push rbx, r12, r13, r14, r15, which also aligns the stack for calls; then
+// take the arguments and jump to the target.
+static void begin_native(Assembler *as) {
+	literals[0] = NIL_VAL;
+	literals[1] = BOOL_VAL(false);
+	literals[2] = BOOL_VAL(true);
+	memset(as, 0, sizeof(*as));
+	static const uint8_t prologue[] = {0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57};
+	for (size_t i = 0; i < sizeof(prologue); i++) emit(as, prologue[i]);
+	mov_reg(as, FRAME, RSI);
+	mov_reg(as, SLOTS, RDX);
+	mov_reg(as, TOP, RCX);
+	emit(as, 0xff);  // jmp rdi
+	emit(as, 0xe7);
+}
+
+// Add the exit stubs, each naming the instruction the interpreter goes on
+// from, and the way out they share; fill in the jumps, to instructions placed
+// by `entries` or to exits; and map the code executable. NULL if that fails.
+static uint8_t *finish_native(Assembler *as, Chunk *chunk, int32_t *entries, size_t *size) {
+	int32_t *exits = ALLOCATE(int32_t, chunk->count);
+	for (int i = 0; i < chunk->count; i++) exits[i] = -1;
+	int patch_count = as->patch_count;
+	for (int i = 0; i < patch_count; i++) {
+		int target = as->patches[i].target;
+		if (!as->patches[i].exit || target < 0 || exits[target] >= 0) continue;
+		exits[target] = as->count;
+		leave_at(as, target);
+	}
+	int leave_stub = as->count;
+	mov_reg(as, RDI, TOP);
+	mov_imm(as, RAX, (uint64_t)(uintptr_t)leave);
+	emit(as, 0xff);  // call rax
+	emit(as, 0xd0);
+	static const uint8_t epilogue[] = {0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3};
+	for (size_t i = 0; i < sizeof(epilogue); i++) emit(as, epilogue[i]);
+
+	for (int i = 0; i < as->patch_count; i++) {
+		Patch *patch = &as->patches[i];
+		int dest     = !patch->exit ? entries[patch->target] : patch->target < 0 ? leave_stub : exits[patch->target];
+		patch32(as, patch->at, dest - (patch->at + 4));
+	}
+	FREE_ARRAY(int32_t, exits, chunk->count);
+	FREE_ARRAY(Patch, as->patches, as->patch_capacity);
+
+	uint8_t *code = mmap(NULL, as->count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code != MAP_FAILED) {
+		memcpy(code, as->code, as->count);
+		mprotect(code, as->count, PROT_READ | PROT_EXEC);
+	}
+	*size = as->count;
+	FREE_ARRAY(uint8_t, as->code, as->capacity);
+	return code == MAP_FAILED ? NULL : code;
+}
+
+bool jit_compile(ObjFunction *function) {
+	Chunk *chunk = &function->chunk;
+	Assembler as;
+	begin_native(&as);
+	int32_t *entries = ALLOCATE(int32_t, chunk->count);
+	for (int i = 0; i < chunk->count; i++) entries[i] = -1;
+	for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+		entries[offset] = as.count;
+		translate(&as, function, offset);
+	}
+
+	size_t size;
+	uint8_t *code = finish_native(&as, chunk, entries, &size);
+	if (code == NULL) {
+		FREE_ARRAY(int32_t, entries, chunk->count);
+		return false;
+	}
+	JitCode *native  = ALLOCATE(JitCode, 1);
+	native->code     = code;
+	native->size     = size;
+	native->entries  = entries;
+	native->count    = chunk->count;
+	function->native = native;
+	return true;
+}
+
+// Run the frame's native code from `ip`. Returns the offset of the instruction
+// the interpreter goes on from.
+int run_native(ObjFunction *function, CallFrame *frame, uint8_t *ip) {
+	JitCode *native = function->native;
+	uint8_t *target = native->code + native->entries[ip - function->chunk.code];
+	return ((NativeEntry)native->code)(target, frame, &g_vm.stack[frame->base], &g_vm.stack[g_vm.stackCount]);
+}
+
+void free_native(JitCode *native) {
+	munmap(native->code, native->size);
+	FREE_ARRAY(int32_t, native->entries, native->count);
+	FREE(JitCode, native);
+}
+
+// Tracing. The interpreter counts each loop's trips through its header and,
+// once a loop is hot, runs the next turn through record() in its debug loop.
+// That notes the path taken and whether the values on top of the stack were
+// numbers. The trace compiled from it is straight-line code, specialized to
+// those types:
+//
+// - A local that the loop reads before writing it, and saw as a number, is
+//   checked once when the trace is entered. Arithmetic on it after that has
+//   no type checks, and neither does arithmetic on the results.
+// - Values from anywhere else that were numbers are checked as they come in.
+// - Each branch checks that it goes the recorded way, straight from the
+//   flags when it tests a comparison.
+// - Number locals and constants aren't pushed for arithmetic, which reads
+//   them where they are.
+//
+// A failed check is a side exit: the stack is always in memory, so leaving to
+// the interpreter at the right instruction is enough to go on from there. A
+// trace that ends with its guarded locals still numbers loops back past the
+// checks on entry.
+
+typedef struct {
+	int offset;
+	uint8_t numbers;  // bit 0 for the top of the stack, bit 1 for the value under it
+} TraceStep;
+
+static struct {
+	Trace *trace;
+	ObjFunction *function;
+	int frame_count;
+	int depth;  // of the stack at the header, from slot zero
+	TraceStep steps[TRACE_MAX];
+	int count;
+} recorder;
+
+enum { UNSEEN, NUMBER, OTHER, KEEP };
+
+static bool traceable(uint8_t op) {
+	switch (op) {
+		case OP_CALL:
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+		case OP_CLOSURE:
+		case OP_CLOSE_UPVALUE:
+		case OP_RETURN:
+		case OP_CLASS:
+		case OP_INHERIT:
+		case OP_METHOD:
+		case OP_IMPORT:
+		case OP_BUILD_STRING:
+		case OP_GET_SUPER:
+			return false;
+		default:
+			return true;
+	}
+}
+
+static void guard_number(Assembler *as, int base, int32_t disp, int exit) {
+#ifdef NAN_BOXING
+	emit_mem(as, 0, true, 0x8b, RAX, base, disp);
+	mov_imm(as, RCX, QNAN);
+	emit(as, 0x48);  // and rax, rcx
+	emit(as, 0x21);
+	emit(as, 0xc8);
+	emit(as, 0x48);  // cmp rax, rcx
+	emit(as, 0x39);
+	emit(as, 0xc8);
+	exit_to(as, CC_E, exit);
+#else
+	emit_mem(as, 0, false, 0x83, 7, base, disp + (int32_t)offsetof(Value, type));  // cmp dword, imm8
+	emit(as, VAL_NUMBER);
+	exit_to(as, CC_NE, exit);
+#endif
+}
+
+// Check the operands of a number instruction that aren't known to be numbers
+// yet, leaving to the interpreter at `offset` if one isn't.
+static void guard_operands(Assembler *as, uint8_t *types, int depth, int operands, int offset) {
+	for (int i = 1; i <= operands; i++) {
+		if (types[depth - i] != NUMBER) guard_number(as, TOP, -i * VALUE_SIZE, offset);
+	}
+}
+
+// A number local or constant the trace hasn't pushed yet. Nothing writes to
+// the local before it is pushed or used, see compile_trace().
+typedef struct {
+	int32_t slot;  // or -1 for the constant at `value`
+	Value *value;
+} Operand;
+
+static bool number_op(uint8_t op) {
+	switch (op) {
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+		case OP_GREATER:
+		case OP_LESS:
+		case OP_ADD_NUMBER:
+		case OP_SUBTRACT_NUMBER:
+		case OP_MULTIPLY_NUMBER:
+		case OP_DIVIDE_NUMBER:
+		case OP_GREATER_NUMBER:
+		case OP_LESS_NUMBER:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Push the first `count` pending operands.
+static void flush(Assembler *as, Operand *pending, int count) {
+	for (int i = 0; i < count; i++) {
+		if (pending[i].slot >= 0) {
+			push_from(as, SLOTS, pending[i].slot * VALUE_SIZE);
+		} else {
+			mov_imm(as, RAX, (uint64_t)(uintptr_t)pending[i].value);
+			push_from(as, RAX, 0);
+		}
+	}
+}
+
+// An SSE instruction on xmm0 and the number in `operand`, or in the stack
+// value at `disp` from the top without one.
+static void number_from(Assembler *as, uint32_t op, Operand *operand, int scratch, int32_t disp) {
+	uint8_t prefix = op == 0x0f2e ? 0x66 : 0xf2;  // ucomisd, or a scalar double op
+	if (operand == NULL) {
+		emit_mem(as, prefix, false, op, 0, TOP, disp + NUMBER_OFFSET);
+	} else if (operand->slot >= 0) {
+		emit_mem(as, prefix, false, op, 0, SLOTS, operand->slot * VALUE_SIZE + NUMBER_OFFSET);
+	} else {
+		mov_imm(as, scratch, (uint64_t)(uintptr_t)operand->value);
+		emit_mem(as, prefix, false, op, 0, scratch, NUMBER_OFFSET);
+	}
+}
+
+// numbers() and compare_numbers() for a trace, where the operands on top may
+// still be pending. Both leave the result pushed; a comparison leaves rax and
+// rcx as in compare_numbers() too.
+static void trace_numbers(Assembler *as, uint8_t op, Operand *pending, int count) {
+	static const uint8_t arithmetic[] = {[OP_ADD] = 0x58, [OP_SUBTRACT] = 0x5c, [OP_MULTIPLY] = 0x59,
+	                                     [OP_DIVIDE] = 0x5e, [OP_ADD_NUMBER] = 0x58,
+	                                     [OP_SUBTRACT_NUMBER] = 0x5c, [OP_MULTIPLY_NUMBER] = 0x59,
+	                                     [OP_DIVIDE_NUMBER] = 0x5e};
+	Operand *a     = count == 2 ? &pending[0] : NULL;
+	Operand *b     = count >= 1 ? &pending[count - 1] : NULL;
+	int32_t a_disp = (count == 0 ? -2 : -1) * VALUE_SIZE;
+	bool less      = op == OP_LESS || op == OP_LESS_NUMBER;
+	if (less || op == OP_GREATER || op == OP_GREATER_NUMBER) {
+		// a > b, or b > a for less.
+		number_from(as, 0x0f10, less ? b : a, RAX, less ? -VALUE_SIZE : a_disp);
+		number_from(as, 0x0f2e, less ? a : b, RCX, less ? a_disp : -VALUE_SIZE);
+		mov_imm(as, RAX, (uint64_t)(uintptr_t)&literals[1]);
+		mov_imm(as, RCX, (uint64_t)(uintptr_t)&literals[2]);
+		emit(as, 0x48);  // cmova rax, rcx
+		emit(as, 0x0f);
+		emit(as, 0x47);
+		emit(as, 0xc1);
+		if (count != 1) move_top(as, count - 1);
+		load_value(as, RAX, 0);
+		store_value(as, TOP, -VALUE_SIZE);
+		return;
+	}
+	number_from(as, 0x0f10, a, RAX, a_disp);
+	number_from(as, 0x0f00 | arithmetic[op], b, RCX, -VALUE_SIZE);
+	if (count != 1) move_top(as, count - 1);
+	emit_mem(as, 0xf2, false, 0x0f11, 0, TOP, NUMBER_OFFSET - VALUE_SIZE);
+#ifndef NAN_BOXING
+	if (a != NULL) {
+		emit_mem(as, 0, false, 0xc7, 0, TOP, -VALUE_SIZE + (int32_t)offsetof(Value, type));  // mov dword, imm32
+		emit32(as, VAL_NUMBER);
+	}
+#endif
+}
+
+static bool compile_trace() {
+	ObjFunction *function = recorder.function;
+	Chunk *chunk          = &function->chunk;
+	uint8_t *types        = ALLOCATE(uint8_t, function->max_stack);
+	bool *guarded         = ALLOCATE(bool, function->max_stack);
+	int depth             = recorder.depth;
+	for (int i = 0; i < function->max_stack; i++) {
+		types[i]   = i < depth ? UNSEEN : OTHER;
+		guarded[i] = false;
+	}
+	Assembler as;
+	begin_native(&as);
+	int body = as.count;
+	int loop = -1;
+
+	Operand pending[2];
+	int pending_count = 0;
+	bool compared     = false;  // the last step compared numbers, leaving the flags set
+
+	for (int i = 0; i < recorder.count; i++) {
+		int offset     = recorder.steps[i].offset;
+		int next       = i + 1 < recorder.count ? recorder.steps[i + 1].offset : recorder.trace->header;
+		bool result    = i + 1 < recorder.count && (recorder.steps[i + 1].numbers & 1);  // what it pushed was a number
+		bool wide      = chunk->code[offset] == OP_WIDE;
+		int start      = wide ? offset + 1 : offset;
+		uint8_t op     = chunk->code[start];
+		uint32_t index = instruction_length(chunk, offset) > 1 ? operand_at(chunk, start + 1, wide) : 0;
+		uint8_t type   = OTHER;  // of what it leaves on top, or KEEP
+		bool after     = compared;
+		compared       = false;
+
+		// Number locals and constants wait for the arithmetic that uses them;
+		// everything else wants them on the stack.
+		bool defers = (op == OP_GET_LOCAL && types[index] != OTHER) ||
+		              (op == OP_CONSTANT && IS_NUMBER(chunk->constants.values[index]));
+		bool uses   = number_op(op) && types[depth - 1] == NUMBER && types[depth - 2] == NUMBER;
+		if (defers && pending_count == 2) {
+			flush(&as, pending, 1);
+			pending[0]    = pending[1];
+			pending_count = 1;
+		} else if (!defers && !uses) {
+			flush(&as, pending, pending_count);
+			pending_count = 0;
+		}
+
+		switch (op) {
+			case OP_GET_LOCAL:
+				if (types[index] == UNSEEN) {
+					guarded[index] = result;
+					types[index]   = result ? NUMBER : OTHER;
+				}
+				if (types[index] == NUMBER) {
+					pending[pending_count++] = (Operand){(int32_t)index, NULL};
+				} else {
+					if (defers) {
+						flush(&as, pending, pending_count);
+						pending_count = 0;
+					}
+					translate(&as, function, offset);
+				}
+				type = types[index];
+				break;
+			case OP_SET_LOCAL:
+				translate(&as, function, offset);
+				types[index] = types[depth - 1];
+				type         = types[depth - 1];
+				break;
+			case OP_CONSTANT:
+				if (defers) {
+					pending[pending_count++] = (Operand){-1, &chunk->constants.values[index]};
+					type                     = NUMBER;
+				} else {
+					translate(&as, function, offset);
+				}
+				break;
+			case OP_GET_GLOBAL:
+			case OP_GET_UPVALUE:
+			case OP_GET_PROPERTY:
+				translate(&as, function, offset);
+				if (result) {
+					guard_number(&as, TOP, -VALUE_SIZE, next);
+					type = NUMBER;
+				}
+				break;
+			case OP_SET_GLOBAL:
+			case OP_SET_UPVALUE:
+			case OP_SET_PROPERTY:
+				translate(&as, function, offset);
+				type = types[depth - 1];
+				break;
+			case OP_ADD:
+			case OP_SUBTRACT:
+			case OP_MULTIPLY:
+			case OP_DIVIDE:
+			case OP_GREATER:
+			case OP_LESS:
+			case OP_ADD_NUMBER:
+			case OP_SUBTRACT_NUMBER:
+			case OP_MULTIPLY_NUMBER:
+			case OP_DIVIDE_NUMBER:
+			case OP_GREATER_NUMBER:
+			case OP_LESS_NUMBER:
+				// Recorded with numbers, see record().
+				if (!uses) guard_operands(&as, types, depth, 2, offset);
+				trace_numbers(&as, op, pending, pending_count);
+				pending_count = 0;
+				compared      = op == OP_GREATER || op == OP_LESS || op == OP_GREATER_NUMBER || op == OP_LESS_NUMBER;
+				if (!compared) type = NUMBER;
+				break;
+			case OP_NEGATE:
+				guard_operands(&as, types, depth, 1, offset);
+				// Fall through.
+			case OP_NEGATE_NUMBER:
+				emit_mem(&as, 0, false, 0x80, 6, TOP, NUMBER_OFFSET - VALUE_SIZE + 7);  // xor byte, flipping the sign
+				emit(&as, 0x80);
+				type = NUMBER;
+				break;
+			case OP_JUMP:
+				type = KEEP;
+				break;
+			case OP_JUMP_IF_FALSE:
+			case OP_JUMP_IF_TRUE: {
+				// Leave where the branch would have gone the other way.
+				bool taken = next != offset + 3;
+				bool when  = (op == OP_JUMP_IF_TRUE) != taken;
+				int exit   = taken ? offset + 3 : jump_target(chunk, offset);
+				if (after) {
+					// rax is the true literal when rcx is.
+					emit(&as, 0x48);  // cmp rax, rcx
+					emit(&as, 0x39);
+					emit(&as, 0xc8);
+					exit_to(&as, when ? CC_E : CC_NE, exit);
+				} else {
+					branch_on(&as, when, exit, true);
+				}
+				type = KEEP;
+				break;
+			}
+			case OP_LOOP:
+				// Only the last one goes back to the header, see record().
+				safepoint(&as, offset);
+				if (i == recorder.count - 1) loop = jump(&as, JMP);
+				type = KEEP;
+				break;
+			default:
+				translate(&as, function, offset);
+				if (op == OP_POP || op == OP_PRINT || op == OP_DEFINE_GLOBAL) type = KEEP;
+				break;
+		}
+		depth += stack_effect(chunk, offset);
+		if (type != KEEP) types[depth - 1] = type;
+	}
+
+	// The checks on entry, which the loop skips when it keeps its locals' types.
+	bool stable = true;
+	int entry   = as.count;
+	for (int slot = 0; slot < recorder.depth; slot++) {
+		if (!guarded[slot]) continue;
+		guard_number(&as, SLOTS, slot * VALUE_SIZE, recorder.trace->header);
+		if (types[slot] != NUMBER) stable = false;
+	}
+	int enter = jump(&as, JMP);
+	patch32(&as, enter, body - (enter + 4));
+	patch32(&as, loop, (stable ? body : entry) - (loop + 4));
+	FREE_ARRAY(uint8_t, types, function->max_stack);
+	FREE_ARRAY(bool, guarded, function->max_stack);
+
+	Trace *trace = recorder.trace;
+	trace->code  = finish_native(&as, chunk, NULL, &trace->size);
+	trace->entry = entry;
+	return trace->code != NULL;
+}
+
+// Record the next turn of the loop, whose header `frame` is at.
+void start_recording(Trace *trace, CallFrame *frame) {
+	recorder.trace       = trace;
+	recorder.function    = frame->closure->function;
+	recorder.frame_count = g_vm.frame_count;
+	recorder.depth       = g_vm.stackCount - frame->base;
+	recorder.count       = 0;
+}
+
+bool recording() {
+	return recorder.trace != NULL;
+}
+
+// Note the instruction at `ip` before the interpreter runs it. False once the
+// recording is over, having compiled the trace or given up.
+bool record(CallFrame *frame, uint8_t *ip) {
+	Chunk *chunk = &recorder.function->chunk;
+	int offset   = (int)(ip - chunk->code);
+	if (g_vm.frame_count != recorder.frame_count) {
+		stop_recording();
+		return false;
+	}
+	if (offset == recorder.trace->header && recorder.count > 0) {
+		if (!compile_trace()) recorder.trace->failed = true;
+		recorder.trace = NULL;
+		return false;
+	}
+
+	uint8_t op      = chunk->code[offset] == OP_WIDE ? chunk->code[offset + 1] : chunk->code[offset];
+	int depth       = g_vm.stackCount - frame->base;
+	uint8_t numbers = 0;
+	if (depth >= 1 && IS_NUMBER(g_vm.stack[g_vm.stackCount - 1])) numbers |= 1;
+	if (depth >= 2 && IS_NUMBER(g_vm.stack[g_vm.stackCount - 2])) numbers |= 2;
+	bool ok = recorder.count < TRACE_MAX && traceable(op);
+	switch (op) {
+		case OP_ADD:
+		case OP_SUBTRACT:
+		case OP_MULTIPLY:
+		case OP_DIVIDE:
+		case OP_GREATER:
+		case OP_LESS:
+			ok = ok && numbers == 3;
+			break;
+		case OP_NEGATE:
+			ok = ok && (numbers & 1);
+			break;
+		case OP_LOOP: {
+			// A for loop goes round through its increment, so one turn can jump
+			// back twice, but going back over the trace again is an inner loop,
+			// which has a trace of its own.
+			int target = jump_target(chunk, offset);
+			for (int i = 0; ok && target != recorder.trace->header && i < recorder.count; i++) {
+				if (recorder.steps[i].offset == target) ok = false;
+			}
+			break;
+		}
+	}
+	if (!ok) {
+		stop_recording();
+		return false;
+	}
+	recorder.steps[recorder.count++] = (TraceStep){offset, numbers};
+	return true;
+}
+
+// Give up on the recording, if there is one.
+void stop_recording() {
+	if (recorder.trace != NULL) recorder.trace->failed = true;
+	recorder.trace = NULL;
+}
+
+// Run the trace from its checks on entry. Returns the offset of the
+// instruction the interpreter goes on from.
+int run_trace(Trace *trace, CallFrame *frame) {
+	return ((NativeEntry)trace->code)(trace->code + trace->entry, frame, &g_vm.stack[frame->base],
+	                                  &g_vm.stack[g_vm.stackCount]);
+}
+
+void free_traces(Trace *trace) {
+	while (trace != NULL) {
+		Trace *next = trace->next;
+		if (trace->code != NULL) munmap(trace->code, trace->size);
+		FREE(Trace, trace);
+		trace = next;
+	}
+}
+
+#else
+
+bool jit_compile(ObjFunction *function) {
+	return false;
+}
+
+int run_native(ObjFunction *function, CallFrame *frame, uint8_t *ip) {
+	return (int)(ip - function->chunk.code);
+}
+
+void free_native(JitCode *native) {
+}
+
+void start_recording(Trace *trace, CallFrame *frame) {
+	trace->failed = true;
+}
+
+bool recording() {
+	return false;
+}
+
+bool record(CallFrame *frame, uint8_t *ip) {
+	return false;
+}
+
+void stop_recording() {
+}
+
+int run_trace(Trace *trace, CallFrame *frame) {
+	return trace->header;
+}
+
+void free_traces(Trace *trace) {
+	while (trace != NULL) {
+		Trace *next = trace->next;
+		FREE(Trace, trace);
+		trace = next;
+	}
+}
+
+#endif
+
+// The loop's counter, added the first time the loop comes round.
+Trace *loop_trace(ObjFunction *function, int header) {
+	for (Trace *trace = function->traces; trace != NULL; trace = trace->next) {
+		if (trace->header == header) return trace;
+	}
+	Trace *trace     = ALLOCATE(Trace, 1);
+	*trace           = (Trace){header, 0, false, NULL, 0, 0, function->traces};
+	function->traces = trace;
+	return trace;
+}
@@ -0,0 +1,66 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "object.h"
+#include "vm.h"
+
+// Calls plus backward branches before a function is translated to machine code.
+#define JIT_THRESHOLD 1000
+// Times round a loop before the interpreter records a trace through it, and
+// the most instructions one may have.
+#define TRACE_THRESHOLD 50
+#define TRACE_MAX       256
+
+// A function's machine code, on x86-64 only. Entering it at any instruction
+// runs until one it leaves to the interpreter, see run_native().
+typedef struct JitCode {
+	uint8_t *code;
+	size_t size;
+	int32_t *entries;  // native offset of the instruction at each bytecode offset, -1 inside one
+	int count;
+} JitCode;
+
+// A loop header the interpreter counts, and the trace compiled for one turn
+// of the loop from there, see record().
+typedef struct Trace {
+	int header;
+	int hits;
+	bool failed;  // recording gave up, so the loop stays with the other tiers
+	uint8_t *code;
+	size_t size;
+	int entry;  // offset of the type guards that start the trace
+	struct Trace *next;
+} Trace;
+
+typedef Value *(*Helper)(Value *top, uintptr_t operand, CallFrame *frame);
+
+// The helpers native code calls, see jit.c, and the way it leaves to the
+// interpreter: syncing the stack top and returning the offset to go on from.
+typedef struct {
+	Helper get_global;
+	Helper set_global;
+	Helper define_global;
+	Helper get_upvalue;
+	Helper set_upvalue;
+	Helper get_property;
+	Helper set_property;
+	Helper equal;
+	Helper print;
+	int (*leave)(Value *top, int offset);
+} Helpers;
+
+extern const Helpers g_helpers;
+
+bool jit_compile(ObjFunction *function);
+int run_native(ObjFunction *function, CallFrame *frame, uint8_t *ip);
+void free_native(JitCode *native);
+
+Trace *loop_trace(ObjFunction *function, int header);
+void start_recording(Trace *trace, CallFrame *frame);
+bool recording();
+bool record(CallFrame *frame, uint8_t *ip);
+void stop_recording();
+int run_trace(Trace *trace, CallFrame *frame);
+void free_traces(Trace *trace);
+
+#endif
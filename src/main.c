@@ -1,67 +1,162 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
+#include "aot.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "common.h"
 #include "debug.h"
+#include "module.h"
 #include "vm.h"
 
 static void repl() {
-	char line[1024];
+	char *line      = NULL;
+	size_t capacity = 0;
 	for (;;) {
 		printf("> ");
-		if (!fgets(line, sizeof(line), stdin)) {
+		ssize_t length = getline(&line, &capacity, stdin);
+		if (length < 0) {
 			printf("\n");
 			break;
 		}
-		interpret(line);
+		interpret_source(line, length, 1);
 	}
+	free(line);
 }
 
-static char *read_file(const char *path) {
-	FILE *file = fopen(path, "rb");
-	if (file == NULL) {
+// The VM is freed as on a normal exit, script consts and all, so that a
+// script stopped by an error leaves nothing behind either.
+static void exit_on_error(InterpretResult result) {
+	if (result != INTERPRET_COMPILE_ERROR && result != INTERPRET_RUNTIME_ERROR) return;
+	freeVm();
+	exit(result == INTERPRET_COMPILE_ERROR ? 65 : 70);
+}
+
+static void open_or_exit(const char *path, Source *source) {
+	if (!open_source(path, source)) {
 		fprintf(stderr, "Could not open file \"%s\".\n", path);
 		exit(74);
 	}
+}
 
-	fseek(file, EOF, SEEK_END);
-	size_t file_size = ftell(file);
-	rewind(file);
-	char *buffer = (char *)malloc(file_size + 1);
-	if (buffer == NULL) {
-		fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-		exit(74);
-	}
-	size_t byte_read = fread(buffer, sizeof(char), file_size, file);
-	if (byte_read < file_size) {
-		fprintf(stderr, "Could not read file \"%s\".\n", path);
+static void run_file(const char *path) {
+	Source source;
+	open_or_exit(path, &source);
+	InterpretResult result = interpret_file(path, source.chars, source.length);
+	close_source(&source);
+	exit_on_error(result);
+}
+
+static void run_file_aot(const char *library, const char *path) {
+	Source source;
+	open_or_exit(path, &source);
+	InterpretResult result = interpret_aot(path, library, source.chars, source.length);
+	close_source(&source);
+	exit_on_error(result);
+}
+
+// Write the script at `path` as C, see emit_c().
+static void emit_file(const char *out_path, const char *path) {
+	Source source;
+	open_or_exit(path, &source);
+	ObjFunction *script = compile_cached(path, source.chars, source.length);
+	if (script == NULL) exit(65);
+	FILE *out = fopen(out_path, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Could not write \"%s\".\n", out_path);
 		exit(74);
 	}
-	buffer[byte_read] = '\0';
+	bool emitted = emit_c(script, out);
+	close_source(&source);
+	if (fclose(out) != 0) exit(74);
+	if (!emitted) exit(65);
+}
 
-	fclose(file);
-	return buffer;
+// Several files are compiled in parallel, then run in order as one program.
+static void run_files(const char **paths, int count) {
+	Source *sources      = (Source *)malloc(sizeof(Source) * count);
+	const char **chars   = (const char **)malloc(sizeof(char *) * count);
+	size_t *lengths      = (size_t *)malloc(sizeof(size_t) * count);
+	if (sources == NULL || chars == NULL || lengths == NULL) exit(74);
+	for (int i = 0; i < count; i++) {
+		open_or_exit(paths[i], &sources[i]);
+		chars[i]   = sources[i].chars;
+		lengths[i] = sources[i].length;
+	}
+	long cpus              = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads            = g_debug.threads > 0 ? g_debug.threads : cpus > 0 ? (int)cpus : 1;
+	InterpretResult result = interpret_all(chars, lengths, count, threads);
+	for (int i = 0; i < count; i++) {
+		close_source(&sources[i]);
+	}
+	free(sources);
+	free(chars);
+	free(lengths);
+	exit_on_error(result);
 }
 
-static void run_file(const char *path) {
-	char *src              = read_file(path);
-	InterpretResult result = interpret(src);
-	free(src);
+static int count_lines(const char *src, size_t length) {
+	int lines = 0;
+	for (const char *p = memchr(src, '\n', length); p != NULL; p = memchr(p + 1, '\n', src + length - p - 1)) {
+		lines++;
+	}
+	return lines;
+}
 
-	if (result == INTERPRET_COMPILE_ERROR) exit(65);
-	if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+// Run stdin as it arrives, one batch of complete declarations at a time, so
+// a program piped in starts before it has all been read.
+static void run_stream() {
+	size_t capacity = 1 << 16;
+	size_t length   = 0;
+	size_t scanned  = 0;  // length when complete_declarations() last found nothing
+	int line        = 1;
+	char *buffer    = (char *)malloc(capacity);
+	if (buffer == NULL) exit(74);
+	for (;;) {
+		if (length == capacity) {
+			capacity *= 2;
+			buffer = (char *)realloc(buffer, capacity);
+			if (buffer == NULL) exit(74);
+		}
+		ssize_t n = read(STDIN_FILENO, buffer + length, capacity - length);
+		if (n < 0) exit(74);
+		length += n;
+		bool final = n == 0;
+		// A full read means more is already waiting, so don't rescan for
+		// every block of a long declaration, only once the buffer doubles.
+		if (!final && length == capacity && length < scanned * 2) continue;
+		size_t complete = complete_declarations(buffer, length, final);
+		if (complete == 0) {
+			scanned = length;
+			if (final) break;
+			continue;
+		}
+		exit_on_error(interpret_source(buffer, complete, line));
+		line += count_lines(buffer, complete);
+		memmove(buffer, buffer + complete, length - complete);
+		length -= complete;
+		scanned = 0;
+		if (final && length == 0) break;
+	}
+	free(buffer);
 }
 
 int main(int argc, char *argv[]) {
 	initVm();
 	if (argc == 1) {
 		repl();
+	} else if (argc == 2 && strcmp(argv[1], "-") == 0) {
+		run_stream();
 	} else if (argc == 2) {
 		run_file(argv[1]);
+	} else if (argc == 4 && strcmp(argv[1], "--emit-c") == 0) {
+		emit_file(argv[2], argv[3]);
+	} else if (argc == 4 && strcmp(argv[1], "--aot") == 0) {
+		run_file_aot(argv[2], argv[3]);
 	} else {
-		fprintf(stderr, "Usage: clox [path]\n");
-		exit(64);
+		run_files((const char **)argv + 1, argc - 1);
 	}
 	freeVm();
 	return 0;
@@ -1,31 +1,53 @@
 #include "memory.h"
 
+#include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
+
+#include <stdio.h>
 
 #include "chunk.h"
 #include "compiler.h"
+#include "debug.h"
+#include "jit.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-#ifdef DEBUG_LOG_GC
-#include <stdio.h>
+#define GC_HEAP_GROW_FACTOR 2
+// Bytes allocated between the steps of a major collection.
+#define GC_STEP_SIZE (64 * 1024)
+// Pause times by powers of two in microseconds, for CLOX_GC_STATS.
+#define PAUSE_BUCKETS 24
+// The collector is instantiated twice from the same code, once with logging
+// folded away, so `log` never costs a branch at run time.
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
 
-#include "debug.h"
-#endif
+_Thread_local Heap *g_heap = NULL;
 
-#define GC_HEAP_GROW_FACTOR 2
+static bool young_only        = false;  // set during a minor collection, which leaves old objects alone
+static unsigned stress_count = 0;
+static uint64_t minor_pauses[PAUSE_BUCKETS];
+static uint64_t step_pauses[PAUSE_BUCKETS];
+static double longest_minor = 0;
+static double longest_step  = 0;
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
-	g_vm.bytes_allocated += newSize - oldSize;
-	if (newSize > oldSize) {
-#ifdef DEBUG_STRESS_GC
-		collect_garbage();
-#endif
+	if (g_heap != NULL) {
+		// Workers never collect; the VM heap is not theirs to walk.
+		g_heap->bytes_allocated += newSize - oldSize;
+	} else {
+		g_vm.bytes_allocated += newSize - oldSize;
+	}
+	if (g_heap == NULL && newSize > oldSize) {
+		// Stress mode keeps next_gc at 0, so this one check covers it.
 		if (g_vm.bytes_allocated > g_vm.next_gc) {
 			collect_garbage();
+		} else if (g_vm.young_bytes > g_vm.nursery_size) {
+			collect_young();
 		}
 	}
 	if (newSize == 0) {
@@ -38,15 +60,7 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
 	return result;
 }
 
-void mark_object(Obj *object) {
-	if (object == NULL) return;
-	if (is_marked(object)) return;
-#ifdef DEBUG_LOG_GC
-	printf("%p mark ", (void *)object);
-	print_value(OBJ_VAL(object));
-	printf("\n");
-#endif
-	set_is_marked(object, true);
+static void gray_object(Obj *object) {
 	if (g_vm.gray_capacity < g_vm.gray_count + 1) {
 		g_vm.gray_capacity = GROW_CAPACITY(g_vm.gray_capacity);
 		g_vm.gray_stack    = (Obj **)realloc(g_vm.gray_stack, sizeof(Obj *) * g_vm.gray_capacity);
@@ -55,6 +69,30 @@ void mark_object(Obj *object) {
 	g_vm.gray_stack[g_vm.gray_count++] = object;
 }
 
+// Each collection marks one generation: a minor one the young objects, a
+// major one the old objects.
+void mark_object(Obj *object) {
+	if (object == NULL) return;
+	if (is_marked(object)) return;
+	if (is_young(object) != young_only) return;
+	set_is_marked(object, true);
+	gray_object(object);
+}
+
+void remember(Obj *object) {
+	set_is_remembered(object, true);
+	if (g_vm.remembered_capacity < g_vm.remembered_count + 1) {
+		g_vm.remembered_capacity = GROW_CAPACITY(g_vm.remembered_capacity);
+		g_vm.remembered          = (Obj **)realloc(g_vm.remembered, sizeof(Obj *) * g_vm.remembered_capacity);
+		if (g_vm.remembered == NULL) exit(1);
+	}
+	g_vm.remembered[g_vm.remembered_count++] = object;
+}
+
+void revive(Obj *object) {
+	if (g_vm.gc_phase == GC_SWEEPING && !is_young(object)) set_is_marked(object, true);
+}
+
 void mark_value(Value value) {
 	if (IS_OBJ(value)) mark_object(AS_OBJ(value));
 }
@@ -65,12 +103,24 @@ static void mark_array(ValueArray *array) {
 	}
 }
 
-static void blacken_object(Obj *object) {
-#ifdef DEBUG_LOG_GC
-	printf("%p blacken ", (void *)object);
-	print_value((OBJ_VAL(object)));
-	printf("\n");
-#endif
+// mark_object() is shared by both copies of the collector, so the logged
+// copy reports what got marked from the gray stack, once it has been pushed.
+ALWAYS_INLINE void log_marks(bool log, int from) {
+	if (!log) return;
+	for (int i = from; i < g_vm.gray_count; i++) {
+		printf("%p mark ", (void *)g_vm.gray_stack[i]);
+		print_value(OBJ_VAL(g_vm.gray_stack[i]));
+		printf("\n");
+	}
+}
+
+ALWAYS_INLINE void blacken_object(Obj *object, bool log) {
+	int from = g_vm.gray_count;
+	if (log) {
+		printf("%p blacken ", (void *)object);
+		print_value((OBJ_VAL(object)));
+		printf("\n");
+	}
 	switch (obj_type(object)) {
 		case OBJ_BOUND_METHOD: {
 			ObjBoundMethod *bound = (ObjBoundMethod *)object;
@@ -96,6 +146,8 @@ static void blacken_object(Obj *object) {
 			ObjFunction *function = (ObjFunction *)object;
 			mark_object((Obj *)function->name);
 			mark_array(&function->chunk.constants);
+			mark_table(&function->consts);
+			mark_object((Obj *)function->script);
 			break;
 		}
 		case OBJ_INSTANCE: {
@@ -111,12 +163,11 @@ static void blacken_object(Obj *object) {
 		case OBJ_STRING:
 			break;
 	}
+	log_marks(log, from);
 }
 
-static void freeObject(Obj *object) {
-#ifdef DEBUG_LOG_GC
-	printf("%p free type %d\n", (void *)object, obj_type(object));
-#endif
+ALWAYS_INLINE void freeObject(Obj *object, bool log) {
+	if (log) printf("%p free type %d\n", (void *)object, obj_type(object));
 	switch (obj_type(object)) {
 		case OBJ_BOUND_METHOD:
 			FREE(ObjBoundMethod, object);
@@ -136,6 +187,11 @@ static void freeObject(Obj *object) {
 		case OBJ_FUNCTION: {
 			ObjFunction *function = (ObjFunction *)object;
 			free_chunk(&function->chunk);
+			freeTable(&function->consts);
+			if (function->source != NULL) FREE_ARRAY(char, function->source, function->source_length + 1);
+			if (function->native != NULL) free_native(function->native);
+			free_traces(function->traces);
+			FREE_ARRAY(Inlined, function->inlined, function->inlined_count);
 			FREE(ObjFunction, object);
 			break;
 		}
@@ -151,7 +207,7 @@ static void freeObject(Obj *object) {
 		}
 		case OBJ_STRING: {
 			ObjString *string = (ObjString *)object;
-			FREE_ARRAY(char, string->chars, string->length + 1);
+			if (!string->borrowed) FREE_ARRAY(char, string->chars, string->length + 1);
 			FREE(ObjString, object);
 			break;
 		}
@@ -161,8 +217,9 @@ static void freeObject(Obj *object) {
 	}
 }
 
-static void mark_roots() {
-	for (uint8_t i = 0; i < g_vm.stackCount; i++) {
+ALWAYS_INLINE void mark_roots(bool log) {
+	int from = g_vm.gray_count;
+	for (int i = 0; i < g_vm.stackCount; i++) {
 		mark_value(g_vm.stack[i]);
 	}
 	for (int i = 0; i < g_vm.frame_count; i++) {
@@ -172,61 +229,311 @@ static void mark_roots() {
 		mark_object((Obj *)upvalue);
 	}
 	mark_table(&g_vm.globals);
+	mark_table(&g_vm.modules);
+	mark_table(&g_vm.consts);
 	mark_compiler_roots();
 	mark_object((Obj *)g_vm.init_string);
+	log_marks(log, from);
 }
 
-static void trace_refs() {
-	while (g_vm.gray_count > 0) {
+// Blacken gray objects down to `floor` on the gray stack, or until `budget`
+// of them are done. What's left of the budget is returned.
+ALWAYS_INLINE int trace_refs(bool log, int floor, int budget) {
+	while (g_vm.gray_count > floor && budget > 0) {
 		Obj *object = g_vm.gray_stack[--g_vm.gray_count];
-		blacken_object(object);
+		blacken_object(object, log);
+		budget--;
 	}
+	return budget;
 }
 
-static void sweep() {
-	Obj *previous = NULL;
-	Obj *object   = g_vm.objects;
-	while (object != NULL) {
+// Free the old objects the sweep reaches that weren't marked, up to
+// `budget` of them, and move the rest back to the old generation. A string
+// the sweep has yet to reach can still be found in the string table, and
+// revive() marks it; a dead one leaves the table as it is freed.
+ALWAYS_INLINE int sweep(bool log, int budget) {
+	while (g_vm.sweeping != NULL && budget > 0) {
+		Obj *object   = g_vm.sweeping;
+		g_vm.sweeping = obj_next(object);
 		if (is_marked(object)) {
 			set_is_marked(object, false);
-			previous = object;
-			object   = obj_next(object);
+			set_obj_next(object, g_vm.objects);
+			g_vm.objects = object;
 		} else {
-			Obj *unreached = object;
-			object         = obj_next(object);
-			if (previous != NULL) {
-				set_obj_next(previous, object);
+			if (obj_type(object) == OBJ_STRING) tableDel(&g_vm.strings, (ObjString *)object);
+			freeObject(object, log);
+		}
+		budget--;
+	}
+	return budget;
+}
+
+// Free the nursery's unreached objects and promote the rest, which are old
+// from then on. While a major collection is marking, they are promoted gray,
+// since no barrier saw what they were given while young.
+ALWAYS_INLINE void sweep_young(bool log) {
+	Obj *object = g_vm.young;
+	while (object != NULL) {
+		Obj *next = obj_next(object);
+		if (is_marked(object)) {
+			set_is_young(object, false);
+			set_obj_next(object, g_vm.objects);
+			g_vm.objects = object;
+			if (g_vm.gc_phase == GC_MARKING) {
+				gray_object(object);
 			} else {
-				g_vm.objects = object;
+				set_is_marked(object, false);
 			}
-			freeObject(unreached);
+		} else {
+			if (obj_type(object) == OBJ_STRING) tableDel(&g_vm.strings, (ObjString *)object);
+			freeObject(object, log);
 		}
+		object = next;
 	}
+	g_vm.young       = NULL;
+	g_vm.young_bytes = 0;
 }
 
-void collect_garbage() {
-#ifdef DEBUG_LOG_GC
-	printf("-- gc begin\n");
+// Once the nursery is empty no old object points into it. One already
+// marked may have been given other old objects since, which marking has to
+// see, so it goes gray again.
+static void forget_remembered() {
+	for (int i = 0; i < g_vm.remembered_count; i++) {
+		Obj *object = g_vm.remembered[i];
+		set_is_remembered(object, false);
+		if (g_vm.gc_phase == GC_MARKING && is_marked(object)) gray_object(object);
+	}
+	g_vm.remembered_count = 0;
+}
+
+// The end of marking, in one pause. The roots and the nursery, which no
+// barrier watches, are traced again, and so are the old objects written to
+// since the last minor collection. Remembered objects left unmarked are dead,
+// and must not be traced from by a minor collection before the sweep frees them.
+ALWAYS_INLINE void finish_marking(bool log) {
+	mark_roots(log);
+	for (Obj *object = g_vm.young; object != NULL; object = obj_next(object)) blacken_object(object, log);
+	for (int i = 0; i < g_vm.remembered_count; i++) {
+		if (is_marked(g_vm.remembered[i])) blacken_object(g_vm.remembered[i], log);
+	}
+	trace_refs(log, 0, INT_MAX);
+	int count = 0;
+	for (int i = 0; i < g_vm.remembered_count; i++) {
+		if (is_marked(g_vm.remembered[i])) g_vm.remembered[count++] = g_vm.remembered[i];
+	}
+	g_vm.remembered_count = count;
+	g_vm.sweeping         = g_vm.objects;
+	g_vm.objects          = NULL;
+	g_vm.gc_phase         = GC_SWEEPING;
+}
+
+// A major collection, one step at a time: marking the old generation from
+// the roots, then sweeping it. Each step does up to the budget's worth of
+// objects, and the next comes GC_STEP_SIZE bytes of allocation later. The
+// program runs in between; write_barrier() makes sure what it stores into
+// objects already marked still gets marked.
+ALWAYS_INLINE void collect_step(bool log, int budget) {
+	size_t before = g_vm.bytes_allocated;
+	if (log) printf("-- gc step begin\n");
+	young_only = false;
+	if (g_vm.gc_phase == GC_IDLE) {
+		g_vm.gc_phase = GC_MARKING;
+		mark_roots(log);
+	}
+	if (g_vm.gc_phase == GC_MARKING) {
+		budget = trace_refs(log, 0, budget);
+		if (g_vm.gray_count == 0) finish_marking(log);
+	}
+	if (g_vm.gc_phase == GC_SWEEPING) {
+		sweep(log, budget);
+		if (g_vm.sweeping == NULL) g_vm.gc_phase = GC_IDLE;
+	}
+	if (g_debug.stress_gc) {
+		g_vm.next_gc = 0;
+	} else if (g_vm.gc_phase == GC_IDLE) {
+		g_vm.next_gc = g_vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+	} else {
+		g_vm.next_gc = g_vm.bytes_allocated + GC_STEP_SIZE;
+	}
+	if (log) {
+		printf("-- gc step end\n");
+		printf("   collected %zu bytes (de %zu à %zu) next at %zu\n", before - g_vm.bytes_allocated, before,
+		       g_vm.bytes_allocated, g_vm.next_gc);
+	}
+}
+
+// A minor collection: only the nursery is traced and swept. The roots and
+// the remembered old objects stand in for the rest of the heap, which can
+// only reach a young object through a store write_barrier() has seen. It
+// works above what a major collection has left gray.
+ALWAYS_INLINE void collect_minor(bool log) {
 	size_t before = g_vm.bytes_allocated;
-#endif
-	mark_roots();
-	trace_refs();
-	table_rm_white(&g_vm.strings);
-	sweep();
-	g_vm.next_gc = g_vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
-#ifdef DEBUG_LOG_GC
-	printf("-- gc end\n");
-	printf("   collected %zu bytes (de %zu à %zu) next at %zu\n", before - g_vm.bytes_allocated, before,
-	       g_vm.bytes_allocated, g_vm.next_gc);
-#endif
+	int floor     = g_vm.gray_count;
+	if (log) printf("-- minor gc begin\n");
+	young_only = true;
+	mark_roots(log);
+	for (int i = 0; i < g_vm.remembered_count; i++) blacken_object(g_vm.remembered[i], log);
+	trace_refs(log, floor, INT_MAX);
+	young_only = false;
+	forget_remembered();
+	sweep_young(log);
+	if (log) {
+		printf("-- minor gc end\n");
+		printf("   collected %zu bytes (de %zu à %zu)\n", before - g_vm.bytes_allocated, before, g_vm.bytes_allocated);
+	}
 }
 
-void freeObjects() {
-	Obj *object = g_vm.objects;
+static double monotonic_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void record_pause(uint64_t *histogram, double *longest, double start) {
+	double pause = monotonic_now() - start;
+	int bucket   = 0;
+	while (bucket < PAUSE_BUCKETS - 1 && pause * 1e6 >= (double)(1 << bucket)) bucket++;
+	histogram[bucket]++;
+	if (pause > *longest) *longest = pause;
+}
+
+void collect_garbage() {
+	// Stress mode collects at every allocation. Most of those only look at
+	// the nursery, so that minor collections get as much exercise.
+	if (g_debug.stress_gc && ++stress_count % 4 != 0) {
+		collect_young();
+		return;
+	}
+	double start = g_debug.gc_stats ? monotonic_now() : 0;
+	if (g_debug.log_gc) {
+		collect_step(true, g_debug.gc_budget);
+	} else {
+		collect_step(false, g_debug.gc_budget);
+	}
+	if (g_debug.gc_stats) record_pause(step_pauses, &longest_step, start);
+}
+
+void collect_young() {
+	double start = g_debug.gc_stats ? monotonic_now() : 0;
+	if (g_debug.log_gc) {
+		collect_minor(true);
+	} else {
+		collect_minor(false);
+	}
+	if (g_debug.gc_stats) record_pause(minor_pauses, &longest_minor, start);
+}
+
+void finish_collection() {
+	while (g_vm.gc_phase != GC_IDLE) collect_step(false, INT_MAX);
+}
+
+void print_gc_stats() {
+	fprintf(stderr, "-- gc pauses       minor      step\n");
+	for (int i = 0; i < PAUSE_BUCKETS; i++) {
+		if (minor_pauses[i] == 0 && step_pauses[i] == 0) continue;
+		fprintf(stderr, "   < %8dus %9llu %9llu\n", 1 << i, (unsigned long long)minor_pauses[i],
+		        (unsigned long long)step_pauses[i]);
+	}
+	fprintf(stderr, "   longest   %8.0fus %7.0fus\n", longest_minor * 1e6, longest_step * 1e6);
+}
+
+void init_heap(Heap *heap) {
+	heap->objects         = NULL;
+	heap->bytes_allocated = 0;
+	initTable(&heap->strings);
+}
+
+// The string `string` stands for once its heap is merged: itself, or the
+// copy the VM had already interned.
+static ObjString *interned_as(Heap *heap, ObjString *string) {
+	Value interned;
+	if (string != NULL && tableGet(&heap->strings, string, &interned) && IS_OBJ(interned)) return AS_STRING(interned);
+	return string;
+}
+
+void merge_heap(Heap *heap) {
+	// Interning below may grow the VM's table, and a collection then would find
+	// the heap's objects neither marked nor on the object list.
+	size_t next_gc      = g_vm.next_gc;
+	size_t nursery_size = g_vm.nursery_size;
+	g_vm.next_gc        = SIZE_MAX;
+	g_vm.nursery_size   = SIZE_MAX;
+	g_vm.bytes_allocated += heap->bytes_allocated;
+
+	// A heap merged earlier may have interned the same characters. Its string
+	// wins, and ours is recorded as a duplicate by pointing at it.
+	for (int i = 0; i < heap->strings.capacity; i++) {
+		Entry *entry = &heap->strings.entries[i];
+		if (entry->key == NULL) continue;
+		ObjString *string   = entry->key;
+		ObjString *interned = tableFindString(&g_vm.strings, string->chars, string->length, string->hash);
+		if (interned == NULL) {
+			tableSet(&g_vm.strings, string, NIL_VAL);
+		} else {
+			entry->value = OBJ_VAL(interned);
+		}
+	}
+
+	// Compiled code only refers to strings through names and constants. They
+	// are all pointed at the winners before any duplicate is freed, since the
+	// list is newest first and a function comes after its strings.
+	for (Obj *object = heap->objects; object != NULL; object = obj_next(object)) {
+		if (obj_type(object) == OBJ_FUNCTION) {
+			ObjFunction *function = (ObjFunction *)object;
+			function->name        = interned_as(heap, function->name);
+			for (int i = 0; i < function->chunk.constants.count; i++) {
+				Value *constant = &function->chunk.constants.values[i];
+				if (IS_STRING(*constant)) *constant = OBJ_VAL(interned_as(heap, AS_STRING(*constant)));
+			}
+			if (function->consts.count > 0) {
+				Table consts;
+				initTable(&consts);
+				for (int i = 0; i < function->consts.capacity; i++) {
+					Entry *entry = &function->consts.entries[i];
+					if (entry->key == NULL) continue;
+					Value value = entry->value;
+					if (IS_STRING(value)) value = OBJ_VAL(interned_as(heap, AS_STRING(value)));
+					tableSet(&consts, interned_as(heap, entry->key), value);
+				}
+				freeTable(&function->consts);
+				function->consts = consts;
+			}
+		}
+	}
+
+	Obj *object = heap->objects;
+	while (object != NULL) {
+		Obj *next = obj_next(object);
+		if (obj_type(object) == OBJ_STRING && interned_as(heap, (ObjString *)object) != (ObjString *)object) {
+			freeObject(object, false);
+			object = next;
+			continue;
+		}
+		// Adopted like objects just allocated, since the strings interned as
+		// above may be young.
+		set_obj_next(object, g_vm.young);
+		g_vm.young = object;
+		object     = next;
+	}
+	g_vm.young_bytes += heap->bytes_allocated;
+	freeTable(&heap->strings);
+	init_heap(heap);
+	g_vm.next_gc      = next_gc;
+	g_vm.nursery_size = nursery_size;
+}
+
+static void free_list(Obj *object) {
 	while (object != NULL) {
 		Obj *next = obj_next(object);
-		freeObject(object);
+		freeObject(object, false);
 		object = next;
 	}
+}
+
+void freeObjects() {
+	free_list(g_vm.objects);
+	free_list(g_vm.sweeping);
+	free_list(g_vm.young);
 	free(g_vm.gray_stack);
+	free(g_vm.remembered);
 }
@@ -17,11 +17,41 @@
 #define FREE_ARRAY(type, pointer, oldCount)                                    \
 	reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// Bytes of new objects between minor collections.
+#define NURSERY_SIZE (256 * 1024)
+
+// Objects made by a compile on a worker thread. They stay out of the VM's heap,
+// which that thread must not touch, until merge_heap() adopts them.
+typedef struct {
+	Obj *objects;
+	Table strings;
+	size_t bytes_allocated;
+} Heap;
+
+// Set on worker threads; NULL on the thread that owns the VM.
+extern _Thread_local Heap *g_heap;
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+void init_heap(Heap *heap);
+void merge_heap(Heap *heap);
 void mark_object(Obj *object);
 void mark_value(Value value); 
+void remember(Obj *object);
+void revive(Obj *object);
 void collect_garbage();
+void collect_young();
+void finish_collection();
+void print_gc_stats();
 void freeObjects();
 
+// After storing into `object` something that may be young, or an old object
+// marking hasn't reached. An old object written to goes on the remembered
+// set, which minor collections trace from instead of the whole old
+// generation, and which a major collection marks from again before it is
+// done.
+static inline void write_barrier(Obj *object) {
+	if (!is_young(object) && !is_remembered(object)) remember(object);
+}
+
 
 #endif
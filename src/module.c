@@ -0,0 +1,898 @@
+#include "module.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "debug.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+#include "value.h"
+#include "vm.h"
+
+// A bytecode image is laid out to be mapped and run in place. After the header
+// come the string, function and constant records, then the line tables, code
+// and string characters they point at. Offsets count from the start of the
+// file, which is padded to a multiple of 8 bytes and in the host's byte order.
+// Loading only creates the objects and intern table entries; code, line tables
+// and characters stay in the mapping, shared between processes.
+//
+// With CLOX_STRIP_DEBUG the line tables go to a side file instead, `.lines`
+// appended to the image's name, which is only mapped if a line is asked for.
+#define IMAGE_MAGIC  "LOXC"
+#define IMAGE_FORMAT 5
+#define LINES_MAGIC  "LOXL"
+
+typedef struct {
+	char magic[4];
+	uint32_t format;
+	uint32_t bytecode;  // BYTECODE_VERSION
+	uint32_t function_count;
+	uint32_t string_count;
+	uint32_t constant_count;
+	uint32_t stripped;  // line tables are in the side file
+	uint32_t const_count;
+	uint64_t source_hash;
+	uint64_t source_length;
+	uint64_t image_size;
+	uint64_t checksum;  // of everything after the header
+} ImageHeader;
+
+typedef struct {
+	uint32_t hash;
+	uint32_t length;
+	uint64_t chars;  // NUL terminated
+} StringRecord;
+
+// A finished Lignes, see finish_lines().
+typedef struct {
+	uint32_t packed_size;
+	uint32_t sample_count;
+	uint64_t packed;
+	uint64_t samples;
+} LineRecord;
+
+// Function 0 is the script. The others follow breadth first, so a function
+// only refers to higher-numbered ones.
+typedef struct {
+	int32_t arity;
+	int32_t upvalue_count;
+	int32_t kind;
+	int32_t name;  // string index, -1 for none
+	uint32_t code_count;
+	uint32_t constant_first;
+	uint32_t constant_count;
+	uint32_t max_stack;
+	uint64_t code;
+	LineRecord lines;  // all zero when stripped
+} FunctionRecord;
+
+// The side file of a stripped image: this header, then a LineRecord for each
+// of the image's functions in the same order.
+typedef struct {
+	char magic[4];
+	uint32_t function_count;
+	uint64_t image_checksum;  // of the image it belongs to
+	uint64_t size;
+	uint64_t checksum;  // of everything after the header
+} LinesHeader;
+
+typedef enum {
+	CONSTANT_NIL,
+	CONSTANT_BOOL,
+	CONSTANT_NUMBER,
+	CONSTANT_STRING,
+	CONSTANT_FUNCTION
+} ConstantTag;
+
+typedef struct {
+	uint32_t tag;
+	uint32_t index;  // string or function index, or the boolean
+	double number;
+} ConstantRecord;
+
+// One of the script's const declarations, after the constants.
+typedef struct {
+	uint32_t name;  // string index
+	uint32_t padding;
+	ConstantRecord value;  // never a function
+} ConstRecord;
+
+typedef struct MappedImage {
+	struct MappedImage *next;
+	void *base;
+	size_t size;
+	// The side file of a stripped image, mapped on first use.
+	char *lines_path;
+	void *lines_base;
+	size_t lines_size;
+} MappedImage;
+
+// Loaded images stay mapped until the VM is freed, since their code and
+// strings are used in place.
+static MappedImage *g_images = NULL;
+
+// Read what cannot be mapped, like a pipe, until it ends.
+static bool read_all(int fd, Source *source) {
+	size_t capacity = 4096;
+	size_t length   = 0;
+	char *buffer    = (char *)malloc(capacity);
+	for (;;) {
+		if (buffer == NULL) return false;
+		ssize_t n = read(fd, buffer + length, capacity - length);
+		if (n < 0) {
+			free(buffer);
+			return false;
+		}
+		if (n == 0) break;
+		length += n;
+		if (length == capacity) {
+			capacity *= 2;
+			char *grown = (char *)realloc(buffer, capacity);
+			if (grown == NULL) free(buffer);
+			buffer = grown;
+		}
+	}
+	source->chars  = buffer;
+	source->length = length;
+	source->mapped = false;
+	return true;
+}
+
+// Map the file at `path` read-only, or read it if it cannot be mapped. The
+// source is not NUL terminated. False if the file cannot be read.
+bool open_source(const char *path, Source *source) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat info;
+	bool ok = false;
+	if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+		void *chars = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (chars != MAP_FAILED) {
+			madvise(chars, info.st_size, MADV_SEQUENTIAL);
+			source->chars  = (const char *)chars;
+			source->length = info.st_size;
+			source->mapped = true;
+			ok             = true;
+		}
+	}
+	if (!ok) ok = read_all(fd, source);
+	close(fd);
+	return ok;
+}
+
+void close_source(Source *source) {
+	if (source->mapped) {
+		munmap((void *)source->chars, source->length);
+	} else {
+		free((void *)source->chars);
+	}
+	source->chars  = NULL;
+	source->length = 0;
+}
+
+// 64-bit FNV-1a, wider than hashString() since a collision here would run
+// stale code.
+static uint64_t hash_source(const char *src, size_t length) {
+	uint64_t hash = 0xcbf29ce484222325u;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (uint8_t)src[i];
+		hash *= 0x100000001b3u;
+	}
+	return hash;
+}
+
+// `foo.lox` caches into `foo.loxc`, anything else gets `.loxc` appended.
+static char *cache_path(const char *path) {
+	size_t length = strlen(path);
+	bool lox      = length >= 4 && strcmp(path + length - 4, ".lox") == 0;
+	char *result  = (char *)malloc(length + 6);
+	if (result == NULL) exit(1);
+	memcpy(result, path, length);
+	strcpy(result + length, lox ? "c" : ".loxc");
+	return result;
+}
+
+static uint64_t checksum(const uint8_t *bytes, size_t size) {
+	uint64_t hash = 0xcbf29ce484222325u;
+	for (size_t i = 0; i < size; i += 8) {
+		uint64_t word;
+		memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3u;
+		hash ^= hash >> 32;
+	}
+	return hash;
+}
+
+typedef struct {
+	uint8_t *data;
+	size_t count;
+	size_t capacity;
+	ObjFunction **functions;
+	int function_count;
+	int function_capacity;
+	ObjString **strings;
+	int string_count;
+	int string_capacity;
+	Table string_index;  // string -> its index, as a number
+	uint32_t constant_count;
+} ImageWriter;
+
+#define GROW_LIST(type, list, count, capacity)                                     \
+	do {                                                                           \
+		if ((capacity) < (count) + 1) {                                            \
+			(capacity) = GROW_CAPACITY(capacity);                                  \
+			(list)     = (type *)realloc((list), sizeof(type) * (capacity));       \
+			if ((list) == NULL) exit(1);                                           \
+		}                                                                          \
+	} while (false)
+
+static int32_t string_index(ImageWriter *writer, ObjString *string) {
+	if (string == NULL) return -1;
+	Value index;
+	if (tableGet(&writer->string_index, string, &index)) return (int32_t)AS_NUMBER(index);
+	GROW_LIST(ObjString *, writer->strings, writer->string_count, writer->string_capacity);
+	writer->strings[writer->string_count] = string;
+	tableSet(&writer->string_index, string, NUMBER_VAL(writer->string_count));
+	return writer->string_count++;
+}
+
+static void add_function(ImageWriter *writer, ObjFunction *function) {
+	GROW_LIST(ObjFunction *, writer->functions, writer->function_count, writer->function_capacity);
+	writer->functions[writer->function_count++] = function;
+}
+
+// Number functions breadth first and strings by first use.
+static void collect(ImageWriter *writer, ObjFunction *script) {
+	add_function(writer, script);
+	for (int i = 0; i < script->consts.capacity; i++) {
+		Entry *entry = &script->consts.entries[i];
+		if (entry->key == NULL) continue;
+		string_index(writer, entry->key);
+		if (IS_STRING(entry->value)) string_index(writer, AS_STRING(entry->value));
+	}
+	for (int i = 0; i < writer->function_count; i++) {
+		ObjFunction *function = writer->functions[i];
+		writer->constant_count += function->chunk.constants.count;
+		string_index(writer, function->name);
+		for (int j = 0; j < function->chunk.constants.count; j++) {
+			Value value = function->chunk.constants.values[j];
+			if (IS_STRING(value)) string_index(writer, AS_STRING(value));
+			if (IS_FUNCTION(value)) add_function(writer, AS_FUNCTION(value));
+		}
+	}
+}
+
+// Append `size` bytes aligned to `align`, returning their offset. Records are
+// written through offsets too, since the buffer moves as it grows.
+static uint64_t append(ImageWriter *writer, const void *bytes, size_t size, size_t align) {
+	size_t offset = (writer->count + align - 1) & ~(align - 1);
+	if (offset + size > writer->capacity) {
+		while (offset + size > writer->capacity) writer->capacity = GROW_CAPACITY(writer->capacity);
+		writer->data = (uint8_t *)realloc(writer->data, writer->capacity);
+		if (writer->data == NULL) exit(1);
+	}
+	memset(writer->data + writer->count, 0, offset - writer->count);
+	if (bytes != NULL) {
+		memcpy(writer->data + offset, bytes, size);
+	} else {
+		memset(writer->data + offset, 0, size);
+	}
+	writer->count = offset + size;
+	return offset;
+}
+
+static LineRecord append_lines(ImageWriter *writer, Lignes *lines) {
+	LineRecord record;
+	record.packed_size  = lines->packed_size;
+	record.sample_count = lines->sample_count;
+	record.samples      = append(writer, lines->samples, sizeof(LineSample) * lines->sample_count, 8);
+	record.packed       = append(writer, lines->packed, lines->packed_size, 1);
+	return record;
+}
+
+// Any constant but a function, which is numbered by collect() instead.
+static ConstantRecord constant_record(ImageWriter *writer, Value value) {
+	ConstantRecord constant;
+	memset(&constant, 0, sizeof(constant));
+	if (IS_NIL(value)) {
+		constant.tag = CONSTANT_NIL;
+	} else if (IS_BOOL(value)) {
+		constant.tag   = CONSTANT_BOOL;
+		constant.index = AS_BOOL(value);
+	} else if (IS_NUMBER(value)) {
+		constant.tag    = CONSTANT_NUMBER;
+		constant.number = AS_NUMBER(value);
+	} else {
+		constant.tag   = CONSTANT_STRING;
+		constant.index = string_index(writer, AS_STRING(value));
+	}
+	return constant;
+}
+
+// Line tables go into `side` when it isn't NULL, see LinesHeader.
+static void build_image(ImageWriter *writer, ImageWriter *side, ObjFunction *script, ImageHeader *header) {
+	collect(writer, script);
+	append(writer, NULL, sizeof(ImageHeader), 8);
+	uint64_t side_records = 0;
+	if (side != NULL) {
+		append(side, NULL, sizeof(LinesHeader), 8);
+		side_records = append(side, NULL, sizeof(LineRecord) * writer->function_count, 8);
+	}
+	uint64_t strings   = append(writer, NULL, sizeof(StringRecord) * writer->string_count, 8);
+	uint64_t functions = append(writer, NULL, sizeof(FunctionRecord) * writer->function_count, 8);
+	uint64_t constants = append(writer, NULL, sizeof(ConstantRecord) * writer->constant_count, 8);
+	uint64_t consts    = append(writer, NULL, sizeof(ConstRecord) * script->consts.count, 8);
+
+	uint32_t constant_next = 0;
+	uint32_t child_next    = 1;  // function constants come up in the order collect() numbered them
+	for (int i = 0; i < writer->function_count; i++) {
+		ObjFunction *function = writer->functions[i];
+		Chunk *chunk          = &function->chunk;
+		FunctionRecord record;
+		memset(&record, 0, sizeof(record));
+		record.arity          = function->arity;
+		record.upvalue_count  = function->upvalue_count;
+		record.kind           = function->kind;
+		record.name           = string_index(writer, function->name);
+		record.code_count     = chunk->count;
+		record.constant_first = constant_next;
+		record.constant_count = chunk->constants.count;
+		record.max_stack      = function->max_stack;
+		record.code           = append(writer, chunk->code, chunk->count, 1);
+		if (side == NULL) {
+			record.lines = append_lines(writer, &chunk->lines);
+		} else {
+			LineRecord lines = append_lines(side, &chunk->lines);
+			memcpy(side->data + side_records + sizeof(LineRecord) * i, &lines, sizeof(lines));
+		}
+		memcpy(writer->data + functions + sizeof(FunctionRecord) * i, &record, sizeof(record));
+
+		for (int j = 0; j < chunk->constants.count; j++) {
+			Value value = chunk->constants.values[j];
+			ConstantRecord constant;
+			if (IS_FUNCTION(value)) {
+				memset(&constant, 0, sizeof(constant));
+				constant.tag   = CONSTANT_FUNCTION;
+				constant.index = child_next++;
+			} else {
+				constant = constant_record(writer, value);
+			}
+			memcpy(writer->data + constants + sizeof(ConstantRecord) * constant_next++, &constant, sizeof(constant));
+		}
+	}
+
+	uint32_t const_next = 0;
+	for (int i = 0; i < script->consts.capacity; i++) {
+		Entry *entry = &script->consts.entries[i];
+		if (entry->key == NULL) continue;
+		ConstRecord record;
+		memset(&record, 0, sizeof(record));
+		record.name  = string_index(writer, entry->key);
+		record.value = constant_record(writer, entry->value);
+		memcpy(writer->data + consts + sizeof(ConstRecord) * const_next++, &record, sizeof(record));
+	}
+
+	for (int i = 0; i < writer->string_count; i++) {
+		ObjString *string = writer->strings[i];
+		StringRecord record;
+		record.hash   = string->hash;
+		record.length = string->length;
+		record.chars  = append(writer, string->chars, string->length + 1, 1);
+		memcpy(writer->data + strings + sizeof(StringRecord) * i, &record, sizeof(record));
+	}
+
+	append(writer, NULL, 0, 8);
+	header->function_count = writer->function_count;
+	header->string_count   = writer->string_count;
+	header->constant_count = writer->constant_count;
+	header->const_count    = script->consts.count;
+	header->stripped       = side != NULL;
+	header->image_size     = writer->count;
+	header->checksum       = checksum(writer->data + sizeof(ImageHeader), writer->count - sizeof(ImageHeader));
+	memcpy(writer->data, header, sizeof(*header));
+
+	if (side != NULL) {
+		append(side, NULL, 0, 8);
+		LinesHeader lines;
+		memcpy(lines.magic, LINES_MAGIC, sizeof(lines.magic));
+		lines.function_count = writer->function_count;
+		lines.image_checksum = header->checksum;
+		lines.size           = side->count;
+		lines.checksum       = checksum(side->data + sizeof(LinesHeader), side->count - sizeof(LinesHeader));
+		memcpy(side->data, &lines, sizeof(lines));
+	}
+}
+
+static char *lines_path(const char *image) {
+	size_t length = strlen(image);
+	char *result  = (char *)malloc(length + 7);
+	if (result == NULL) exit(1);
+	memcpy(result, image, length);
+	strcpy(result + length, ".lines");
+	return result;
+}
+
+// Written under a temporary name and renamed into place, so that concurrent
+// runs never map half a file.
+static void write_file(const char *path, const uint8_t *data, size_t size) {
+	char temp[4096];
+	if (snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)getpid()) >= (int)sizeof(temp)) return;
+	FILE *file = fopen(temp, "wb");
+	if (file == NULL) return;
+	bool ok = fwrite(data, 1, size, file) == size;
+	ok      = fclose(file) == 0 && ok;
+	if (!ok || rename(temp, path) != 0) remove(temp);
+}
+
+// A stripped image's side file goes first, so the image is never found
+// without it.
+static void write_image(const char *path, ObjFunction *script, ImageHeader *header) {
+	ImageWriter writer, side;
+	memset(&writer, 0, sizeof(writer));
+	memset(&side, 0, sizeof(side));
+	initTable(&writer.string_index);
+	build_image(&writer, g_debug.strip_debug ? &side : NULL, script, header);
+
+	if (g_debug.strip_debug) {
+		char *side_path = lines_path(path);
+		write_file(side_path, side.data, side.count);
+		free(side_path);
+	}
+	write_file(path, writer.data, writer.count);
+	freeTable(&writer.string_index);
+	free(writer.functions);
+	free(writer.strings);
+	free(writer.data);
+	free(side.data);
+}
+
+static bool in_image(uint64_t offset, uint64_t size, size_t image_size) {
+	return offset <= image_size && size <= image_size - offset;
+}
+
+// getLineByNumber() stops at the end of the packed bytes by itself, but starts
+// from the samples, so those must be in order and point inside.
+static bool valid_lines(const uint8_t *base, size_t size, const LineRecord *lines) {
+	if (lines->packed_size > INT32_MAX || lines->sample_count > INT32_MAX || lines->samples % 8 != 0 ||
+	    !in_image(lines->packed, lines->packed_size, size) ||
+	    !in_image(lines->samples, sizeof(LineSample) * (uint64_t)lines->sample_count, size)) {
+		return false;
+	}
+	int32_t previous = 0;
+	for (uint32_t i = 0; i < lines->sample_count; i++) {
+		LineSample sample;
+		memcpy(&sample, base + lines->samples + sizeof(LineSample) * i, sizeof(sample));
+		if (sample.offset < previous || sample.position < 0 || (uint32_t)sample.position >= lines->packed_size) {
+			return false;
+		}
+		previous = sample.offset;
+	}
+	return true;
+}
+
+static void use_lines(Lignes *lines, const uint8_t *base, const LineRecord *record) {
+	lines->packed       = base + record->packed;
+	lines->samples      = (const LineSample *)(base + record->samples);
+	lines->packed_size  = (int)record->packed_size;
+	lines->sample_count = (int)record->sample_count;
+	lines->mapped       = true;
+}
+
+static uint32_t read_operand(const uint8_t *code, uint32_t at, bool wide) {
+	return wide ? code[at] | code[at + 1] << 8 | code[at + 2] << 16 : code[at];
+}
+
+// The tag of constant `index` of `function`, or -1 past its constants.
+static int constant_tag(const uint8_t *base, uint64_t constants, const FunctionRecord *function, uint32_t index,
+                        uint32_t *function_index) {
+	if (index >= function->constant_count) return -1;
+	ConstantRecord constant;
+	memcpy(&constant, base + constants + sizeof(ConstantRecord) * (function->constant_first + index), sizeof(constant));
+	*function_index = constant.index;
+	return (int)constant.tag;
+}
+
+// The code of `function` holds up to what run() takes from the compiler on
+// trust: every instruction is whole and known, indices are in range and name
+// a constant of the right kind, local slots are under max_stack, OP_CLOSURE's
+// upvalues are encoded for the function it makes, and jumps land on the start
+// of an instruction. The last one doesn't fall through, so neither does any.
+static bool valid_code(const uint8_t *base, uint64_t functions, uint64_t constants, const FunctionRecord *function) {
+	const uint8_t *code = base + function->code;
+	uint32_t count      = function->code_count;
+	if (count == 0) return false;
+	// A bit for the start of each instruction and one for each jump target.
+	uint8_t *marks = (uint8_t *)calloc(count, 1);
+	if (marks == NULL) exit(1);
+	bool valid  = true;
+	uint8_t op  = OP_RETURN;
+	uint32_t at = 0;
+	while (valid && at < count) {
+		marks[at] |= 1;
+		bool wide      = code[at] == OP_WIDE;
+		uint32_t start = at + wide;
+		uint32_t width = wide ? 3 : 1;
+		if (start >= count) {
+			valid = false;
+			break;
+		}
+		op             = code[start];
+		uint32_t next  = start + 1 + width;  // past the operands, for most instructions
+		uint32_t index = next <= count ? read_operand(code, start + 1, wide) : 0;
+		uint32_t child = 0;
+		switch (op) {
+			case OP_CONSTANT: {
+				int tag = constant_tag(base, constants, function, index, &child);
+				valid   = tag >= 0 && tag != CONSTANT_FUNCTION;
+				break;
+			}
+			case OP_GET_GLOBAL:
+			case OP_DEFINE_GLOBAL:
+			case OP_SET_GLOBAL:
+			case OP_GET_PROPERTY:
+			case OP_SET_PROPERTY:
+			case OP_GET_SUPER:
+			case OP_CLASS:
+			case OP_METHOD:
+			case OP_IMPORT:
+				valid = constant_tag(base, constants, function, index, &child) == CONSTANT_STRING;
+				break;
+			case OP_INVOKE:
+			case OP_SUPER_INVOKE:
+				next += 1;  // the argument count
+				valid = constant_tag(base, constants, function, index, &child) == CONSTANT_STRING;
+				break;
+			case OP_GET_LOCAL:
+			case OP_SET_LOCAL:
+				valid = index < function->max_stack;
+				break;
+			case OP_GET_UPVALUE:
+			case OP_SET_UPVALUE:
+				valid = index < (uint32_t)function->upvalue_count;
+				break;
+			case OP_CLOSURE: {
+				if (constant_tag(base, constants, function, index, &child) != CONSTANT_FUNCTION) {
+					valid = false;
+					break;
+				}
+				FunctionRecord record;
+				memcpy(&record, base + functions + sizeof(FunctionRecord) * child, sizeof(record));
+				for (int32_t i = 0; valid && i < record.upvalue_count; i++) {
+					if (next + 1 + width > count) {
+						valid = false;
+						break;
+					}
+					uint8_t is_local = code[next];
+					uint32_t slot    = read_operand(code, next + 1, wide);
+					valid = is_local == 1 ? slot < function->max_stack
+					                      : is_local == 0 && slot < (uint32_t)function->upvalue_count;
+					next += 1 + width;
+				}
+				break;
+			}
+			case OP_CALL:
+			case OP_BUILD_STRING:
+				valid = !wide;
+				break;
+			case OP_JUMP:
+			case OP_JUMP_IF_FALSE:
+			case OP_JUMP_IF_TRUE:
+			case OP_LOOP: {
+				next = start + 3;
+				if (wide || next > count) {
+					valid = false;
+					break;
+				}
+				uint32_t jump = code[start + 1] << 8 | code[start + 2];
+				if (op == OP_LOOP ? jump > next : next + jump >= count) {
+					valid = false;
+					break;
+				}
+				marks[op == OP_LOOP ? next - jump : next + jump] |= 2;
+				break;
+			}
+			case OP_WIDE:
+			// Only the optimizing tier emits these, never into an image.
+			case OP_IS_NUMBER:
+			case OP_NEW:
+				valid = false;
+				break;
+			default:
+				next  = start + 1;
+				valid = !wide && op < OP_NEW;
+				break;
+		}
+		if (next > count) valid = false;
+		at = next;
+	}
+	valid = valid && (op == OP_RETURN || op == OP_JUMP || op == OP_LOOP);
+	for (uint32_t i = 0; valid && i < count; i++) {
+		if (marks[i] == 2) valid = false;
+	}
+	free(marks);
+	return valid;
+}
+
+// Everything materialize() relies on: the header matches, the checksum holds,
+// and every offset and index stays inside the image.
+static bool validate_image(const uint8_t *base, size_t size, const ImageHeader *expected) {
+	ImageHeader header;
+	if (size < sizeof(header) || size % 8 != 0) return false;
+	memcpy(&header, base, sizeof(header));
+	if (memcmp(header.magic, expected->magic, sizeof(header.magic)) != 0 || header.format != expected->format ||
+	    header.bytecode != expected->bytecode || header.source_hash != expected->source_hash ||
+	    header.source_length != expected->source_length || header.image_size != size || header.function_count == 0) {
+		return false;
+	}
+	uint64_t strings   = sizeof(ImageHeader);
+	uint64_t functions = strings + sizeof(StringRecord) * (uint64_t)header.string_count;
+	uint64_t constants = functions + sizeof(FunctionRecord) * (uint64_t)header.function_count;
+	uint64_t consts    = constants + sizeof(ConstantRecord) * (uint64_t)header.constant_count;
+	if (!in_image(consts, sizeof(ConstRecord) * (uint64_t)header.const_count, size)) return false;
+	if (checksum(base + sizeof(header), size - sizeof(header)) != header.checksum) return false;
+
+	for (uint32_t i = 0; i < header.string_count; i++) {
+		StringRecord string;
+		memcpy(&string, base + strings + sizeof(StringRecord) * i, sizeof(string));
+		if (string.length > INT32_MAX || !in_image(string.chars, (uint64_t)string.length + 1, size)) return false;
+		if (base[string.chars + string.length] != '\0') return false;
+	}
+	for (uint32_t i = 0; i < header.function_count; i++) {
+		FunctionRecord function;
+		memcpy(&function, base + functions + sizeof(FunctionRecord) * i, sizeof(function));
+		// Code whose depths agree never gets deeper than one push per
+		// instruction. materialize() checks the exact depth.
+		if (function.arity < 0 || function.upvalue_count < 0 || function.name < -1 ||
+		    function.name >= (int64_t)header.string_count || function.code_count > INT32_MAX ||
+		    function.max_stack < (uint64_t)function.arity + 1 ||
+		    function.max_stack > (uint64_t)function.arity + 1 + function.code_count ||
+		    !in_image(function.code, function.code_count, size) || !valid_lines(base, size, &function.lines) ||
+		    (uint64_t)function.constant_first + function.constant_count > header.constant_count) {
+			return false;
+		}
+
+		for (uint32_t c = 0; c < function.constant_count; c++) {
+			ConstantRecord constant;
+			memcpy(&constant, base + constants + sizeof(ConstantRecord) * (function.constant_first + c), sizeof(constant));
+			if (constant.tag > CONSTANT_FUNCTION) return false;
+			if (constant.tag == CONSTANT_STRING && constant.index >= header.string_count) return false;
+			if (constant.tag == CONSTANT_FUNCTION && (constant.index <= i || constant.index >= header.function_count)) {
+				return false;
+			}
+		}
+	}
+	// The script runs without a closure's upvalues or arguments.
+	FunctionRecord script;
+	memcpy(&script, base + functions, sizeof(script));
+	if (script.arity != 0 || script.upvalue_count != 0) return false;
+	// Only once every constant is known to be in range.
+	for (uint32_t i = 0; i < header.function_count; i++) {
+		FunctionRecord function;
+		memcpy(&function, base + functions + sizeof(FunctionRecord) * i, sizeof(function));
+		if (!valid_code(base, functions, constants, &function)) return false;
+	}
+	for (uint32_t i = 0; i < header.const_count; i++) {
+		ConstRecord record;
+		memcpy(&record, base + consts + sizeof(ConstRecord) * i, sizeof(record));
+		if (record.name >= header.string_count || record.value.tag > CONSTANT_STRING) return false;
+		if (record.value.tag == CONSTANT_STRING && record.value.index >= header.string_count) return false;
+	}
+	return true;
+}
+
+// The value of a validated constant record, whose strings and functions are
+// on the stack from `first_string` and `first_function`.
+static Value constant_value(const ConstantRecord *constant, int first_string, int first_function) {
+	switch (constant->tag) {
+		case CONSTANT_BOOL:
+			return BOOL_VAL(constant->index != 0);
+		case CONSTANT_NUMBER:
+			return NUMBER_VAL(constant->number);
+		case CONSTANT_STRING:
+			return g_vm.stack[first_string + constant->index];
+		case CONSTANT_FUNCTION:
+			return g_vm.stack[first_function + constant->index];
+		default:
+			return NIL_VAL;
+	}
+}
+
+// Build the objects for a validated image. They sit on the stack until every
+// one is created, strings first and then functions, in image order. NULL if
+// a function's recorded max_stack is not the depth its code reaches.
+static ObjFunction *materialize(MappedImage *image) {
+	const uint8_t *base = (const uint8_t *)image->base;
+	ImageHeader header;
+	memcpy(&header, base, sizeof(header));
+	uint64_t strings   = sizeof(ImageHeader);
+	uint64_t functions = strings + sizeof(StringRecord) * (uint64_t)header.string_count;
+	uint64_t constants = functions + sizeof(FunctionRecord) * (uint64_t)header.function_count;
+	int first_string   = g_vm.stackCount;
+	int first_function = first_string + header.string_count;
+
+	for (uint32_t i = 0; i < header.string_count; i++) {
+		StringRecord string;
+		memcpy(&string, base + strings + sizeof(StringRecord) * i, sizeof(string));
+		push(OBJ_VAL(borrowString((const char *)base + string.chars, string.length, string.hash)));
+	}
+	for (uint32_t i = 0; i < header.function_count; i++) {
+		push(OBJ_VAL(new_function()));
+	}
+
+	for (uint32_t i = 0; i < header.function_count; i++) {
+		FunctionRecord record;
+		memcpy(&record, base + functions + sizeof(FunctionRecord) * i, sizeof(record));
+		ObjFunction *function   = AS_FUNCTION(g_vm.stack[first_function + i]);
+		function->arity         = record.arity;
+		function->upvalue_count = record.upvalue_count;
+		function->max_stack     = record.max_stack;
+		function->kind          = record.kind;
+		function->name          = record.name < 0 ? NULL : AS_STRING(g_vm.stack[first_string + record.name]);
+
+		Chunk *chunk          = &function->chunk;
+		chunk->code           = (uint8_t *)base + record.code;
+		chunk->count          = record.code_count;
+		if (header.stripped) {
+			chunk->lines.stripped = image;
+			chunk->lines.function = (int)i;
+		} else {
+			use_lines(&chunk->lines, base, &record.lines);
+		}
+		Value *values         = ALLOCATE(Value, record.constant_count);
+		for (uint32_t c = 0; c < record.constant_count; c++) {
+			ConstantRecord constant;
+			memcpy(&constant, base + constants + sizeof(ConstantRecord) * (record.constant_first + c), sizeof(constant));
+			values[c] = constant_value(&constant, first_string, first_function);
+		}
+		chunk->constants.values   = values;
+		chunk->constants.capacity = record.constant_count;
+		chunk->constants.count    = record.constant_count;
+		write_barrier((Obj *)function);
+	}
+
+	// Calls reserve max_stack and the pushes in the body don't check it, so it
+	// must be what the code needs. The walk needs OP_CLOSURE's functions.
+	for (uint32_t i = 0; i < header.function_count; i++) {
+		ObjFunction *function = AS_FUNCTION(g_vm.stack[first_function + i]);
+		int error;
+		int max_stack = max_stack_depth(&function->chunk, function->arity + 1, &error);
+		if (error >= 0 || max_stack != function->max_stack) {
+			g_vm.stackCount = first_string;
+			return NULL;
+		}
+	}
+
+	ObjFunction *script = AS_FUNCTION(g_vm.stack[first_function]);
+	uint64_t consts     = constants + sizeof(ConstantRecord) * (uint64_t)header.constant_count;
+	for (uint32_t i = 0; i < header.const_count; i++) {
+		ConstRecord record;
+		memcpy(&record, base + consts + sizeof(ConstRecord) * i, sizeof(record));
+		Value value = constant_value(&record.value, first_string, first_function);
+		tableSet(&script->consts, AS_STRING(g_vm.stack[first_string + record.name]), value);
+	}
+	g_vm.stackCount = first_string;
+	return script;
+}
+
+static ObjFunction *load_image(const char *path, const ImageHeader *expected) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat info;
+	void *base = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(ImageHeader)) {
+		base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (base == MAP_FAILED) return NULL;
+	if (!validate_image((const uint8_t *)base, info.st_size, expected)) {
+		munmap(base, info.st_size);
+		return NULL;
+	}
+
+	MappedImage *image = (MappedImage *)malloc(sizeof(MappedImage));
+	if (image == NULL) exit(1);
+	image->base       = base;
+	image->size       = info.st_size;
+	image->lines_path = lines_path(path);
+	image->lines_base = NULL;
+	image->lines_size = 0;
+	image->next       = g_images;
+	g_images          = image;
+	return materialize(image);
+}
+
+static bool map_side_file(MappedImage *image) {
+	int fd = open(image->lines_path, O_RDONLY);
+	free(image->lines_path);
+	image->lines_path = NULL;
+	if (fd < 0) return false;
+	struct stat info;
+	void *base = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(LinesHeader)) {
+		base = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (base == MAP_FAILED) return false;
+
+	ImageHeader image_header;
+	LinesHeader header;
+	memcpy(&image_header, image->base, sizeof(image_header));
+	memcpy(&header, base, sizeof(header));
+	bool valid = memcmp(header.magic, LINES_MAGIC, sizeof(header.magic)) == 0 &&
+	             header.function_count == image_header.function_count &&
+	             header.image_checksum == image_header.checksum && header.size == (uint64_t)info.st_size &&
+	             info.st_size % 8 == 0 &&
+	             checksum((const uint8_t *)base + sizeof(header), info.st_size - sizeof(header)) == header.checksum &&
+	             in_image(sizeof(header), sizeof(LineRecord) * (uint64_t)header.function_count, info.st_size);
+	for (uint32_t i = 0; valid && i < header.function_count; i++) {
+		LineRecord record;
+		memcpy(&record, (const uint8_t *)base + sizeof(header) + sizeof(LineRecord) * i, sizeof(record));
+		valid = valid_lines((const uint8_t *)base, info.st_size, &record);
+	}
+	if (!valid) {
+		munmap(base, info.st_size);
+		return false;
+	}
+	image->lines_base = base;
+	image->lines_size = info.st_size;
+	return true;
+}
+
+// Fill in the line table of a function from a stripped image, mapping the
+// side file the first time one is needed. Without a matching side file the
+// table stays empty and lines are reported as unknown.
+void load_stripped_lines(Lignes *lines) {
+	MappedImage *image = lines->stripped;
+	lines->stripped    = NULL;
+	if (image->lines_base == NULL && (image->lines_path == NULL || !map_side_file(image))) return;
+	LineRecord record;
+	memcpy(&record, (const uint8_t *)image->lines_base + sizeof(LinesHeader) + sizeof(LineRecord) * lines->function,
+	       sizeof(record));
+	use_lines(lines, (const uint8_t *)image->lines_base, &record);
+}
+
+void unmap_images() {
+	while (g_images != NULL) {
+		MappedImage *next = g_images->next;
+		munmap(g_images->base, g_images->size);
+		if (g_images->lines_base != NULL) munmap(g_images->lines_base, g_images->lines_size);
+		free(g_images->lines_path);
+		free(g_images);
+		g_images = next;
+	}
+}
+
+// The script in `src`, mapped from the image next to `path` when that was
+// built from the same source by the same bytecode version, and compiled then
+// written out otherwise. NULL on a compile error.
+ObjFunction *compile_cached(const char *path, const char *src, size_t length) {
+	if (g_debug.no_cache) return compile(src, length, 1);
+	ImageHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+	header.format         = IMAGE_FORMAT;
+	header.bytecode       = BYTECODE_VERSION;
+	header.source_hash    = hash_source(src, length);
+	header.source_length  = length;
+	char *image           = cache_path(path);
+	ObjFunction *function = load_image(image, &header);
+	if (function == NULL) {
+		function = compile_eager(src, length);
+		if (function != NULL) {
+			push(OBJ_VAL(function));  // building the image allocates
+			write_image(image, function, &header);
+			pop();
+		}
+	}
+	free(image);
+	return function;
+}
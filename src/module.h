@@ -0,0 +1,21 @@
+#ifndef clox_module_h
+#define clox_module_h
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "object.h"
+
+typedef struct {
+	const char *chars;
+	size_t length;
+	bool mapped;  // else read into malloc()ed memory
+} Source;
+
+bool open_source(const char *path, Source *source);
+void close_source(Source *source);
+ObjFunction *compile_cached(const char *path, const char *src, size_t length);
+void load_stripped_lines(Lignes *lines);
+void unmap_images();
+
+#endif
@@ -2,9 +2,11 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "chunk.h"
+#include "debug.h"
 #include "memory.h"
 #include "table.h"
 #include "value.h"
@@ -12,13 +14,31 @@
 
 #define ALLOCATE_OBJ(type, objectType) (type *)allocateObject(sizeof(type), objectType)
 
-static Obj *allocateObject(size_t size, ObjType type) {
+// Objects start out young, in the nursery, see collect_young(). The slow path
+// takes whatever an allocation might have to do besides: collecting, going to
+// a worker's heap, or logging for CLOX_LOG_GC, which sets young_limit to 0.
+static __attribute__((noinline)) Obj *allocate_slow(size_t size, ObjType type) {
+	Obj **list     = g_heap != NULL ? &g_heap->objects : &g_vm.young;
 	Obj *object    = (Obj *)reallocate(NULL, 0, size);
-	object->header = (unsigned long)g_vm.objects | (unsigned long)type << 56;
-	g_vm.objects   = object;
-#ifdef DEBUG_LOG_GC
-	printf("%p allocate %zu for %d\n", (void *)object, size, type);
-#endif
+	object->header = (unsigned long)*list | (unsigned long)type << 56 | 1ul << 49;
+	*list          = object;
+	if (g_heap == NULL) g_vm.young_bytes += size;
+	if (g_debug.log_gc) printf("%p allocate %zu for %d\n", (void *)object, size, type);
+	return object;
+}
+
+// The common case, on the VM's heap with no collection due, is inlined as a
+// branch on the nursery and heap limits; only the slow path is a call.
+static inline __attribute__((always_inline)) Obj *allocateObject(size_t size, ObjType type) {
+	if (g_heap != NULL || g_vm.young_bytes >= g_vm.young_limit || g_vm.bytes_allocated + size > g_vm.next_gc) {
+		return allocate_slow(size, type);
+	}
+	Obj *object = (Obj *)malloc(size);
+	if (object == NULL) exit(1);
+	g_vm.bytes_allocated += size;
+	g_vm.young_bytes += size;
+	object->header = (unsigned long)g_vm.young | (unsigned long)type << 56 | 1ul << 49;
+	g_vm.young     = object;
 	return object;
 }
 
@@ -52,8 +72,23 @@ ObjFunction *new_function() {
 	ObjFunction *function   = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 	function->arity         = 0;
 	function->upvalue_count = 0;
+	function->max_stack     = 0;
 	function->name          = NULL;
+	function->source        = NULL;
+	function->source_length = 0;
+	function->source_line   = 0;
+	function->kind          = 0;
+	function->script        = NULL;
+	function->hotness       = 0;
+	function->original      = 0;
+	function->number_args   = UINT32_MAX;
+	function->native        = NULL;
+	function->traces        = NULL;
+	function->inlined       = NULL;
+	function->inlined_count = 0;
+	function->aot           = NULL;
 	init_chunk(&function->chunk);
+	initTable(&function->consts);
 	return function;
 }
 
@@ -70,7 +105,7 @@ ObjNative *new_native(NativeFn function) {
 	return native;
 }
 
-static uint32_t hashString(const char *key, int length) {
+uint32_t hashString(const char *key, int length) {
 	uint32_t hash = 0x811c9dc5u;
 	for (int i = 0; i < length; i++) {
 		hash ^= (uint8_t)key[i];
@@ -83,17 +118,31 @@ static uint32_t hashString(const char *key, int length) {
 static ObjString *allocateString(char *chars, int length, uint32_t hash) {
 	ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
 	string->length    = length;
+	string->borrowed  = false;
 	string->chars     = chars;
 	string->hash      = hash;
+	if (g_heap != NULL) {
+		tableSet(&g_heap->strings, string, NIL_VAL);
+		return string;
+	}
 	push(OBJ_VAL(string));
 	tableSet(&g_vm.strings, string, NIL_VAL);
 	pop();
 	return string;
 }
 
+// A worker may read the VM's strings as well as its own: the VM stays idle
+// for as long as any worker runs.
+static ObjString *find_interned(const char *chars, int length, uint32_t hash) {
+	ObjString *interned = tableFindString(&g_vm.strings, chars, length, hash);
+	if (interned == NULL && g_heap != NULL) interned = tableFindString(&g_heap->strings, chars, length, hash);
+	if (interned != NULL && g_heap == NULL) revive((Obj *)interned);
+	return interned;
+}
+
 ObjString *takeString(char *chars, int length) {
 	uint32_t hash       = hashString(chars, length);
-	ObjString *interned = tableFindString(&g_vm.strings, chars, length, hash);
+	ObjString *interned = find_interned(chars, length, hash);
 	if (interned != NULL) {
 		FREE_ARRAY(char, chars, length + 1);
 		return interned;
@@ -103,7 +152,7 @@ ObjString *takeString(char *chars, int length) {
 
 ObjString *copyString(const char *chars, int length) {
 	uint32_t hash       = hashString(chars, length);
-	ObjString *interned = tableFindString(&g_vm.strings, chars, length, hash);
+	ObjString *interned = find_interned(chars, length, hash);
 	if (interned != NULL) return interned;
 	char *heapChars = ALLOCATE(char, length + 1);
 	memcpy(heapChars, chars, length);
@@ -111,6 +160,16 @@ ObjString *copyString(const char *chars, int length) {
 	return allocateString(heapChars, length, hash);
 }
 
+// Intern `chars` without copying them, for strings in a mapped bytecode image,
+// which outlives every object. `hash` is their hashString().
+ObjString *borrowString(const char *chars, int length, uint32_t hash) {
+	ObjString *interned = find_interned(chars, length, hash);
+	if (interned != NULL) return interned;
+	ObjString *string = allocateString((char *)chars, length, hash);
+	string->borrowed  = true;
+	return string;
+}
+
 ObjUpValue *new_upvalue(Value *slot) {
 	ObjUpValue *upvalue = ALLOCATE_OBJ(ObjUpValue, OBJ_UPVALUE);
 	upvalue->closed     = NIL_VAL;
@@ -127,6 +186,41 @@ static void print_function(ObjFunction *function) {
 	printf("<fn %s>", function->name->chars);
 }
 
+static int format_function(ObjFunction *function, char *buffer, size_t size) {
+	if (function->name == NULL) return snprintf(buffer, size, "<script>");
+	return snprintf(buffer, size, "<fn %s>", function->name->chars);
+}
+
+// Like printObject(), into a buffer. See format_value().
+int formatObject(Value value, char *buffer, size_t size) {
+	switch (OBJ_TYPE(value)) {
+		case OBJ_BOUND_METHOD:
+			return format_function(AS_BOUND_METHOD(value)->method->function, buffer, size);
+		case OBJ_CLASS:
+			return snprintf(buffer, size, "%s", AS_CLASS(value)->name->chars);
+		case OBJ_CLOSURE:
+			return format_function(AS_CLOSURE(value)->function, buffer, size);
+		case OBJ_FUNCTION:
+			return format_function(AS_FUNCTION(value), buffer, size);
+		case OBJ_INSTANCE:
+			return snprintf(buffer, size, "%s instance", AS_INSTANCE(value)->klass->name->chars);
+		case OBJ_NATIVE:
+			return snprintf(buffer, size, "<native fn>");
+		case OBJ_STRING: {
+			ObjString *string = AS_STRING(value);
+			if (size > 0) {
+				size_t copied = (size_t)string->length < size - 1 ? (size_t)string->length : size - 1;
+				memcpy(buffer, string->chars, copied);
+				buffer[copied] = '\0';
+			}
+			return string->length;
+		}
+		case OBJ_UPVALUE:
+			return snprintf(buffer, size, "upvalue");
+	}
+	return 0;
+}
+
 void printObject(Value value) {
 	switch (OBJ_TYPE(value)) {
 		case OBJ_BOUND_METHOD:
@@ -53,9 +53,9 @@ ObjString │   │   │   │   │   │   │   │   │   │   │   │
 // };
 
 /*
-.....TTT .......M NNNNNNNN NNNNNNNN NNNNNNNN NNNNNNNN NNNNNNNN
+.....TTT ....CRYM NNNNNNNN NNNNNNNN NNNNNNNN NNNNNNNN NNNNNNNN
 
-T = Type enum, M = mark bit, N = next pointer
+T = Type enum, C = const name bit, R = remembered bit, Y = young bit, M = mark bit, N = next pointer
 */
 
 struct Obj{
@@ -70,24 +70,81 @@ static inline bool is_marked(Obj *object) {
 	return (bool)((object->header >> 48) & 0x01);
 }
 
+static inline bool is_young(Obj *object) {
+	return (bool)((object->header >> 49) & 0x01);
+}
+
+static inline bool is_remembered(Obj *object) {
+	return (bool)((object->header >> 50) & 0x01);
+}
+
+// Set on the interned name of a global once its const declaration has run,
+// see g_vm.consts.
+static inline bool is_const(Obj *object) {
+	return (bool)((object->header >> 51) & 0x01);
+}
+
 static inline Obj* obj_next(Obj *object) {
 	return (Obj*)(object->header & 0x0000ffffffffffff);
 }
 
 static inline void set_is_marked(Obj* object, bool is_marked) {
-	object->header = (object->header & 0xff00ffffffffffff) | ((uint64_t)is_marked << 48);
+	object->header = (object->header & 0xfffeffffffffffff) | ((uint64_t)is_marked << 48);
+}
+
+static inline void set_is_young(Obj *object, bool is_young) {
+	object->header = (object->header & 0xfffdffffffffffff) | ((uint64_t)is_young << 49);
+}
+
+static inline void set_is_remembered(Obj *object, bool is_remembered) {
+	object->header = (object->header & 0xfffbffffffffffff) | ((uint64_t)is_remembered << 50);
+}
+
+static inline void set_is_const(Obj *object, bool is_const) {
+	object->header = (object->header & 0xfff7ffffffffffff) | ((uint64_t)is_const << 51);
 }
 
 static inline void set_obj_next(Obj *object, Obj *next) {
 	object->header = (object->header & 0xffff000000000000) | (uint64_t)next;
 }
 
+struct CallFrame;
+
+// Instructions [start, end) of a function's code came from `callee`, which
+// the optimizing tier inlined at a call on `line`.
 typedef struct {
+	int start;
+	int end;
+	int line;
+	struct ObjFunction *callee;
+} Inlined;
+
+typedef struct ObjFunction {
 	Obj obj;
 	int arity;
 	int upvalue_count;
+	int max_stack;  // slots a call needs, from slot zero up, see max_stack_depth()
 	Chunk chunk;
 	ObjString *name;
+	// Body not compiled yet, from the parameter list to the closing brace.
+	// NULL once compile_body() has run.
+	char *source;
+	int source_length;
+	int source_line;
+	int kind;  // the compiler's FunctionType
+	// A script's const declarations, with their values when known at compile
+	// time. Bodies it deferred point back at it to inline them too.
+	Table consts;
+	struct ObjFunction *script;
+	int hotness;             // calls and backward branches so far, -1 once past JIT_THRESHOLD
+	int original;            // where the code as compiled starts, after any the optimizing tier put first
+	uint32_t number_args;    // a bit per parameter, cleared once it's passed anything but a number
+	struct JitCode *native;  // machine code, see jit.h
+	struct Trace *traces;    // loops counted for tracing
+	Inlined *inlined;        // in order of start, for errors in inlined code
+	int inlined_count;
+	// Compiled ahead of time, see aot.h.
+	int (*aot)(struct CallFrame *frame, Value *slots, Value *top, int offset);
 } ObjFunction;
 
 typedef Value (*NativeFn)(int arg_count, Value *args);
@@ -100,6 +157,7 @@ typedef struct {
 struct ObjString {
 	Obj obj;
 	int length;
+	bool borrowed;  // chars live in a mapped bytecode image
 	char* chars;
 	uint32_t hash;
 };
@@ -142,10 +200,13 @@ ObjClosure *new_closure(ObjFunction *function);
 ObjFunction *new_function();
 ObjInstance *new_instance(ObjClass *klass);
 ObjNative *new_native(NativeFn function);
+uint32_t hashString(const char *key, int length);
 ObjString *takeString(char *chars, int length);
 ObjString *copyString(const char *chars, int length);
+ObjString *borrowString(const char *chars, int length, uint32_t hash);
 ObjUpValue *new_upvalue(Value *slot);
 void printObject(Value value);
+int formatObject(Value value, char *buffer, size_t size);
 
 static inline bool isObjType(Value value, ObjType type) {
 	return IS_OBJ(value) && obj_type(AS_OBJ(value)) == type;
@@ -0,0 +1,217 @@
+#include "optimizer.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "value.h"
+
+// Jump chains followed at most, a guard against pathological code.
+#define THREAD_MAX 16
+
+static uint8_t opcode_at(Chunk *chunk, int offset) {
+	uint8_t op = chunk->code[offset];
+	return op == OP_WIDE ? chunk->code[offset + 1] : op;
+}
+
+static bool is_jump(uint8_t op) {
+	return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE || op == OP_LOOP;
+}
+
+static int jump_target(Chunk *chunk, int offset) {
+	int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+	return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+// Pushes that cannot fail or have side effects, so a following pop cancels them.
+static bool is_pure_push(uint8_t op) {
+	switch (op) {
+		case OP_NIL:
+		case OP_TRUE:
+		case OP_FALSE:
+		case OP_CONSTANT:
+		case OP_GET_LOCAL:
+		case OP_GET_UPVALUE:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// A forward jump to an OP_JUMP can go straight to its destination, and so can
+// a conditional jump to one of the same kind, since it tests the same value.
+static bool thread_jumps(Chunk *chunk) {
+	bool changed = false;
+	for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+		uint8_t op = chunk->code[offset];
+		if (!is_jump(op) || op == OP_LOOP) continue;
+		int dest = jump_target(chunk, offset);
+		for (int hops = 0; hops < THREAD_MAX; hops++) {
+			uint8_t next = chunk->code[dest];
+			if (next != OP_JUMP && (op == OP_JUMP || next != op)) break;
+			dest = jump_target(chunk, dest);
+		}
+		int jump = dest - offset - 3;
+		if (dest == jump_target(chunk, offset) || jump > UINT16_MAX) continue;
+		chunk->code[offset + 1] = (jump >> 8) & 0xff;
+		chunk->code[offset + 2] = jump & 0xff;
+		changed                 = true;
+	}
+	return changed;
+}
+
+// Copy the surviving instructions back into the chunk, rebuilding its line
+// runs and re-encoding every jump for the new offsets.
+static void compact(Chunk *chunk, bool *dead) {
+	int count       = chunk->count;
+	uint8_t *code   = ALLOCATE(uint8_t, count);
+	int *lines      = ALLOCATE(int, count);
+	int *new_offset = ALLOCATE(int, count + 1);
+	memcpy(code, chunk->code, count);
+	for (int run = 0, offset = 0; run <= chunk->lines.count; run++) {
+		for (int i = 0; i < chunk->lines.runs[run].runLength; i++) {
+			lines[offset++] = chunk->lines.runs[run].lineNumber;
+		}
+	}
+
+	int size = 0;
+	for (int offset = 0; offset < count; offset += instruction_length(chunk, offset)) {
+		new_offset[offset] = size;
+		if (!dead[offset]) size += instruction_length(chunk, offset);
+	}
+	new_offset[count] = size;
+
+	Chunk old = *chunk;
+	old.code  = code;
+	freeLines(&chunk->lines);
+	chunk->count = 0;
+	for (int offset = 0; offset < count;) {
+		int length = instruction_length(&old, offset);
+		if (!dead[offset]) {
+			for (int i = 0; i < length; i++) write_chunk(chunk, code[offset + i], lines[offset + i]);
+			if (is_jump(code[offset])) {
+				int dest = jump_target(&old, offset);
+				int from = new_offset[offset] + 3;
+				int jump = code[offset] == OP_LOOP ? from - new_offset[dest] : new_offset[dest] - from;
+				chunk->code[new_offset[offset] + 1] = (jump >> 8) & 0xff;
+				chunk->code[new_offset[offset] + 2] = jump & 0xff;
+			}
+		}
+		offset += length;
+	}
+
+	FREE_ARRAY(uint8_t, code, count);
+	FREE_ARRAY(int, lines, count);
+	FREE_ARRAY(int, new_offset, count + 1);
+}
+
+static bool optimize_pass(Chunk *chunk) {
+	bool changed = thread_jumps(chunk);
+	int count    = chunk->count;
+	bool *target = ALLOCATE(bool, count + 1);
+	bool *dead   = ALLOCATE(bool, count + 1);
+	memset(target, 0, count + 1);
+	memset(dead, 0, count + 1);
+	for (int offset = 0; offset < count; offset += instruction_length(chunk, offset)) {
+		if (is_jump(chunk->code[offset])) target[jump_target(chunk, offset)] = true;
+	}
+
+	bool live   = true;
+	bool shrink = false;
+	for (int offset = 0; offset < count;) {
+		int length = instruction_length(chunk, offset);
+		int next   = offset + length;
+		uint8_t op = opcode_at(chunk, offset);
+		if (target[offset]) live = true;
+		if (!live) {
+			// Nothing jumps here and control never falls through to it.
+			dead[offset] = shrink = true;
+		} else if (op == OP_JUMP && jump_target(chunk, offset) == next) {
+			dead[offset] = shrink = true;
+		} else if (op == OP_NOT && next < count && !target[next] &&
+		           (chunk->code[next] == OP_JUMP_IF_FALSE || chunk->code[next] == OP_JUMP_IF_TRUE) &&
+		           chunk->code[next + 3] == OP_POP && chunk->code[jump_target(chunk, next)] == OP_POP) {
+			// Both successors pop the condition, so its negation can go into the jump.
+			chunk->code[next] = chunk->code[next] == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE;
+			dead[offset] = shrink = true;
+		} else if (is_pure_push(op) && next < count && chunk->code[next] == OP_POP && !target[next]) {
+			dead[offset] = dead[next] = shrink = true;
+			next++;
+		}
+		if (op == OP_JUMP || op == OP_LOOP || op == OP_RETURN) live = false;
+		offset = next;
+	}
+
+	if (shrink) compact(chunk, dead);
+	FREE_ARRAY(bool, target, count + 1);
+	FREE_ARRAY(bool, dead, count + 1);
+	return changed || shrink;
+}
+
+void optimize_chunk(Chunk *chunk) {
+	while (optimize_pass(chunk)) {
+	}
+}
+
+// Reach `offset` with `depth` values on the stack, queueing it the first time.
+static bool reach(int *depths, int *queue, int *queued, int offset, int depth) {
+	if (depths[offset] < 0) {
+		depths[offset]     = depth;
+		queue[(*queued)++] = offset;
+		return true;
+	}
+	return depths[offset] == depth;
+}
+
+// Walk the chunk's paths from the start with `entry` values on the stack,
+// filling in `depths` before each instruction, -1 where unreachable, and
+// returning the deepest it gets.
+static int walk_stack(Chunk *chunk, int entry, int *depths, int *error) {
+	int count  = chunk->count;
+	int *queue = ALLOCATE(int, count);
+	int queued = 0;
+	int max    = entry;
+	*error     = -1;
+	for (int i = 0; i < count; i++) depths[i] = -1;
+	if (count > 0) reach(depths, queue, &queued, 0, entry);
+
+	while (queued > 0 && *error < 0) {
+		int offset = queue[--queued];
+		uint8_t op = opcode_at(chunk, offset);
+		int depth  = depths[offset] + stack_effect(chunk, offset);
+		int next   = offset + instruction_length(chunk, offset);
+		if (depth > max) max = depth;
+		bool ok = depth >= 1;
+		if (ok && is_jump(op)) {
+			int dest = jump_target(chunk, offset);
+			ok       = dest >= 0 && dest < count && reach(depths, queue, &queued, dest, depth);
+		}
+		if (ok && op != OP_JUMP && op != OP_LOOP && op != OP_RETURN) {
+			ok = next < count && reach(depths, queue, &queued, next, depth);
+		}
+		if (!ok) *error = offset;
+	}
+
+	FREE_ARRAY(int, queue, count);
+	return max;
+}
+
+// The deepest the stack gets in a call of the chunk, counting the `entry`
+// slots the callee and its arguments take. Every path must reach an
+// instruction at the same depth, never pop slot zero, and not run off the
+// end; the first instruction that breaks that goes into `*error`, else -1.
+int max_stack_depth(Chunk *chunk, int entry, int *error) {
+	int *depths = ALLOCATE(int, chunk->count);
+	int max     = walk_stack(chunk, entry, depths, error);
+	FREE_ARRAY(int, depths, chunk->count);
+	return max;
+}
+
+// The stack depth before each instruction, as max_stack_depth() finds it,
+// into `depths`. False if the chunk doesn't pass its checks.
+bool stack_depths(Chunk *chunk, int entry, int *depths) {
+	int error;
+	walk_stack(chunk, entry, depths, &error);
+	return error < 0;
+}
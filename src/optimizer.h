@@ -0,0 +1,10 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+void optimize_chunk(Chunk *chunk);
+int max_stack_depth(Chunk *chunk, int entry, int *error);
+bool stack_depths(Chunk *chunk, int entry, int *depths);
+
+#endif
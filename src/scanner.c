@@ -1,22 +1,22 @@
 #include "scanner.h"
 
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "common.h"
 
-typedef struct {
-	const char *start;
-	const char *current;
-	int line;
-} Scanner;
-
-Scanner scanner;
+void init_scanner(Scanner *scanner, const char *src, size_t length, int line) {
+	scanner->start   = src;
+	scanner->current = src;
+	scanner->end     = src + length;
+	scanner->line    = line;
 
-void init_scanner(const char *src) {
-	scanner.start   = src;
-	scanner.current = src;
-	scanner.line    = 1;
+	scanner->interpolating = 0;
 }
 
 static bool is_digit(char c) {
@@ -24,212 +24,362 @@ static bool is_digit(char c) {
 }
 
 static bool is_alpha(char c) {
-	return (c >= 'A' && c <= 'z') || c == '_';
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static bool is_blank(char c) {
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Runs of identifier characters, digits and whitespace, and searches for the
+// end of strings and comments, are what most of a source is made of. They go
+// 16 bytes at a time where SSE2 is available. Each takes the end of the source
+// and never returns past it.
+#ifdef __SSE2__
+
+// A 16-byte load may read past the end of the source, but never into the next
+// page, and whatever it finds there is masked off. ASan would still flag the
+// overread, so it is kept out of these.
+#ifdef __SANITIZE_ADDRESS__
+#define BULK static inline __attribute__((no_sanitize_address))
+#else
+#define BULK static inline
+#endif
+
+static inline bool block_readable(const char *p) {
+	return ((uintptr_t)p & 4095) <= 4096 - 16;
+}
+
+// Bits for the bytes of a block at `p` that lie at or past `end`.
+static inline unsigned past_end(const char *p, const char *end) {
+	return end - p >= 16 ? 0 : 0xffffu << (end - p);
+}
+
+static inline __m128i in_range(__m128i bytes, char lo, char hi) {
+	__m128i above = _mm_cmpgt_epi8(bytes, _mm_set1_epi8(lo - 1));
+	__m128i below = _mm_cmplt_epi8(bytes, _mm_set1_epi8(hi + 1));
+	return _mm_and_si128(above, below);
+}
+
+static inline __m128i equal_to(__m128i bytes, char c) {
+	return _mm_cmpeq_epi8(bytes, _mm_set1_epi8(c));
+}
+
+// Bit i set when byte i is an identifier character. Setting 0x20 folds upper
+// case onto lower case and maps nothing else into 'a'..'z'.
+static inline unsigned ident_bits(__m128i bytes) {
+	__m128i letter = in_range(_mm_or_si128(bytes, _mm_set1_epi8(0x20)), 'a', 'z');
+	__m128i digit  = in_range(bytes, '0', '9');
+	__m128i mask   = _mm_or_si128(_mm_or_si128(letter, digit), equal_to(bytes, '_'));
+	return (unsigned)_mm_movemask_epi8(mask);
+}
+
+static inline unsigned digit_bits(__m128i bytes) {
+	return (unsigned)_mm_movemask_epi8(in_range(bytes, '0', '9'));
+}
+
+BULK const char *skip_ident(const char *p, const char *end) {
+	while (p < end) {
+		if (!block_readable(p)) {
+			if (!is_alpha(*p) && !is_digit(*p)) return p;
+			p++;
+			continue;
+		}
+		unsigned stop = (~ident_bits(_mm_loadu_si128((const __m128i *)p)) | past_end(p, end)) & 0xffff;
+		if (stop != 0) return p + __builtin_ctz(stop);
+		p += 16;
+	}
+	return end;
+}
+
+BULK const char *skip_digits(const char *p, const char *end) {
+	while (p < end) {
+		if (!block_readable(p)) {
+			if (!is_digit(*p)) return p;
+			p++;
+			continue;
+		}
+		unsigned stop = (~digit_bits(_mm_loadu_si128((const __m128i *)p)) | past_end(p, end)) & 0xffff;
+		if (stop != 0) return p + __builtin_ctz(stop);
+		p += 16;
+	}
+	return end;
+}
+
+// Skip spaces, tabs and newlines, counting the newlines into `line`. Most
+// runs are a single space, which a vector compare would only slow down, so
+// the first few go one at a time.
+BULK const char *skip_blanks(const char *p, const char *end, int *line) {
+	for (int i = 0; i < 4; i++, p++) {
+		if (p == end || !is_blank(*p)) return p;
+		if (*p == '\n') (*line)++;
+	}
+	while (p < end) {
+		if (!block_readable(p)) {
+			if (!is_blank(*p)) return p;
+			if (*p++ == '\n') (*line)++;
+			continue;
+		}
+		__m128i bytes    = _mm_loadu_si128((const __m128i *)p);
+		__m128i newlines = equal_to(bytes, '\n');
+		__m128i blanks   = _mm_or_si128(_mm_or_si128(equal_to(bytes, ' '), equal_to(bytes, '\t')),
+		                                _mm_or_si128(equal_to(bytes, '\r'), newlines));
+		unsigned stop    = (~(unsigned)_mm_movemask_epi8(blanks) | past_end(p, end)) & 0xffff;
+		unsigned counted = stop != 0 ? (1u << __builtin_ctz(stop)) - 1 : 0xffff;
+		*line += __builtin_popcount((unsigned)_mm_movemask_epi8(newlines) & counted);
+		if (stop != 0) return p + __builtin_ctz(stop);
+		p += 16;
+	}
+	return end;
 }
 
-static bool is_at_end() {
-	return *scanner.current == '\0';
+// The first `a` or `b` at or after `p`, or `end`.
+BULK const char *find_either(const char *p, const char *end, char a, char b) {
+	while (p < end) {
+		if (!block_readable(p)) {
+			if (*p == a || *p == b) return p;
+			p++;
+			continue;
+		}
+		__m128i bytes = _mm_loadu_si128((const __m128i *)p);
+		unsigned hits = (unsigned)_mm_movemask_epi8(_mm_or_si128(equal_to(bytes, a), equal_to(bytes, b)));
+		hits |= past_end(p, end);
+		if (hits != 0) return p + __builtin_ctz(hits);
+		p += 16;
+	}
+	return end;
+}
+
+#else
+
+static const char *skip_ident(const char *p, const char *end) {
+	while (p < end && (is_alpha(*p) || is_digit(*p))) p++;
+	return p;
 }
 
-static char advance() {
-	scanner.current++;
-	return scanner.current[-1];
+static const char *skip_digits(const char *p, const char *end) {
+	while (p < end && is_digit(*p)) p++;
+	return p;
 }
 
-static char peek() {
-	return *scanner.current;
+static const char *skip_blanks(const char *p, const char *end, int *line) {
+	for (; p < end && is_blank(*p); p++) {
+		if (*p == '\n') (*line)++;
+	}
+	return p;
 }
 
-static char peek_next() {
-	if (is_at_end()) return '\0';
-	return scanner.current[1];
+static const char *find_either(const char *p, const char *end, char a, char b) {
+	while (p < end && *p != a && *p != b) p++;
+	return p;
 }
 
-static bool match(char expected) {
-	if (is_at_end()) return false;
-	if (*scanner.current != expected) return false;
-	scanner.current++;
+#endif
+
+static bool match(Scanner *scanner, char expected) {
+	if (scanner->current == scanner->end || *scanner->current != expected) return false;
+	scanner->current++;
 	return true;
 }
 
-static Token make_token(TokenType type) {
+static Token make_token(Scanner *scanner, TokenType type) {
 	Token token;
 	token.type   = type;
-	token.start  = scanner.start;
-	token.length = (int)(scanner.current - scanner.start);
-	token.line   = scanner.line;
+	token.start  = scanner->start;
+	token.length = (int)(scanner->current - scanner->start);
+	token.line   = scanner->line;
 	return token;
 }
 
-static Token error_token(const char *msg) {
+static Token error_token(Scanner *scanner, const char *msg) {
 	Token token;
 	token.type   = TOKEN_ERROR;
 	token.start  = msg;
 	token.length = strlen(msg);
-	token.line   = scanner.line;
+	token.line   = scanner->line;
 	return token;
 }
 
-static void skip_whitespace() {
+static void skip_whitespace(Scanner *scanner) {
+	const char *p   = scanner->current;
+	const char *end = scanner->end;
 	for (;;) {
-		char c = peek();
-		switch (c) {
-			case ' ':
-			case '\t':
-			case '\r':
-				advance();
-				break;
-			case '\n':
-				scanner.line++;
-				advance();
-				break;
-			case '/':
-				if (peek_next() == '/') {
-					while (peek() != '\n' && !is_at_end()) advance();
-				} else if (peek_next() == '*') {
-					advance();
-					advance();
-					while (peek() != '*' || peek_next() != '/') {
-						if (peek() == '\n') scanner.line++;
-						if (is_at_end()) return;
-						advance();
-					}
-					advance();
-					advance();
+		p = skip_blanks(p, end, &scanner->line);
+		if (end - p < 2 || p[0] != '/') break;
+		if (p[1] == '/') {
+			p = find_either(p + 2, end, '\n', '\n');
+		} else if (p[1] == '*') {
+			p += 2;
+			for (;;) {
+				p = find_either(p, end, '*', '\n');
+				if (p == end) break;
+				if (*p == '\n') {
+					scanner->line++;
+					p++;
+				} else if (end - p >= 2 && p[1] == '/') {
+					p += 2;
+					break;
 				} else {
-					return;
+					p++;
 				}
-				break;
-			default:
-				return;
+			}
+		} else {
+			break;
 		}
 	}
+	scanner->current = p;
 }
 
-static TokenType check_keyword(int start, int length, const char *rest, TokenType type) {
-	if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length) == 0) {
-		return type;
-	}
+// Keywords are found by a perfect hash of the first and last characters and
+// the length into a table of 32, and confirmed with one memcmp.
+#define KEYWORD_SLOTS 32
 
-	return TOKEN_IDENTIFIER;
+typedef struct {
+	const char *name;
+	int length;
+	TokenType type;
+} Keyword;
+
+static int keyword_hash(const char *start, int length) {
+	return ((uint8_t)start[0] + (uint8_t)start[length - 1] * 18 + (length << 1)) & (KEYWORD_SLOTS - 1);
 }
 
-static TokenType identifier_type() {
-	switch (scanner.start[0]) {
-		case 'a':
-			return check_keyword(1, 2, "nd", TOKEN_AND);
-		case 'c':
-			return check_keyword(1, 4, "lass", TOKEN_CLASS);
-		case 'e':
-			return check_keyword(1, 3, "lse", TOKEN_ELSE);
-		case 'f':
-			if (scanner.current - scanner.start > 1) {
-				switch (scanner.start[1]) {
-					case 'a':
-						return check_keyword(2, 3, "lse", TOKEN_FALSE);
-					case 'o':
-						return check_keyword(2, 1, "r", TOKEN_FOR);
-					case 'u':
-						return check_keyword(2, 1, "n", TOKEN_FUN);
-				}
-			}
-			break;
-		case 'i':
-			return check_keyword(1, 1, "f", TOKEN_IF);
-		case 'n':
-			return check_keyword(1, 2, "il", TOKEN_NIL);
-		case 'o':
-			return check_keyword(1, 1, "r", TOKEN_OR);
-		case 'p':
-			return check_keyword(1, 4, "rint", TOKEN_PRINT);
-		case 'r':
-			return check_keyword(1, 5, "eturn", TOKEN_RETURN);
-		case 's':
-			return check_keyword(1, 4, "uper", TOKEN_SUPER);
-		case 't':
-			if (scanner.current - scanner.start > 1) {
-				switch (scanner.start[1]) {
-					case 'h':
-						return check_keyword(2, 2, "is", TOKEN_THIS);
-					case 'r':
-						return check_keyword(2, 2, "ue", TOKEN_TRUE);
-				}
-			}
-			break;
-		case 'v':
-			return check_keyword(1, 2, "ar", TOKEN_VAR);
-		case 'w':
-			return check_keyword(1, 4, "hile", TOKEN_WHILE);
-	}
+static const Keyword keywords[KEYWORD_SLOTS] = {
+    [0]  = {"var", 3, TOKEN_VAR},     [1]  = {"super", 5, TOKEN_SUPER},   [2]  = {"print", 5, TOKEN_PRINT},
+    [3]  = {"class", 5, TOKEN_CLASS}, [7]  = {"else", 4, TOKEN_ELSE},     [8]  = {"fun", 3, TOKEN_FUN},
+    [10] = {"false", 5, TOKEN_FALSE}, [12] = {"nil", 3, TOKEN_NIL},       [15] = {"and", 3, TOKEN_AND},
+    [16] = {"for", 3, TOKEN_FOR},     [18] = {"this", 4, TOKEN_THIS},     [21] = {"const", 5, TOKEN_CONST},
+    [22] = {"true", 4, TOKEN_TRUE},   [23] = {"or", 2, TOKEN_OR},         [25] = {"if", 2, TOKEN_IF},
+    [26] = {"return", 6, TOKEN_RETURN}, [27] = {"while", 5, TOKEN_WHILE}, [29] = {"import", 6, TOKEN_IMPORT},
+};
+
+static TokenType identifier_type(Scanner *scanner) {
+	int length = (int)(scanner->current - scanner->start);
+	if (length < 2 || length > 6) return TOKEN_IDENTIFIER;
+	const Keyword *keyword = &keywords[keyword_hash(scanner->start, length)];
+	if (keyword->length == length && memcmp(keyword->name, scanner->start, length) == 0) return keyword->type;
 	return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-	while (is_alpha(peek()) || is_digit(peek())) advance();
-	return make_token(identifier_type());
+static Token identifier(Scanner *scanner) {
+	scanner->current = skip_ident(scanner->current, scanner->end);
+	return make_token(scanner, identifier_type(scanner));
 }
 
-static Token number() {
-	while (is_digit(peek())) advance();
-	if (peek() == '.' && is_digit(peek_next())) {
-		advance();
-		while (is_digit(peek())) advance();
+static Token number(Scanner *scanner) {
+	const char *end  = scanner->end;
+	scanner->current = skip_digits(scanner->current, end);
+	if (end - scanner->current >= 2 && scanner->current[0] == '.' && is_digit(scanner->current[1])) {
+		scanner->current = skip_digits(scanner->current + 1, end);
 	}
-	return make_token(TOKEN_NUMBER);
+	return make_token(scanner, TOKEN_NUMBER);
 }
 
-static Token string() {
-	while (peek() != '"' && !is_at_end()) {
-		if (peek() == '\n') scanner.line++;
-		advance();
+// Scans up to the closing quote, or up to a "${" that starts an interpolated
+// expression. The string resumes at the "}" that closes it.
+static Token string(Scanner *scanner) {
+	const char *p = scanner->current;
+	for (;;) {
+		p = find_either(p, scanner->end, '"', '$');
+		if (p == scanner->end || *p == '"' || (p + 1 < scanner->end && p[1] == '{')) break;
+		p++;
+	}
+	for (const char *q = scanner->current; (q = memchr(q, '\n', p - q)) != NULL; q++) {
+		scanner->line++;
+	}
+	scanner->current = p;
+	if (p == scanner->end) return error_token(scanner, "Unterminated string.");
+	if (*p == '"') {
+		scanner->current++;
+		return make_token(scanner, TOKEN_STRING);
 	}
+	if (scanner->interpolating == MAX_INTERPOLATION) return error_token(scanner, "Interpolation nested too deeply.");
+	scanner->braces[scanner->interpolating++] = 0;
+	scanner->current += 2;
+	return make_token(scanner, TOKEN_INTERPOLATION);
+}
+
+// Powers of ten that are exact doubles.
+static const double exact_powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
 
-	if (is_at_end()) return error_token("Unterminated string.");
-	advance();
-	return make_token(TOKEN_STRING);
+// strtod() needs a NUL after the digits, which the source may not have.
+static double slow_number(const Token *token) {
+	char *text = (char *)malloc(token->length + 1);
+	if (text == NULL) exit(1);
+	memcpy(text, token->start, token->length);
+	text[token->length] = '\0';
+	double value        = strtod(text, NULL);
+	free(text);
+	return value;
 }
 
-Token scan_token() {
-	skip_whitespace();
-	scanner.start = scanner.current;
-	if (is_at_end()) return make_token(TOKEN_EOF);
-	char c = advance();
-	if (is_alpha(c)) return identifier();
-	if (is_digit(c)) return number();
+// The value of a number token. When its digits fit in 53 bits and it has at
+// most 22 decimals, both the digits and the scale are exact doubles and one
+// division rounds correctly; anything else goes the slow way.
+double token_number(const Token *token) {
+	uint64_t digits = 0;
+	int scale       = -1;
+	for (int i = 0; i < token->length; i++) {
+		char c = token->start[i];
+		if (c == '.') {
+			scale = 0;
+			continue;
+		}
+		if (digits > (UINT64_C(1) << 53) / 10) return slow_number(token);
+		digits = digits * 10 + (c - '0');
+		if (scale >= 0) scale++;
+	}
+	if (digits > (UINT64_C(1) << 53) || scale > 22) return slow_number(token);
+	return scale <= 0 ? (double)digits : (double)digits / exact_powers[scale];
+}
+
+Token scan_token(Scanner *scanner) {
+	skip_whitespace(scanner);
+	scanner->start = scanner->current;
+	if (scanner->current == scanner->end) return make_token(scanner, TOKEN_EOF);
+	char c = *scanner->current++;
+	if (is_alpha(c)) return identifier(scanner);
+	if (is_digit(c)) return number(scanner);
 
 	switch (c) {
 		case '(':
-			return make_token(TOKEN_LEFT_PAREN);
+			return make_token(scanner, TOKEN_LEFT_PAREN);
 		case ')':
-			return make_token(TOKEN_RIGHT_PAREN);
+			return make_token(scanner, TOKEN_RIGHT_PAREN);
 		case '{':
-			return make_token(TOKEN_LEFT_BRACE);
+			if (scanner->interpolating > 0) scanner->braces[scanner->interpolating - 1]++;
+			return make_token(scanner, TOKEN_LEFT_BRACE);
 		case '}':
-			return make_token(TOKEN_RIGHT_BRACE);
+			if (scanner->interpolating > 0 && scanner->braces[scanner->interpolating - 1]-- == 0) {
+				scanner->interpolating--;
+				return string(scanner);
+			}
+			return make_token(scanner, TOKEN_RIGHT_BRACE);
 		case ';':
-			return make_token(TOKEN_SEMICOLON);
+			return make_token(scanner, TOKEN_SEMICOLON);
 		case ',':
-			return make_token(TOKEN_COMMA);
+			return make_token(scanner, TOKEN_COMMA);
 		case '.':
-			return make_token(TOKEN_DOT);
+			return make_token(scanner, TOKEN_DOT);
 		case '-':
-			return make_token(TOKEN_MINUS);
+			return make_token(scanner, TOKEN_MINUS);
 		case '+':
-			return make_token(TOKEN_PLUS);
+			return make_token(scanner, TOKEN_PLUS);
 		case '/':
-			return make_token(TOKEN_SLASH);
+			return make_token(scanner, TOKEN_SLASH);
 		case '*':
-			return make_token(TOKEN_STAR);
+			return make_token(scanner, TOKEN_STAR);
 		case '!':
-			return make_token(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+			return make_token(scanner, match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
 		case '=':
-			return make_token(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+			return make_token(scanner, match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
 		case '<':
-			return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+			return make_token(scanner, match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
 		case '>':
-			return make_token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+			return make_token(scanner, match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 		case '"':
-			return string();
+			return string(scanner);
 	}
-	return error_token("Unexpected character.");
+	return error_token(scanner, "Unexpected character.");
 }
@@ -1,6 +1,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include <stddef.h>
+
 typedef enum {
 	// Single-character tokens. 单字符词法
 	TOKEN_LEFT_PAREN,
@@ -26,15 +28,18 @@ typedef enum {
 	// Literals. 字面量
 	TOKEN_IDENTIFIER,
 	TOKEN_STRING,
+	TOKEN_INTERPOLATION,  // a string part that ends in "${"
 	TOKEN_NUMBER,
 	// Keywords. 关键字
 	TOKEN_AND,
 	TOKEN_CLASS,
+	TOKEN_CONST,
 	TOKEN_ELSE,
 	TOKEN_FALSE,
 	TOKEN_FOR,
 	TOKEN_FUN,
 	TOKEN_IF,
+	TOKEN_IMPORT,
 	TOKEN_NIL,
 	TOKEN_OR,
 	TOKEN_PRINT,
@@ -56,7 +61,22 @@ typedef struct {
 	int line;
 } Token;
 
-void init_scanner(const char *src);
-Token scan_token();
+// Sources are length-delimited and need no trailing NUL, so they can be
+// scanned straight out of a mapped file.
+#define MAX_INTERPOLATION 8
+
+typedef struct {
+	const char *start;
+	const char *current;
+	const char *end;
+	int line;
+	// Open braces in each "${...}" being scanned, innermost last.
+	int braces[MAX_INTERPOLATION];
+	int interpolating;
+} Scanner;
+
+void init_scanner(Scanner *scanner, const char *src, size_t length, int line);
+Token scan_token(Scanner *scanner);
+double token_number(const Token *token);
 
 #endif
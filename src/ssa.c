@@ -0,0 +1,2089 @@
+#include "ssa.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "debug.h"
+#include "jit.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "vm.h"
+
+// The optimizing tier. A hot function's bytecode is lifted into SSA form:
+// each instruction that computes something is a node, the locals and the
+// stack only name nodes, and a phi stands for each slot holding different
+// values where control flow meets. Then:
+//
+// - Parameters the interpreter has only seen numbers in are taken to be
+//   numbers, and so is arithmetic on numbers, which becomes the unchecked
+//   *_NUMBER forms.
+// - A global or upvalue read again in the same block, with no call and no
+//   other store in between, is the value read or stored before.
+// - A pure op computing what one that dominates it already has is replaced
+//   by that one.
+// - A pure op in a loop whose inputs come from outside it moves out, to the
+//   end of the block that dominates the loop's header.
+// - Pure ops nothing uses are dropped.
+//
+// Before any of that, a call through a global to a small function that has
+// run, captures nothing and calls nothing itself gets the function's body in
+// its place, and so does a call to a class whose initializer is such a
+// function, as a new instance and the initializer's body. Each is behind a
+// check that the global still holds the same closure or class. The inlined
+// code keeps its own lines, and the function notes where it is so that an
+// error there still shows the call.
+//
+// An instance made that way that only ever has its fields set and read, all
+// in places where the field's value is known, is never made: each read is
+// the value last stored. A field read off it that was never set, and is
+// only called, invokes the method directly instead of binding it first.
+//
+// The graph goes back to bytecode. A value used once, straight off the
+// stack where it was pushed, is emitted there as it was; any other lives in
+// a local slot, which values never live at the same time share, and which a
+// phi shares with its inputs where it can.
+//
+// Speculation is checked once, on entry: if a parameter isn't a number after
+// all, the call jumps to a copy of the original bytecode kept at the end of
+// the chunk and goes on there. Frames already running the function when it
+// is optimized go on in that copy too. A failed inlining check goes there as
+// well, at the call it stands for, after putting each local and stack slot
+// back the way the original code has it and making any instance that was
+// replaced.
+
+enum { IR_PARAM = 256, IR_PHI, IR_CHECK };  // nodes that aren't instructions
+
+typedef struct {
+	int op;            // an OpCode or one of the above
+	int block;         // moves to the loop's preheader when hoisted
+	int offset;        // of the instruction, for its line
+	uint32_t operand;  // its index operand or argument count; a parameter's slot, a phi's stack position
+	int args;          // of OP_INVOKE and OP_SUPER_INVOKE
+	int first;         // inputs in Graph.inputs, a phi's one per predecessor
+	int count;
+	int forward;  // the node standing in for this one, or -1
+	bool dead;
+	bool number;
+	bool moved;    // hoisted out of a loop
+	bool inlined;  // emitted where it's used rather than kept in a slot
+	bool scalar;   // an instance never made, see replace_scalars()
+	int uses;
+	int user;       // the node using it when there's one use, -1 for its block's branch or return
+	int use_block;  // where that use is
+	bool direct;    // and whether it takes the value straight off the stack
+	int slot;
+} Node;
+
+typedef struct {
+	int start;  // instructions [start, end), the last at `last`
+	int end;
+	int last;
+	int exit;  // the instruction ending it, or -1 when it falls through
+	int value;  // the condition or result it ends with
+	bool value_direct;
+	int succ[2];  // where it falls through and where it jumps, -1 for neither
+	int first_pred;
+	int pred_count;
+	int depth;  // of the stack on entry, -1 where unreachable
+	int exit_state;  // the values on the stack at its end, in Graph.states
+	int exit_depth;
+	int first_node;  // its phis, then the nodes for its instructions
+	int end_node;
+	int idom;
+	int first_root;  // the nodes emitted as statements, in Graph.roots
+	int root_count;
+	int label;
+	bool pop_first;  // entered only by a conditional jump, whose condition it pops
+} Block;
+
+typedef struct {
+	int at;
+	int block;
+} Patch;
+
+typedef uint64_t Bits;
+
+#define OBJECT_FIELDS 16
+
+// An instance kept as its fields, which are the values last stored to them.
+typedef struct {
+	int node;
+	int klass;  // the constant holding its class
+	int count;
+	ObjString *fields[OBJECT_FIELDS];
+	int names[OBJECT_FIELDS];  // the constants holding their names
+} Object;
+
+// A check that failed, its jump to where it leaves, and that code's jump to
+// the original.
+typedef struct {
+	int check;
+	int at;
+	int leave;
+} Exit;
+
+// A call inlined, and the check in front of it that the callee is still
+// `target`, which leaves for the original code at `call` when it isn't.
+typedef struct {
+	ObjFunction *callee;  // the function or initializer inlined, if any
+	int line;             // of the call
+	int check;            // where the check is in the spliced code
+	int call;
+	int base;    // the callee's slot
+	int target;  // the constant holding the closure or class
+} Site;
+
+typedef struct {
+	ObjFunction *function;
+	Chunk *chunk;  // what's lifted, `source` or `spliced`
+	// The function's code, and a copy of it with calls inlined, the call
+	// each of whose bytes came from an inlined callee, -1 for the rest.
+	Chunk *source;
+	Chunk spliced;
+	int *site_at;
+	int site_capacity;
+	Site *sites;
+	int site_count;
+	int max_stack;
+	int code_count;  // bytes of the chunk lifted
+	int *depths;     // of the stack before each instruction
+	int *block_at;  // the block starting at each offset, else -1
+	Block *blocks;
+	int block_count;
+	int *preds;
+	Node *nodes;
+	int node_count;
+	int node_capacity;
+	int *inputs;
+	bool *direct;  // the input came straight off the stack from its node
+	int input_count;
+	int input_capacity;
+	int *states;
+	int state_count;
+	int state_capacity;
+	// The stack while a block is lifted, and which values on it were pushed
+	// by their nodes rather than copied from a local.
+	int *stack;
+	bool *fresh;
+	int capacity;
+	int depth;
+	int *roots;
+	Object *objects;
+	int object_count;
+	int object_capacity;
+	// Slots: sets of nodes, their interference, and the classes that share one.
+	int words;
+	Bits *interfere;
+	Bits *members;
+	int *parent;
+	int *color;
+	int slots;
+	// The new chunk, its jumps to blocks not placed yet and to the deopt stub.
+	Chunk out;
+	Patch *patches;
+	int patch_count;
+	int patch_capacity;
+	int *deopts;
+	int deopt_count;
+	Exit *exits;
+	int exit_count;
+	int exit_capacity;
+	int original;  // where the copy of the original bytecode starts
+	Inlined *inlined;
+	int inlined_count;
+	int inlined_capacity;
+	bool failed;
+} Graph;
+
+static bool alive(Node *node) {
+	return node->forward < 0 && !node->dead;
+}
+
+static int resolve(Graph *g, int n) {
+	while (g->nodes[n].forward >= 0) n = g->nodes[n].forward;
+	return n;
+}
+
+static int input(Graph *g, Node *node, int i) {
+	return resolve(g, g->inputs[node->first + i]);
+}
+
+static bool constant_op(int op) {
+	return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE || op == OP_FALSE;
+}
+
+// No effects and never an error, so they can be merged, moved and dropped.
+static bool pure_op(int op) {
+	switch (op) {
+		case OP_NOT:
+		case OP_EQUAL:
+		case OP_ADD_NUMBER:
+		case OP_SUBTRACT_NUMBER:
+		case OP_MULTIPLY_NUMBER:
+		case OP_DIVIDE_NUMBER:
+		case OP_NEGATE_NUMBER:
+		case OP_GREATER_NUMBER:
+		case OP_LESS_NUMBER:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool commutative(int op) {
+	return op == OP_EQUAL || op == OP_ADD_NUMBER || op == OP_MULTIPLY_NUMBER;
+}
+
+// Stores leave the value they stored on the stack.
+static bool store_op(int op) {
+	return op == OP_SET_GLOBAL || op == OP_SET_UPVALUE || op == OP_SET_PROPERTY;
+}
+
+static bool has_result(int op) {
+	return !store_op(op) && op != OP_DEFINE_GLOBAL && op != OP_PRINT && op != IR_CHECK;
+}
+
+static bool branch_op(int op) {
+	return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE || op == OP_LOOP;
+}
+
+static int jump_target(Chunk *chunk, int offset) {
+	int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+	return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+// Whatever makes closures or classes, imports, or takes a wide operand.
+static bool liftable(uint8_t op) {
+	switch (op) {
+		case OP_WIDE:
+		case OP_CLOSURE:
+		case OP_CLASS:
+		case OP_INHERIT:
+		case OP_METHOD:
+		case OP_IMPORT:
+		case OP_IS_NUMBER:
+			return false;
+		default:
+			return true;
+	}
+}
+
+static void bits_set(Bits *set, int i) {
+	set[i / 64] |= (Bits)1 << (i % 64);
+}
+
+static void bits_clear(Bits *set, int i) {
+	set[i / 64] &= ~((Bits)1 << (i % 64));
+}
+
+static bool bits_has(Bits *set, int i) {
+	return (set[i / 64] >> (i % 64)) & 1;
+}
+
+// Inlining.
+
+// Whether the instruction pushes a value, rather than only popping or
+// leaving the stack as it was.
+static bool pushes(uint8_t op) {
+	switch (op) {
+		case OP_POP:
+		case OP_PRINT:
+		case OP_DEFINE_GLOBAL:
+		case OP_CLOSE_UPVALUE:
+		case OP_SET_LOCAL:
+		case OP_SET_GLOBAL:
+		case OP_SET_UPVALUE:
+			return false;
+		default:
+			return true;
+	}
+}
+
+static bool constant_operand(uint8_t op) {
+	switch (op) {
+		case OP_CONSTANT:
+		case OP_DEFINE_GLOBAL:
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+		case OP_GET_SUPER:
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// The OP_CALL that calls what the OP_GET_GLOBAL at `offset` pushes, with its
+// arguments pushed by straight-line code in between, or -1.
+static int find_call(Chunk *chunk, int *depths, bool *targets, int offset) {
+	int base = depths[offset];
+	for (int at = offset + 2; at < chunk->count; at += instruction_length(chunk, at)) {
+		uint8_t op = chunk->code[at];
+		if (targets[at] || depths[at] < 0 || branch_op(op) || op == OP_RETURN) return -1;
+		if (op == OP_CALL && depths[at] == base + chunk->code[at + 1] + 1) return at;
+		if (op == OP_SET_LOCAL && chunk->code[at + 1] == base) return -1;
+		if (depths[at] + stack_effect(chunk, at) - pushes(op) <= base) return -1;
+	}
+	return -1;
+}
+
+// A function's code as compiled, even once it's been optimized. Its lines
+// are the function's own chunk's, `function->original` further on.
+static Chunk compiled_code(ObjFunction *function) {
+	Chunk chunk = function->chunk;
+	chunk.code += function->original;
+	chunk.count -= function->original;
+	return chunk;
+}
+
+// Whether `function` is small enough to inline, has run, and needs nothing
+// the inlined code can't have: upvalues, or its own slots past UINT8_COUNT
+// once they're moved up to `base`. It makes no calls either: a check in
+// inlined code would have no frame of the callee's to leave for, and a
+// callee that calls others is better off optimized, inlining them, itself.
+static bool inlinable(Graph *g, ObjFunction *function, int base, int arg_count) {
+	Chunk chunk = compiled_code(function);
+	if (function == g->function || function->arity != arg_count || function->upvalue_count > 0 ||
+	    function->source != NULL || function->hotness == 0 || chunk.count == 0 || chunk.count > SSA_MAX_INLINE ||
+	    base + function->max_stack > UINT8_COUNT) {
+		return false;
+	}
+	int *depths = ALLOCATE(int, chunk.count);
+	bool ok     = stack_depths(&chunk, function->arity + 1, depths);
+	for (int offset = 0; ok && offset < chunk.count; offset += instruction_length(&chunk, offset)) {
+		uint8_t op = chunk.code[offset];
+		ok         = liftable(op) && op != OP_GET_UPVALUE && op != OP_SET_UPVALUE && op != OP_CALL && op != OP_INVOKE &&
+		     op != OP_SUPER_INVOKE;
+	}
+	FREE_ARRAY(int, depths, chunk.count);
+	return ok;
+}
+
+// The closure or class a call with `arg_count` arguments and its callee in
+// slot `base` gets inlined from, or NULL. Only the global's value now says
+// which that is; the check in front of the inlined code covers the rest. A
+// class's methods, its initializer among them, don't change once it's made.
+static Obj *inline_callee(Graph *g, ObjString *name, int base, int arg_count) {
+	Value value;
+	if (!tableGet(&g_vm.globals, name, &value)) return NULL;
+	if (IS_CLOSURE(value)) return inlinable(g, AS_CLOSURE(value)->function, base, arg_count) ? AS_OBJ(value) : NULL;
+	if (!IS_CLASS(value)) return NULL;
+	Value initializer;
+	if (!tableGet(&AS_CLASS(value)->methods, g_vm.init_string, &initializer)) return arg_count == 0 ? AS_OBJ(value) : NULL;
+	return inlinable(g, AS_CLOSURE(initializer)->function, base, arg_count) ? AS_OBJ(value) : NULL;
+}
+
+static void splice_byte(Graph *g, uint8_t byte, int line, int site) {
+	if (g->site_capacity < g->spliced.count + 1) {
+		int old_capacity = g->site_capacity;
+		g->site_capacity = GROW_CAPACITY(old_capacity);
+		g->site_at       = GROW_ARRAY(int, g->site_at, old_capacity, g->site_capacity);
+	}
+	g->site_at[g->spliced.count] = site;
+	write_chunk(&g->spliced, byte, line);
+}
+
+// Point the spliced jump at `at` to `target`.
+static void splice_jump(Graph *g, int at, int target) {
+	uint8_t *code = g->spliced.code;
+	int jump      = code[at] == OP_LOOP ? at + 3 - target : target - (at + 3);
+	if (jump < 0 || jump > UINT16_MAX) g->failed = true;
+	code[at + 1] = (jump >> 8) & 0xff;
+	code[at + 2] = jump & 0xff;
+}
+
+// The index of `value` among the function's constants, added if it isn't
+// there yet.
+static int caller_constant(Graph *g, Value value) {
+	ValueArray *constants = &g->source->constants;
+	for (int i = 0; i < constants->count; i++) {
+		Value other = constants->values[i];
+		if (IS_NUMBER(value) != IS_NUMBER(other)) continue;
+		// Not 0 for -0, which compare equal.
+		double a = IS_NUMBER(value) ? AS_NUMBER(value) : 0;
+		double b = IS_NUMBER(other) ? AS_NUMBER(other) : 0;
+		if (memcmp(&a, &b, sizeof(double)) == 0 && values_equal(value, other)) return i;
+	}
+	int index = add_constant(g->source, value);
+	if (index >= UINT8_COUNT) g->failed = true;
+	return index;
+}
+
+// Copy the instructions of `chunk` in [start, end), with those that jump
+// remembered in `jumps` to be pointed at their targets once `map` has them.
+static void splice_code(Graph *g, Chunk *chunk, int start, int end, int *map, int *jumps, int *jump_count,
+                        int site) {
+	for (int offset = start; offset < end; offset += instruction_length(chunk, offset)) {
+		map[offset] = g->spliced.count;
+		if (branch_op(chunk->code[offset])) {
+			jumps[(*jump_count)++] = offset;
+		}
+		int line = chunk_line(chunk, offset);
+		for (int i = 0; i < instruction_length(chunk, offset); i++) splice_byte(g, chunk->code[offset + i], line, site);
+	}
+}
+
+// The call at `call` to `target` made in place: the check, then for a class
+// a new instance in the callee's slot, then the body of the function or
+// initializer with its slots moved up to where the call puts them and its
+// returns leaving their value in the callee's slot.
+static void splice_call(Graph *g, int call, int base, Obj *target) {
+	ObjFunction *callee = NULL;
+	Value initializer;
+	if (obj_type(target) == OBJ_CLOSURE) {
+		callee = ((ObjClosure *)target)->function;
+	} else if (tableGet(&((ObjClass *)target)->methods, g_vm.init_string, &initializer)) {
+		callee = AS_CLOSURE(initializer)->function;
+	}
+	int line       = chunk_line(g->source, call);
+	int site       = g->site_count++;
+	int constant   = caller_constant(g, OBJ_VAL(target));
+	g->sites[site] = (Site){callee, line, g->spliced.count, call, base, constant};
+
+	// Lifted as the check, see lift_check().
+	splice_byte(g, OP_GET_LOCAL, line, -1);
+	splice_byte(g, base, line, -1);
+	splice_byte(g, OP_POP, line, -1);
+	if (obj_type(target) == OBJ_CLASS) {
+		splice_byte(g, OP_CONSTANT, line, -1);
+		splice_byte(g, constant, line, -1);
+		splice_byte(g, OP_NEW, line, -1);
+		splice_byte(g, OP_SET_LOCAL, line, -1);
+		splice_byte(g, base, line, -1);
+		splice_byte(g, OP_POP, line, -1);
+	}
+	if (callee == NULL) return;
+
+	Chunk code     = compiled_code(callee);
+	Chunk *chunk   = &code;
+	int count      = chunk->count;
+	int *depths    = ALLOCATE(int, count);
+	int *map       = ALLOCATE(int, count + 1);
+	int *jumps     = ALLOCATE(int, count);
+	int *exits     = ALLOCATE(int, count);
+	int jump_count = 0, exit_count = 0;
+	stack_depths(chunk, callee->arity + 1, depths);
+	for (int offset = 0; offset < count; offset += instruction_length(chunk, offset)) {
+		map[offset] = g->spliced.count;
+		if (depths[offset] < 0) continue;
+		uint8_t *code  = &chunk->code[offset];
+		int inner_line = chunk_line(&callee->chunk, callee->original + offset);
+		switch (code[0]) {
+			case OP_GET_LOCAL:
+			case OP_SET_LOCAL:
+				splice_byte(g, code[0], inner_line, site);
+				splice_byte(g, base + code[1], inner_line, site);
+				break;
+			case OP_RETURN:
+				splice_byte(g, OP_SET_LOCAL, inner_line, site);
+				splice_byte(g, base, inner_line, site);
+				for (int i = 1; i < depths[offset]; i++) splice_byte(g, OP_POP, inner_line, site);
+				exits[exit_count++] = g->spliced.count;
+				splice_byte(g, OP_JUMP, inner_line, site);
+				splice_byte(g, 0xff, inner_line, site);
+				splice_byte(g, 0xff, inner_line, site);
+				break;
+			default:
+				if (branch_op(code[0])) jumps[jump_count++] = offset;
+				splice_byte(g, code[0], inner_line, site);
+				for (int i = 1; i < instruction_length(chunk, offset); i++) {
+					bool operand = i == 1 && constant_operand(code[0]);
+					splice_byte(g, operand ? caller_constant(g, chunk->constants.values[code[1]]) : code[i], inner_line,
+					            site);
+				}
+				break;
+		}
+	}
+	map[count] = g->spliced.count;
+	for (int i = 0; i < jump_count; i++) {
+		splice_jump(g, map[jumps[i]], map[jump_target(chunk, jumps[i])]);
+	}
+	for (int i = 0; i < exit_count; i++) splice_jump(g, exits[i], g->spliced.count);
+	FREE_ARRAY(int, depths, count);
+	FREE_ARRAY(int, map, count + 1);
+	FREE_ARRAY(int, jumps, count);
+	FREE_ARRAY(int, exits, count);
+}
+
+// Lift a copy of the function with its calls to small functions inlined, if
+// it makes any.
+static bool inline_calls(Graph *g) {
+	Chunk *chunk = g->source;
+	int count    = chunk->count;
+	int *depths  = ALLOCATE(int, count);
+	bool ok      = stack_depths(chunk, g->function->arity + 1, depths);
+	bool *targets          = ALLOCATE(bool, count + 1);
+	Obj **callee_at        = ALLOCATE(Obj *, count);
+	memset(targets, 0, sizeof(bool) * (count + 1));
+	memset(callee_at, 0, sizeof(Obj *) * count);
+	int calls = 0;
+	for (int offset = 0; ok && offset < count; offset += instruction_length(chunk, offset)) {
+		if (branch_op(chunk->code[offset])) targets[jump_target(chunk, offset)] = true;
+	}
+	for (int offset = 0; ok && offset < count; offset += instruction_length(chunk, offset)) {
+		if (chunk->code[offset] != OP_GET_GLOBAL || depths[offset] < 0) continue;
+		int call = find_call(chunk, depths, targets, offset);
+		if (call < 0) continue;
+		ObjString *name = AS_STRING(chunk->constants.values[chunk->code[offset + 1]]);
+		callee_at[call] = inline_callee(g, name, depths[offset], chunk->code[call + 1]);
+		if (callee_at[call] != NULL) calls++;
+	}
+
+	if (ok && calls > 0) {
+		g->sites     = ALLOCATE(Site, calls);
+		int *map     = ALLOCATE(int, count + 1);
+		int *jumps   = ALLOCATE(int, count);
+		int jump_count = 0;
+		for (int offset = 0; offset < count; offset += instruction_length(chunk, offset)) {
+			if (callee_at[offset] != NULL) {
+				map[offset] = g->spliced.count;
+				splice_call(g, offset, depths[offset] - chunk->code[offset + 1] - 1, callee_at[offset]);
+			} else {
+				splice_code(g, chunk, offset, offset + instruction_length(chunk, offset), map, jumps, &jump_count, -1);
+			}
+		}
+		map[count] = g->spliced.count;
+		for (int i = 0; i < jump_count; i++) {
+			splice_jump(g, map[jumps[i]], map[jump_target(chunk, jumps[i])]);
+		}
+		FREE_ARRAY(int, map, count + 1);
+		FREE_ARRAY(int, jumps, count);
+
+		// Constants are all added by now.
+		finish_lines(&g->spliced.lines);
+		g->spliced.constants = chunk->constants;
+		g->chunk             = &g->spliced;
+		int error;
+		g->max_stack = max_stack_depth(&g->spliced, g->function->arity + 1, &error);
+		ok           = !g->failed && error < 0 && g->spliced.count <= SSA_MAX_CODE;
+	}
+	FREE_ARRAY(int, depths, count);
+	FREE_ARRAY(bool, targets, count + 1);
+	FREE_ARRAY(Obj *, callee_at, count);
+	return ok;
+}
+
+// Lifting.
+
+static int new_node(Graph *g, int op, int block, int offset, uint32_t operand) {
+	if (g->node_capacity < g->node_count + 1) {
+		int old_capacity = g->node_capacity;
+		g->node_capacity = GROW_CAPACITY(old_capacity);
+		g->nodes         = GROW_ARRAY(Node, g->nodes, old_capacity, g->node_capacity);
+	}
+	Node *node = &g->nodes[g->node_count];
+	memset(node, 0, sizeof(*node));
+	node->op      = op;
+	node->block   = block;
+	node->offset  = offset;
+	node->operand = operand;
+	node->first   = g->input_count;
+	node->forward = -1;
+	node->user    = -1;
+	node->slot    = -1;
+	return g->node_count++;
+}
+
+static int new_inputs(Graph *g, int count) {
+	if (g->input_capacity < g->input_count + count) {
+		int old_capacity  = g->input_capacity;
+		g->input_capacity = GROW_CAPACITY(g->input_count + count);
+		g->inputs         = GROW_ARRAY(int, g->inputs, old_capacity, g->input_capacity);
+		g->direct         = GROW_ARRAY(bool, g->direct, old_capacity, g->input_capacity);
+	}
+	int first = g->input_count;
+	g->input_count += count;
+	return first;
+}
+
+static int save_state(Graph *g) {
+	if (g->state_capacity < g->state_count + g->depth) {
+		int old_capacity  = g->state_capacity;
+		g->state_capacity = GROW_CAPACITY(g->state_count + g->depth);
+		g->states         = GROW_ARRAY(int, g->states, old_capacity, g->state_capacity);
+	}
+	int first = g->state_count;
+	memcpy(&g->states[first], g->stack, sizeof(int) * g->depth);
+	g->state_count += g->depth;
+	return first;
+}
+
+static void push_value(Graph *g, int value, bool fresh) {
+	g->stack[g->depth]   = value;
+	g->fresh[g->depth++] = fresh;
+}
+
+// A node for the instruction at `offset`, taking its `arity` inputs off the
+// stack and pushing itself if it has a result.
+static int lift(Graph *g, int block, int offset, int op, uint32_t operand, int arity) {
+	int node  = new_node(g, op, block, offset, operand);
+	int first = new_inputs(g, arity);
+	g->depth -= arity;
+	for (int i = 0; i < arity; i++) {
+		g->inputs[first + i] = g->stack[g->depth + i];
+		g->direct[first + i] = g->fresh[g->depth + i];
+	}
+	g->nodes[node].first = first;
+	g->nodes[node].count = arity;
+	if (has_result(op)) push_value(g, node, true);
+	return node;
+}
+
+// Find the blocks and their edges, and the depth of the stack in each.
+static bool split_blocks(Graph *g) {
+	Chunk *chunk = g->chunk;
+	int count     = chunk->count;
+	g->code_count = count;
+	g->depths     = ALLOCATE(int, count);
+	if (!stack_depths(chunk, g->function->arity + 1, g->depths)) return false;
+	g->block_at = ALLOCATE(int, count + 1);
+	for (int i = 0; i <= count; i++) g->block_at[i] = -1;
+	g->block_at[0] = 0;
+	for (int offset = 0; offset < count; offset += instruction_length(chunk, offset)) {
+		uint8_t op = chunk->code[offset];
+		if (!liftable(op)) return false;
+		if (branch_op(op)) g->block_at[jump_target(chunk, offset)] = 0;
+		if (branch_op(op) || op == OP_RETURN) g->block_at[offset + instruction_length(chunk, offset)] = 0;
+	}
+
+	// Block zero is the way in, where the parameters are defined.
+	g->block_count = 1;
+	for (int offset = 0; offset < count; offset++) {
+		if (g->block_at[offset] == 0) g->block_at[offset] = g->block_count++;
+	}
+	g->blocks = ALLOCATE(Block, g->block_count);
+	memset(g->blocks, 0, sizeof(Block) * g->block_count);
+	g->blocks[0] = (Block){.exit = -1, .succ = {1, -1}, .depth = g->function->arity + 1, .label = -1};
+	for (int offset = 0, b = 1; offset < count; b++) {
+		Block *block   = &g->blocks[b];
+		block->start  = offset;
+		block->depth  = g->depths[offset];
+		block->label  = -1;
+		block->exit   = -1;
+		block->succ[0] = block->succ[1] = -1;
+		do {
+			block->last = offset;
+			offset += instruction_length(chunk, offset);
+		} while (offset < count && g->block_at[offset] < 0);
+		block->end = offset;
+		uint8_t op = chunk->code[block->last];
+		if (branch_op(op) || op == OP_RETURN) block->exit = op;
+		if (op != OP_JUMP && op != OP_LOOP && op != OP_RETURN) block->succ[0] = g->block_at[offset];
+		if (branch_op(op)) block->succ[1] = g->block_at[jump_target(chunk, block->last)];
+	}
+
+	// Predecessors, from reachable blocks only.
+	for (int b = 0; b < g->block_count; b++) {
+		Block *block = &g->blocks[b];
+		if (block->depth < 0) continue;
+		for (int i = 0; i < 2; i++) {
+			if (block->succ[i] >= 0) g->blocks[block->succ[i]].pred_count++;
+		}
+	}
+	g->preds  = ALLOCATE(int, 2 * g->block_count);
+	int first = 0;
+	for (int b = 0; b < g->block_count; b++) {
+		g->blocks[b].first_pred = first;
+		first += g->blocks[b].pred_count;
+		g->blocks[b].pred_count = 0;
+	}
+	for (int b = 0; b < g->block_count; b++) {
+		Block *block = &g->blocks[b];
+		if (block->depth < 0) continue;
+		for (int i = 0; i < 2; i++) {
+			if (block->succ[i] < 0) continue;
+			Block *succ                                   = &g->blocks[block->succ[i]];
+			g->preds[succ->first_pred + succ->pred_count++] = b;
+		}
+	}
+	return true;
+}
+
+// Set up the stack on entry to block `b`, with phis where its predecessors
+// disagree or haven't been lifted yet, which are all that jump back to it.
+static void enter_block(Graph *g, int b) {
+	Block *block      = &g->blocks[b];
+	block->first_node = g->node_count;
+	g->depth          = block->depth;
+	bool seen         = true;
+	for (int k = 0; k < block->pred_count; k++) {
+		if (g->preds[block->first_pred + k] >= b) seen = false;
+	}
+	for (int j = 0; j < block->depth; j++) {
+		int value = -1;
+		if (seen) {
+			for (int k = 0; k < block->pred_count; k++) {
+				int other = g->states[g->blocks[g->preds[block->first_pred + k]].exit_state + j];
+				if (k == 0) value = other;
+				if (other != value) value = -1;
+			}
+		}
+		if (value < 0) {
+			value     = new_node(g, IR_PHI, b, block->start, j);
+			int first = new_inputs(g, block->pred_count);
+			for (int k = 0; k < block->pred_count; k++) {
+				int pred             = g->preds[block->first_pred + k];
+				g->inputs[first + k] = pred < b ? g->states[g->blocks[pred].exit_state + j] : -1;
+				g->direct[first + k] = false;
+			}
+			g->nodes[value].first = first;
+			g->nodes[value].count = block->pred_count;
+		}
+		g->stack[j] = value;
+		g->fresh[j] = false;
+	}
+}
+
+// The site whose check is at `offset` in the spliced code, or -1.
+static int check_at(Graph *g, int offset) {
+	for (int i = 0; i < g->site_count; i++) {
+		if (g->sites[i].check == offset) return i;
+	}
+	return -1;
+}
+
+// A check takes everything on the stack, which is what the original code
+// needs at the call when it leaves for it.
+static void lift_check(Graph *g, int b, int offset, int site) {
+	int node  = new_node(g, IR_CHECK, b, offset, site);
+	int first = new_inputs(g, g->depth);
+	for (int i = 0; i < g->depth; i++) {
+		g->inputs[first + i] = g->stack[i];
+		g->direct[first + i] = false;
+	}
+	g->nodes[node].first = first;
+	g->nodes[node].count = g->depth;
+	g->nodes[node].args  = g->depth;
+}
+
+static bool lift_block(Graph *g, int b) {
+	Chunk *chunk = g->chunk;
+	Block *block = &g->blocks[b];
+	enter_block(g, b);
+	for (int offset = block->start; offset < block->end; offset += instruction_length(chunk, offset)) {
+		uint8_t *code = &chunk->code[offset];
+		uint8_t op    = code[0];
+		uint8_t a     = instruction_length(chunk, offset) > 1 ? code[1] : 0;
+		int top       = g->depth > 0 ? g->stack[g->depth - 1] : -1;
+		int site      = check_at(g, offset);
+		if (site >= 0) lift_check(g, b, offset, site);
+		switch (op) {
+			case OP_CONSTANT:
+			case OP_NIL:
+			case OP_TRUE:
+			case OP_FALSE:
+			case OP_GET_GLOBAL:
+			case OP_GET_UPVALUE:
+				lift(g, b, offset, op, a, 0);
+				break;
+			case OP_POP:
+			case OP_CLOSE_UPVALUE:  // nothing here makes a closure that could capture it
+				g->depth--;
+				break;
+			case OP_GET_LOCAL:
+				push_value(g, g->stack[a], false);
+				break;
+			case OP_SET_LOCAL:
+				g->stack[a] = top;
+				if (a != g->depth - 1) g->fresh[a] = false;
+				break;
+			case OP_DEFINE_GLOBAL:
+			case OP_PRINT:
+			case OP_GET_PROPERTY:
+			case OP_NEW:
+			case OP_NOT:
+			case OP_NEGATE:
+			case OP_NEGATE_NUMBER:
+				lift(g, b, offset, op, a, 1);
+				break;
+			case OP_SET_GLOBAL:
+			case OP_SET_UPVALUE:
+				lift(g, b, offset, op, a, 1);
+				push_value(g, top, false);
+				break;
+			case OP_SET_PROPERTY:
+				lift(g, b, offset, op, a, 2);
+				push_value(g, top, false);
+				break;
+			case OP_GET_SUPER:
+			case OP_EQUAL:
+			case OP_GREATER:
+			case OP_LESS:
+			case OP_ADD:
+			case OP_SUBTRACT:
+			case OP_MULTIPLY:
+			case OP_DIVIDE:
+			case OP_ADD_NUMBER:
+			case OP_SUBTRACT_NUMBER:
+			case OP_MULTIPLY_NUMBER:
+			case OP_DIVIDE_NUMBER:
+			case OP_GREATER_NUMBER:
+			case OP_LESS_NUMBER:
+				lift(g, b, offset, op, a, 2);
+				break;
+			case OP_CALL:
+				lift(g, b, offset, op, a, a + 1);
+				break;
+			case OP_INVOKE:
+			case OP_SUPER_INVOKE: {
+				int node            = lift(g, b, offset, op, a, code[2] + (op == OP_INVOKE ? 1 : 2));
+				g->nodes[node].args = code[2];
+				break;
+			}
+			case OP_BUILD_STRING:
+				lift(g, b, offset, op, a, a);
+				break;
+			case OP_JUMP:
+			case OP_LOOP:
+				break;
+			case OP_JUMP_IF_FALSE:
+			case OP_JUMP_IF_TRUE:
+			case OP_RETURN:
+				block->value        = top;
+				block->value_direct = g->fresh[g->depth - 1];
+				if (op == OP_RETURN) g->depth--;
+				break;
+			default:
+				return false;
+		}
+	}
+	block->end_node   = g->node_count;
+	block->exit_state = save_state(g);
+	block->exit_depth = g->depth;
+	return true;
+}
+
+// A phi whose inputs are all one other value, or itself, is that value.
+static void remove_trivial_phis(Graph *g) {
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int n = 0; n < g->node_count; n++) {
+			Node *node = &g->nodes[n];
+			if (node->op != IR_PHI || !alive(node)) continue;
+			int same = -1;
+			bool trivial = true;
+			for (int i = 0; i < node->count && trivial; i++) {
+				int value = input(g, node, i);
+				if (value == n || value == same) continue;
+				trivial = same < 0;
+				same    = value;
+			}
+			if (trivial && same >= 0) {
+				node->forward = same;
+				changed       = true;
+			}
+		}
+	}
+}
+
+static bool build(Graph *g) {
+	if (!inline_calls(g) || !split_blocks(g)) return false;
+	g->capacity = (g->max_stack > g->function->max_stack ? g->max_stack : g->function->max_stack) + 1;
+	g->stack    = ALLOCATE(int, g->capacity);
+	g->fresh    = ALLOCATE(bool, g->capacity);
+
+	Block *entry      = &g->blocks[0];
+	entry->first_node = 0;
+	for (int slot = 0; slot <= g->function->arity; slot++) {
+		push_value(g, new_node(g, IR_PARAM, 0, 0, slot), false);
+	}
+	entry->end_node   = g->node_count;
+	entry->exit_state = save_state(g);
+	entry->exit_depth = g->depth;
+
+	for (int b = 1; b < g->block_count; b++) {
+		if (g->blocks[b].depth >= 0 && !lift_block(g, b)) return false;
+		if (g->node_count > SSA_MAX_NODES) return false;
+	}
+	// The inputs of phis from blocks that jump back.
+	for (int n = 0; n < g->node_count; n++) {
+		Node *node = &g->nodes[n];
+		if (node->op != IR_PHI) continue;
+		Block *block = &g->blocks[node->block];
+		for (int k = 0; k < node->count; k++) {
+			if (g->inputs[node->first + k] >= 0) continue;
+			Block *pred                 = &g->blocks[g->preds[block->first_pred + k]];
+			g->inputs[node->first + k] = g->states[pred->exit_state + node->operand];
+		}
+	}
+	remove_trivial_phis(g);
+
+	// Dominators, by Cooper, Harvey and Kennedy's iteration. Blocks are in
+	// bytecode order, so every edge but a loop's goes forward.
+	for (int b = 1; b < g->block_count; b++) g->blocks[b].idom = -1;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int b = 1; b < g->block_count; b++) {
+			Block *block = &g->blocks[b];
+			if (block->depth < 0) continue;
+			int idom = -1;
+			for (int k = 0; k < block->pred_count; k++) {
+				int pred = g->preds[block->first_pred + k];
+				if (g->blocks[pred].idom < 0) continue;
+				if (idom < 0) {
+					idom = pred;
+					continue;
+				}
+				while (pred != idom) {
+					while (pred > idom) pred = g->blocks[pred].idom;
+					while (idom > pred) idom = g->blocks[idom].idom;
+				}
+			}
+			if (idom != block->idom) {
+				block->idom = idom;
+				changed     = true;
+			}
+		}
+	}
+	return true;
+}
+
+static bool ends_with_value(Block *block) {
+	return block->exit == OP_RETURN || block->exit == OP_JUMP_IF_FALSE || block->exit == OP_JUMP_IF_TRUE;
+}
+
+static bool dominates(Graph *g, int a, int b) {
+	while (b > a) b = g->blocks[b].idom;
+	return a == b;
+}
+
+// The passes.
+
+static ObjString *name_of(Graph *g, Node *node) {
+	return AS_STRING(g->chunk->constants.values[node->operand]);
+}
+
+// Whether node `n` stores field `name` of `object`, including the stores
+// replace_scalars() has dropped.
+static bool stores(Graph *g, int n, int object, ObjString *name) {
+	Node *node = &g->nodes[n];
+	return node->op == OP_SET_PROPERTY && node->forward < 0 && input(g, node, 0) == object && name_of(g, node) == name;
+}
+
+// Whether control goes on from node `from` to node `at` in block `b`, not
+// by way of `object` being made again.
+static bool reaches(Graph *g, int from, int b, int at, int object) {
+	int home    = g->nodes[object].block;
+	bool *seen  = ALLOCATE(bool, g->block_count);
+	int *work   = ALLOCATE(int, 2 * g->block_count);
+	int queued  = 0;
+	bool found  = false;
+	Block *last = &g->blocks[g->nodes[from].block];
+	memset(seen, 0, sizeof(bool) * g->block_count);
+	for (int i = 0; i < 2; i++) {
+		if (last->succ[i] >= 0) work[queued++] = last->succ[i];
+	}
+	while (queued > 0 && !found) {
+		int block = work[--queued];
+		if (seen[block] || block == home) continue;
+		seen[block] = true;
+		found       = block == b;
+		for (int i = 0; i < 2; i++) {
+			if (g->blocks[block].succ[i] >= 0) work[queued++] = g->blocks[block].succ[i];
+		}
+	}
+	FREE_ARRAY(bool, seen, g->block_count);
+	FREE_ARRAY(int, work, 2 * g->block_count);
+	return found;
+}
+
+enum { FIELD_UNSET = -1, FIELD_UNKNOWN = -2 };
+
+// The store whose value field `name` of `object` holds at node `at` in
+// block `b`: the last on the way there. FIELD_UNSET when there's none, and
+// FIELD_UNKNOWN when another may have come after it.
+static int field_value(Graph *g, int object, ObjString *name, int b, int at) {
+	int home  = g->nodes[object].block;
+	int store = -1;
+	for (int block = b;; block = g->blocks[block].idom) {
+		Block *here = &g->blocks[block];
+		for (int n = here->first_node; n < here->end_node; n++) {
+			if ((block != b || n < at) && stores(g, n, object, name)) store = n;
+		}
+		if (store >= 0 || block == home) break;
+	}
+	int store_block = store >= 0 ? g->nodes[store].block : -1;
+	for (int n = 0; n < g->node_count; n++) {
+		if (n == store || !stores(g, n, object, name)) continue;
+		// Stores on the way to the last one are overwritten by it.
+		int block = g->nodes[n].block;
+		if (store >= 0 && (block == store_block ? n < store : dominates(g, block, store_block))) continue;
+		if (reaches(g, n, b, at, object)) return FIELD_UNKNOWN;
+	}
+	return store >= 0 ? store : FIELD_UNSET;
+}
+
+// The one node that uses `n`, or -1 when there are more, or a block uses it.
+static int only_user(Graph *g, int n) {
+	int user = -1;
+	for (int m = 0; m < g->node_count; m++) {
+		Node *node = &g->nodes[m];
+		if (!alive(node)) continue;
+		for (int i = 0; i < node->count; i++) {
+			if (input(g, node, i) != n) continue;
+			if (user >= 0) return -1;
+			user = m;
+		}
+	}
+	for (int b = 1; b < g->block_count; b++) {
+		Block *block = &g->blocks[b];
+		if (block->depth >= 0 && ends_with_value(block) && resolve(g, block->value) == n) return -1;
+	}
+	return user;
+}
+
+// Whether the load `n` of a method from `object` makes a bound method only
+// to call it straight away, with nothing in between that could call code
+// that sees the instance. The call can invoke the method instead.
+static bool bound_call(Graph *g, int n, int object) {
+	Node *load = &g->nodes[n];
+	Value klass = g->chunk->constants.values[g->nodes[input(g, &g->nodes[object], 0)].operand];
+	Value method;
+	if (!tableGet(&AS_CLASS(klass)->methods, name_of(g, load), &method)) return false;
+	int call = only_user(g, n);
+	if (call < 0 || g->nodes[call].op != OP_CALL || input(g, &g->nodes[call], 0) != n || g->nodes[call].block != load->block) {
+		return false;
+	}
+	for (int m = n + 1; m < call; m++) {
+		int op = g->nodes[m].op;
+		if (alive(&g->nodes[m]) && (op == OP_CALL || op == OP_INVOKE || op == OP_SUPER_INVOKE || op == OP_SET_PROPERTY || op == IR_CHECK)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Add `count` inputs to node `n`, moving its others to make room.
+static int more_inputs(Graph *g, int n, int count) {
+	Node *node = &g->nodes[n];
+	int first  = new_inputs(g, node->count + count);
+	memcpy(&g->inputs[first], &g->inputs[node->first], sizeof(int) * node->count);
+	memcpy(&g->direct[first], &g->direct[node->first], sizeof(bool) * node->count);
+	node->first = first;
+	node->count += count;
+	return first + node->count - count;
+}
+
+// Look at an instance made here, and either keep it as its fields or leave
+// it be, perhaps with the one bound method it makes invoked instead.
+static void replace_scalar(Graph *g, int n) {
+	Object *object = &g->objects[g->object_count];
+	object->node   = n;
+	object->klass  = g->nodes[input(g, &g->nodes[n], 0)].operand;
+	object->count  = 0;
+	bool escapes   = false;
+	int bound      = -1;
+	// Stores dropped for instances already replaced still count: what they
+	// stored is one of those instances' fields.
+	for (int m = 0; m < g->node_count && !escapes; m++) {
+		Node *user = &g->nodes[m];
+		if (user->forward >= 0) continue;
+		for (int i = 0; i < user->count; i++) {
+			if (input(g, user, i) != n) continue;
+			if (user->op == OP_SET_PROPERTY && i == 0) {
+				ObjString *name = name_of(g, user);
+				int field       = 0;
+				while (field < object->count && object->fields[field] != name) field++;
+				if (field == OBJECT_FIELDS) {
+					escapes = true;
+				} else if (field == object->count) {
+					object->fields[object->count]  = name;
+					object->names[object->count++] = user->operand;
+				}
+			} else if (user->op == OP_GET_PROPERTY) {
+				continue;
+			} else if (user->op != IR_CHECK || i >= user->args) {
+				escapes = true;
+			}
+		}
+	}
+	for (int b = 1; b < g->block_count && !escapes; b++) {
+		Block *block = &g->blocks[b];
+		escapes      = block->depth >= 0 && ends_with_value(block) && resolve(g, block->value) == n;
+	}
+
+	// Every load has to find the field set, and every check to know what
+	// each field holds.
+	for (int m = 0; m < g->node_count && !escapes; m++) {
+		Node *user = &g->nodes[m];
+		if (!alive(user)) continue;
+		if (user->op == OP_GET_PROPERTY && input(g, user, 0) == n) {
+			int store = field_value(g, n, name_of(g, user), user->block, m);
+			if (store == FIELD_UNSET && bound < 0 && bound_call(g, m, n)) {
+				bound = m;
+			} else {
+				escapes = store < 0;
+			}
+		}
+		if (user->op != IR_CHECK) continue;
+		bool takes = false;
+		for (int i = 0; i < user->args; i++) takes = takes || input(g, user, i) == n;
+		for (int f = 0; takes && f < object->count; f++) {
+			escapes = escapes || field_value(g, n, object->fields[f], user->block, m) == FIELD_UNKNOWN;
+		}
+	}
+	if (escapes) return;
+
+	if (bound >= 0) {
+		Node *load             = &g->nodes[bound];
+		Node *call             = &g->nodes[only_user(g, bound)];
+		call->op               = OP_INVOKE;
+		call->args             = call->operand;
+		call->operand          = load->operand;
+		g->inputs[call->first] = n;
+		g->direct[call->first] = false;
+		load->dead             = true;
+		return;
+	}
+
+	g->object_count++;
+	g->nodes[n].scalar = true;
+	for (int m = 0; m < g->node_count; m++) {
+		Node *user = &g->nodes[m];
+		if (!alive(user)) continue;
+		if (user->op == OP_GET_PROPERTY && input(g, user, 0) == n) {
+			int store     = field_value(g, n, name_of(g, user), user->block, m);
+			user->forward = input(g, &g->nodes[store], 1);
+		}
+		if (user->op != IR_CHECK) continue;
+		bool takes = false;
+		for (int i = 0; i < user->args; i++) takes = takes || input(g, user, i) == n;
+		for (int f = 0; takes && f < object->count; f++) {
+			int store = field_value(g, n, object->fields[f], user->block, m);
+			if (store < 0) continue;
+			int value     = input(g, &g->nodes[store], 1);
+			int at        = more_inputs(g, m, 1);
+			g->inputs[at] = value;
+			g->direct[at] = false;
+		}
+	}
+	for (int m = 0; m < g->node_count; m++) {
+		Node *node = &g->nodes[m];
+		if (node->op == OP_SET_PROPERTY && alive(node) && input(g, node, 0) == n) node->dead = true;
+	}
+}
+
+// Escape analysis and scalar replacement. An instance made by an inlined
+// call whose fields are only set and read here, or that only checks hold
+// on to, is never made: a load is the value last stored to the field, and a
+// check that fails makes the instance with the fields it has by then.
+static void replace_scalars(Graph *g) {
+	int count = 0;
+	for (int n = 0; n < g->node_count; n++) {
+		if (alive(&g->nodes[n]) && g->nodes[n].op == OP_NEW) count++;
+	}
+	if (count == 0) return;
+	g->objects         = ALLOCATE(Object, count);
+	g->object_capacity = count;
+	for (int n = 0; n < g->node_count; n++) {
+		if (alive(&g->nodes[n]) && g->nodes[n].op == OP_NEW) replace_scalar(g, n);
+	}
+}
+
+
+// Optimistically, every value is a number until one of its inputs isn't.
+static void infer_numbers(Graph *g) {
+	uint32_t speculated = g->function->number_args;
+	Value *constants    = g->chunk->constants.values;
+	for (int n = 0; n < g->node_count; n++) g->nodes[n].number = true;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int n = 0; n < g->node_count; n++) {
+			Node *node = &g->nodes[n];
+			if (!alive(node)) continue;
+			bool number = false;
+			switch (node->op) {
+				case IR_PARAM:
+					number = node->operand >= 1 && node->operand <= 32 && (speculated >> (node->operand - 1) & 1);
+					break;
+				case IR_PHI:
+				case OP_ADD:
+				case OP_SUBTRACT:
+				case OP_MULTIPLY:
+				case OP_DIVIDE:
+				case OP_NEGATE:
+					number = true;
+					for (int i = 0; i < node->count; i++) number = number && g->nodes[input(g, node, i)].number;
+					break;
+				case OP_CONSTANT:
+					number = IS_NUMBER(constants[node->operand]);
+					break;
+				case OP_ADD_NUMBER:
+				case OP_SUBTRACT_NUMBER:
+				case OP_MULTIPLY_NUMBER:
+				case OP_DIVIDE_NUMBER:
+				case OP_NEGATE_NUMBER:
+					number = true;
+					break;
+			}
+			if (number != node->number) {
+				node->number = number;
+				changed      = true;
+			}
+		}
+	}
+
+	for (int n = 0; n < g->node_count; n++) {
+		Node *node = &g->nodes[n];
+		if (!alive(node)) continue;
+		bool numbers = node->count > 0;
+		for (int i = 0; i < node->count; i++) numbers = numbers && g->nodes[input(g, node, i)].number;
+		if (!numbers) continue;
+		switch (node->op) {
+			case OP_ADD: node->op = OP_ADD_NUMBER; break;
+			case OP_SUBTRACT: node->op = OP_SUBTRACT_NUMBER; break;
+			case OP_MULTIPLY: node->op = OP_MULTIPLY_NUMBER; break;
+			case OP_DIVIDE: node->op = OP_DIVIDE_NUMBER; break;
+			case OP_NEGATE: node->op = OP_NEGATE_NUMBER; break;
+			case OP_GREATER: node->op = OP_GREATER_NUMBER; break;
+			case OP_LESS: node->op = OP_LESS_NUMBER; break;
+		}
+	}
+}
+
+#define KNOWN_MAX 32
+
+// Redundant loads: within a block, a global or upvalue read again is what
+// was last read from or stored to it, until a call, which may change either.
+static void forward_loads(Graph *g) {
+	struct {
+		bool global;
+		uintptr_t key;  // the name, or the upvalue's index
+		int value;
+	} known[KNOWN_MAX];
+	Value *constants = g->chunk->constants.values;
+	for (int b = 1; b < g->block_count; b++) {
+		Block *block = &g->blocks[b];
+		int count    = 0;
+		for (int n = block->first_node; n < block->end_node; n++) {
+			Node *node = &g->nodes[n];
+			if (!alive(node)) continue;
+			int op = node->op;
+			if (op == OP_CALL || op == OP_INVOKE || op == OP_SUPER_INVOKE) {
+				count = 0;
+				continue;
+			}
+			bool global = op == OP_GET_GLOBAL || op == OP_SET_GLOBAL || op == OP_DEFINE_GLOBAL;
+			if (!global && op != OP_GET_UPVALUE && op != OP_SET_UPVALUE) continue;
+			uintptr_t key = global ? (uintptr_t)AS_OBJ(constants[node->operand]) : node->operand;
+			int found     = -1;
+			for (int i = 0; i < count; i++) {
+				if (known[i].global == global && known[i].key == key) found = i;
+			}
+			if (op == OP_GET_GLOBAL || op == OP_GET_UPVALUE) {
+				if (found >= 0) {
+					node->forward = known[found].value;
+					continue;
+				}
+				if (count == KNOWN_MAX) continue;
+				found               = count++;
+				known[found].value  = n;
+			} else {
+				if (found < 0 && count == KNOWN_MAX) continue;
+				if (found < 0) found = count++;
+				known[found].value = input(g, node, 0);
+			}
+			known[found].global = global;
+			known[found].key    = key;
+		}
+	}
+}
+
+// Global value numbering: a pure op with the same inputs as one that
+// dominates it is that one.
+static void number_values(Graph *g) {
+	for (int y = 0; y < g->node_count; y++) {
+		Node *later = &g->nodes[y];
+		if (!alive(later) || !pure_op(later->op)) continue;
+		for (int x = 0; x < y; x++) {
+			Node *earlier = &g->nodes[x];
+			if (!alive(earlier) || earlier->op != later->op || earlier->count != later->count) continue;
+			bool same = true;
+			for (int i = 0; i < later->count; i++) same = same && input(g, earlier, i) == input(g, later, i);
+			if (!same && commutative(later->op)) {
+				same = input(g, earlier, 0) == input(g, later, 1) && input(g, earlier, 1) == input(g, later, 0);
+			}
+			if (same && dominates(g, earlier->block, later->block)) {
+				later->forward = x;
+				break;
+			}
+		}
+	}
+}
+
+// Loop-invariant code motion, inner loops first so that what leaves one can
+// go on out of the loops around it.
+static void hoist(Graph *g) {
+	bool *in_loop = ALLOCATE(bool, g->block_count);
+	int *work     = ALLOCATE(int, g->block_count);
+	for (int header = g->block_count - 1; header >= 1; header--) {
+		Block *block = &g->blocks[header];
+		if (block->depth < 0) continue;
+		memset(in_loop, 0, sizeof(bool) * g->block_count);
+		in_loop[header] = true;
+		bool loop       = false;
+		int queued      = 0;
+		for (int k = 0; k < block->pred_count; k++) {
+			int pred = g->preds[block->first_pred + k];
+			if (pred < header || !dominates(g, header, pred)) continue;
+			loop = true;
+			if (!in_loop[pred]) {
+				in_loop[pred]  = true;
+				work[queued++] = pred;
+			}
+		}
+		if (!loop) continue;
+		while (queued > 0) {
+			Block *member = &g->blocks[work[--queued]];
+			for (int k = 0; k < member->pred_count; k++) {
+				int pred = g->preds[member->first_pred + k];
+				if (!in_loop[pred]) {
+					in_loop[pred]  = true;
+					work[queued++] = pred;
+				}
+			}
+		}
+
+		int preheader = block->idom;
+		for (int n = 0; n < g->node_count; n++) {
+			Node *node = &g->nodes[n];
+			if (!alive(node) || !pure_op(node->op) || !in_loop[node->block]) continue;
+			bool invariant = true;
+			for (int i = 0; i < node->count; i++) {
+				Node *from = &g->nodes[input(g, node, i)];
+				invariant  = invariant && (constant_op(from->op) || !in_loop[from->block]);
+			}
+			if (invariant) {
+				node->block = preheader;
+				node->moved = true;
+			}
+		}
+	}
+	FREE_ARRAY(bool, in_loop, g->block_count);
+	FREE_ARRAY(int, work, g->block_count);
+}
+
+// Dead code: keep what has effects or may fail, what the blocks branch on
+// and return, and what those use.
+static void sweep(Graph *g) {
+	bool *live = ALLOCATE(bool, g->node_count);
+	int *work  = ALLOCATE(int, g->node_count);
+	int queued = 0;
+	memset(live, 0, sizeof(bool) * g->node_count);
+	for (int n = 0; n < g->node_count; n++) {
+		Node *node = &g->nodes[n];
+		bool keep  = !pure_op(node->op) && !constant_op(node->op) && node->op != IR_PHI && node->op != OP_GET_UPVALUE;
+		if (alive(node) && keep) {
+			live[n]        = true;
+			work[queued++] = n;
+		}
+	}
+	for (int b = 1; b < g->block_count; b++) {
+		Block *block = &g->blocks[b];
+		if (block->depth < 0 || (block->exit != OP_RETURN && block->exit != OP_JUMP_IF_FALSE && block->exit != OP_JUMP_IF_TRUE)) {
+			continue;
+		}
+		int value = resolve(g, block->value);
+		if (!live[value]) {
+			live[value]    = true;
+			work[queued++] = value;
+		}
+	}
+	while (queued > 0) {
+		Node *node = &g->nodes[work[--queued]];
+		for (int i = 0; i < node->count; i++) {
+			int value = input(g, node, i);
+			if (!live[value]) {
+				live[value]    = true;
+				work[queued++] = value;
+			}
+		}
+	}
+	for (int n = 0; n < g->node_count; n++) {
+		if (!live[n]) g->nodes[n].dead = true;
+	}
+	FREE_ARRAY(bool, live, g->node_count);
+	FREE_ARRAY(int, work, g->node_count);
+}
+
+// Back to bytecode.
+
+static void use(Graph *g, int value, int user, int block, bool direct) {
+	Node *node      = &g->nodes[value];
+	node->uses     += 1;
+	node->user      = user;
+	node->use_block = block;
+	node->direct    = direct;
+}
+
+static void count_uses(Graph *g) {
+	for (int n = 0; n < g->node_count; n++) {
+		Node *node = &g->nodes[n];
+		if (!alive(node)) continue;
+		for (int i = 0; i < node->count; i++) {
+			int value   = input(g, node, i);
+			bool direct = node->op != IR_PHI && g->direct[node->first + i] && value == g->inputs[node->first + i];
+			use(g, value, n, node->block, direct);
+		}
+	}
+	for (int b = 1; b < g->block_count; b++) {
+		Block *block = &g->blocks[b];
+		if (block->depth < 0 || (block->exit != OP_RETURN && block->exit != OP_JUMP_IF_FALSE && block->exit != OP_JUMP_IF_TRUE)) {
+			continue;
+		}
+		int value = resolve(g, block->value);
+		use(g, value, -1, b, block->value_direct && value == block->value);
+	}
+}
+
+static bool root_op(int op) {
+	return !constant_op(op) && op != IR_PHI && op != IR_PARAM;
+}
+
+// A value used once, straight off the stack and in its own block, is emitted
+// where it's used, as long as nothing emitted on its own comes in between
+// and would run in a different order.
+static void choose_inlined(Graph *g) {
+	for (int n = 0; n < g->node_count; n++) {
+		Node *node    = &g->nodes[n];
+		node->inlined = alive(node) && root_op(node->op) && has_result(node->op) && node->uses == 1 &&
+		                node->direct && !node->moved && node->use_block == node->block &&
+		                (node->user < 0 || !g->nodes[node->user].moved);
+	}
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int n = 0; n < g->node_count; n++) {
+			Node *node = &g->nodes[n];
+			if (!node->inlined) continue;
+			int end = node->user >= 0 ? node->user : g->blocks[node->block].end_node;
+			for (int m = n + 1; m < end; m++) {
+				Node *other = &g->nodes[m];
+				if (alive(other) && root_op(other->op) && !other->moved && !other->inlined && !other->scalar) {
+					node->inlined = false;
+					changed       = true;
+					break;
+				}
+			}
+		}
+	}
+
+	// What each block emits on its own: its own nodes in order, then those
+	// hoisted into it.
+	g->roots  = ALLOCATE(int, g->node_count);
+	int count = 0;
+	for (int b = 0; b < g->block_count; b++) {
+		Block *block      = &g->blocks[b];
+		block->first_root = count;
+		if (block->depth < 0) continue;
+		for (int pass = 0; pass < 2; pass++) {
+			int from = pass == 0 ? block->first_node : 0;
+			int to   = pass == 0 ? block->end_node : g->node_count;
+			for (int n = from; n < to; n++) {
+				Node *node = &g->nodes[n];
+				if (alive(node) && root_op(node->op) && !node->inlined && !node->scalar && node->moved == (pass == 1) &&
+				    node->block == b) {
+					g->roots[count++] = n;
+				}
+			}
+		}
+		block->root_count = count - block->first_root;
+	}
+}
+
+static bool slotted(Graph *g, int n) {
+	Node *node = &g->nodes[n];
+	return alive(node) && node->uses > 0 && !node->inlined && !node->scalar && !constant_op(node->op);
+}
+
+// Add the slots that emitting `value` reads to `live`.
+static void reads(Graph *g, int value, Bits *live) {
+	value      = resolve(g, value);
+	Node *node = &g->nodes[value];
+	if (constant_op(node->op) || node->scalar) return;
+	if (!node->inlined) {
+		bits_set(live, value);
+		return;
+	}
+	for (int i = 0; i < node->count; i++) reads(g, g->inputs[node->first + i], live);
+}
+
+static void conflict(Graph *g, int value, Bits *live) {
+	Bits *row = &g->interfere[value * g->words];
+	for (int w = 0; w < g->words; w++) {
+		Bits bits = live[w];
+		row[w] |= bits;
+		while (bits != 0) {
+			int other = w * 64 + __builtin_ctzll(bits);
+			bits &= bits - 1;
+			bits_set(&g->interfere[other * g->words], value);
+		}
+	}
+	bits_clear(row, value);
+	bits_clear(&g->interfere[value * g->words], value);
+}
+
+// Walk block `b` backwards from the values live at its end, leaving those live
+// at its start. With `interfere`, note what's live where each value is written.
+static void scan_block(Graph *g, int b, Bits *live, bool interfere) {
+	Block *block = &g->blocks[b];
+	if (ends_with_value(block)) reads(g, block->value, live);
+	for (int i = block->root_count - 1; i >= 0; i--) {
+		int root   = g->roots[block->first_root + i];
+		Node *node = &g->nodes[root];
+		if (slotted(g, root)) {
+			if (interfere) conflict(g, root, live);
+			bits_clear(live, root);
+		}
+		for (int j = 0; j < node->count; j++) reads(g, g->inputs[node->first + j], live);
+	}
+	// Phis, and parameters, are written on the way in.
+	for (int n = block->first_node; n < block->end_node; n++) {
+		int op = g->nodes[n].op;
+		if ((op == IR_PHI || op == IR_PARAM) && slotted(g, n) && interfere) conflict(g, n, live);
+	}
+	for (int n = block->first_node; n < block->end_node; n++) {
+		int op = g->nodes[n].op;
+		if (op == IR_PHI || op == IR_PARAM) bits_clear(live, n);
+	}
+}
+
+// The values live at the end of block `b`: those live into its successors,
+// and what it hands their phis.
+static void live_out(Graph *g, int b, Bits *live_in, Bits *live) {
+	Block *block = &g->blocks[b];
+	memset(live, 0, sizeof(Bits) * g->words);
+	for (int i = 0; i < 2; i++) {
+		int s = block->succ[i];
+		if (s < 0) continue;
+		Block *succ = &g->blocks[s];
+		for (int w = 0; w < g->words; w++) live[w] |= live_in[s * g->words + w];
+		for (int n = succ->first_node; n < succ->end_node; n++) {
+			Node *phi = &g->nodes[n];
+			if (phi->op != IR_PHI || !slotted(g, n)) continue;
+			for (int k = 0; k < succ->pred_count; k++) {
+				int value = input(g, phi, k);
+				if (g->preds[succ->first_pred + k] == b && slotted(g, value)) bits_set(live, value);
+			}
+		}
+	}
+}
+
+static int find(Graph *g, int n) {
+	while (g->parent[n] != n) n = g->parent[n] = g->parent[g->parent[n]];
+	return n;
+}
+
+// Give each value kept in a slot one, by liveness, sharing a phi's with its
+// inputs where they don't interfere. Parameters keep theirs.
+static bool allocate_slots(Graph *g) {
+	int count     = g->node_count;
+	g->words      = (count + 63) / 64;
+	int words     = g->words;
+	Bits *live_in = ALLOCATE(Bits, g->block_count * words);
+	Bits *live    = ALLOCATE(Bits, words);
+	g->interfere  = ALLOCATE(Bits, count * words);
+	g->members    = ALLOCATE(Bits, count * words);
+	g->parent     = ALLOCATE(int, count);
+	g->color      = ALLOCATE(int, count);
+	memset(live_in, 0, sizeof(Bits) * g->block_count * words);
+	memset(g->interfere, 0, sizeof(Bits) * count * words);
+	memset(g->members, 0, sizeof(Bits) * count * words);
+
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (int b = g->block_count - 1; b >= 0; b--) {
+			if (g->blocks[b].depth < 0) continue;
+			live_out(g, b, live_in, live);
+			scan_block(g, b, live, false);
+			if (memcmp(live, &live_in[b * words], sizeof(Bits) * words) != 0) {
+				memcpy(&live_in[b * words], live, sizeof(Bits) * words);
+				changed = true;
+			}
+		}
+	}
+	for (int b = 0; b < g->block_count; b++) {
+		if (g->blocks[b].depth < 0) continue;
+		live_out(g, b, live_in, live);
+		scan_block(g, b, live, true);
+	}
+
+	for (int n = 0; n < count; n++) {
+		g->parent[n] = n;
+		g->color[n]  = g->nodes[n].op == IR_PARAM ? (int)g->nodes[n].operand : -1;
+		bits_set(&g->members[n * words], n);
+	}
+	for (int n = 0; n < count; n++) {
+		Node *phi = &g->nodes[n];
+		if (phi->op != IR_PHI || !slotted(g, n)) continue;
+		for (int k = 0; k < phi->count; k++) {
+			int value = input(g, phi, k);
+			if (!slotted(g, value)) continue;
+			int a = find(g, n), c = find(g, value);
+			if (a == c || (g->color[a] >= 0 && g->color[c] >= 0)) continue;
+			bool clash = false;
+			for (int w = 0; w < words && !clash; w++) clash = (g->interfere[a * words + w] & g->members[c * words + w]) != 0;
+			if (clash) continue;
+			g->parent[c] = a;
+			if (g->color[a] < 0) g->color[a] = g->color[c];
+			for (int w = 0; w < words; w++) {
+				g->interfere[a * words + w] |= g->interfere[c * words + w];
+				g->members[a * words + w] |= g->members[c * words + w];
+			}
+		}
+	}
+
+	// Parameters come first, so their classes are colored before the rest.
+	bool ok   = true;
+	g->slots  = g->function->arity + 1;
+	int *slot = ALLOCATE(int, count);
+	for (int n = 0; n < count; n++) slot[n] = -1;
+	for (int n = 0; n < count && ok; n++) {
+		if (!slotted(g, n)) continue;
+		int root = find(g, n);
+		if (slot[root] < 0) {
+			int color = g->color[root];
+			if (color < 0) {
+				bool used[UINT8_COUNT] = {false};
+				Bits *row              = &g->interfere[root * words];
+				for (int other = 0; other < count; other++) {
+					if (bits_has(row, other) && slot[find(g, other)] >= 0) used[slot[find(g, other)]] = true;
+				}
+				color = 0;
+				while (color < UINT8_COUNT && used[color]) color++;
+			}
+			if (color >= UINT8_COUNT) ok = false;
+			slot[root] = color;
+		}
+		g->nodes[n].slot = slot[root];
+		if (slot[root] + 1 > g->slots) g->slots = slot[root] + 1;
+	}
+	FREE_ARRAY(int, slot, count);
+	FREE_ARRAY(Bits, live_in, g->block_count * words);
+	FREE_ARRAY(Bits, live, words);
+	return ok;
+}
+
+static void emit_byte(Graph *g, uint8_t byte, int line) {
+	write_chunk(&g->out, byte, line);
+}
+
+static int line_at(Graph *g, int offset) {
+	return chunk_line(g->chunk, offset);
+}
+
+static void emit_value(Graph *g, int value, int line);
+
+// Note that the code from `start` on came from an inlined call.
+static void add_inlined(Graph *g, int start, int site) {
+	Inlined *last = g->inlined_count > 0 ? &g->inlined[g->inlined_count - 1] : NULL;
+	if (last != NULL && last->end == start && last->callee == g->sites[site].callee && last->line == g->sites[site].line) {
+		last->end = g->out.count;
+		return;
+	}
+	if (g->inlined_capacity < g->inlined_count + 1) {
+		int old_capacity    = g->inlined_capacity;
+		g->inlined_capacity = GROW_CAPACITY(old_capacity);
+		g->inlined          = GROW_ARRAY(Inlined, g->inlined, old_capacity, g->inlined_capacity);
+	}
+	g->inlined[g->inlined_count++] = (Inlined){start, g->out.count, g->sites[site].line, g->sites[site].callee};
+}
+
+// The node's inputs, then its instruction.
+static void emit_node(Graph *g, int n) {
+	Node *node = &g->nodes[n];
+	int line   = line_at(g, node->offset);
+	for (int i = 0; i < node->count; i++) emit_value(g, g->inputs[node->first + i], line);
+	int start = g->out.count;
+	emit_byte(g, node->op, line);
+	switch (node->op) {
+		case OP_CONSTANT:
+		case OP_DEFINE_GLOBAL:
+		case OP_GET_GLOBAL:
+		case OP_SET_GLOBAL:
+		case OP_GET_UPVALUE:
+		case OP_SET_UPVALUE:
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+		case OP_GET_SUPER:
+		case OP_CALL:
+		case OP_BUILD_STRING:
+			emit_byte(g, node->operand, line);
+			break;
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+			emit_byte(g, node->operand, line);
+			emit_byte(g, node->args, line);
+			break;
+	}
+	if (g->site_at != NULL && g->site_at[node->offset] >= 0) add_inlined(g, start, g->site_at[node->offset]);
+}
+
+static void emit_value(Graph *g, int value, int line) {
+	value      = resolve(g, value);
+	Node *node = &g->nodes[value];
+	if (constant_op(node->op) || node->inlined) {
+		emit_node(g, value);
+	} else {
+		emit_byte(g, OP_GET_LOCAL, line);
+		emit_byte(g, node->slot, line);
+	}
+}
+
+static int emit_jump(Graph *g, uint8_t op, int line) {
+	emit_byte(g, op, line);
+	emit_byte(g, 0xff, line);
+	emit_byte(g, 0xff, line);
+	return g->out.count - 2;
+}
+
+static void patch_jump(Graph *g, int at, int target) {
+	int jump = target - (at + 2);
+	if (jump < 0 || jump > UINT16_MAX) g->failed = true;
+	g->out.code[at]     = (jump >> 8) & 0xff;
+	g->out.code[at + 1] = jump & 0xff;
+}
+
+// A jump to block `to`, filled in once the block is placed.
+static void add_patch(Graph *g, int at, int to) {
+	if (g->patch_capacity < g->patch_count + 1) {
+		int old_capacity  = g->patch_capacity;
+		g->patch_capacity = GROW_CAPACITY(old_capacity);
+		g->patches        = GROW_ARRAY(Patch, g->patches, old_capacity, g->patch_capacity);
+	}
+	g->patches[g->patch_count++] = (Patch){at, to};
+}
+
+// Go on at block `to`, falling through when it's `next`.
+static void emit_goto(Graph *g, int to, bool next, int line) {
+	Block *target = &g->blocks[to];
+	if (target->label >= 0) {
+		emit_byte(g, OP_LOOP, line);
+		int jump = g->out.count + 2 - target->label;
+		if (jump > UINT16_MAX) g->failed = true;
+		emit_byte(g, (jump >> 8) & 0xff, line);
+		emit_byte(g, jump & 0xff, line);
+	} else if (!next) {
+		add_patch(g, emit_jump(g, OP_JUMP, line), to);
+	}
+}
+
+// Hand block `to`'s phis their values from block `from`, all at once through
+// the stack so that it doesn't matter which slots they share.
+static void copy_edge(Graph *g, int from, int to, int line) {
+	Block *succ = &g->blocks[to];
+	int *copied = ALLOCATE(int, succ->depth + 1);
+	int count   = 0;
+	for (int n = succ->first_node; n < succ->end_node; n++) {
+		Node *phi = &g->nodes[n];
+		if (phi->op != IR_PHI || !slotted(g, n)) continue;
+		int k = 0;
+		while (g->preds[succ->first_pred + k] != from) k++;
+		int value = input(g, phi, k);
+		if (slotted(g, value) && g->nodes[value].slot == phi->slot) continue;
+		emit_value(g, value, line);
+		copied[count++] = phi->slot;
+	}
+	while (count > 0) {
+		emit_byte(g, OP_SET_LOCAL, line);
+		emit_byte(g, copied[--count], line);
+		emit_byte(g, OP_POP, line);
+	}
+	FREE_ARRAY(int, copied, succ->depth + 1);
+}
+
+// Check that the callee is still the one inlined, and leave if it isn't.
+static void emit_check(Graph *g, int n) {
+	Node *node = &g->nodes[n];
+	Site *site = &g->sites[node->operand];
+	int line   = site->line;
+	emit_value(g, g->inputs[node->first + site->base], line);
+	emit_byte(g, OP_CONSTANT, line);
+	emit_byte(g, site->target, line);
+	emit_byte(g, OP_EQUAL, line);
+	if (g->exit_capacity < g->exit_count + 1) {
+		int old_capacity = g->exit_capacity;
+		g->exit_capacity = GROW_CAPACITY(old_capacity);
+		g->exits         = GROW_ARRAY(Exit, g->exits, old_capacity, g->exit_capacity);
+	}
+	g->exits[g->exit_count++] = (Exit){n, emit_jump(g, OP_JUMP_IF_FALSE, line), -1};
+	emit_byte(g, OP_POP, line);
+}
+
+static void emit_root(Graph *g, int n) {
+	Node *node = &g->nodes[n];
+	int line   = line_at(g, node->offset);
+	if (node->op == IR_CHECK) {
+		emit_check(g, n);
+		return;
+	}
+	emit_node(g, n);
+	if (has_result(node->op) && slotted(g, n)) {
+		emit_byte(g, OP_SET_LOCAL, line);
+		emit_byte(g, node->slot, line);
+	}
+	if (has_result(node->op) || store_op(node->op)) emit_byte(g, OP_POP, line);
+}
+
+// Check the parameters speculated on, and make room for the slots.
+static void emit_entry(Graph *g) {
+	int line   = line_at(g, 0);
+	int arity  = g->function->arity;
+	g->deopts  = ALLOCATE(int, arity + 1);
+	for (int slot = 1; slot <= arity; slot++) {
+		Node *param = &g->nodes[slot];
+		if (!param->number || !slotted(g, slot)) continue;
+		emit_byte(g, OP_IS_NUMBER, line);
+		emit_byte(g, slot, line);
+		g->deopts[g->deopt_count++] = emit_jump(g, OP_JUMP_IF_FALSE, line);
+		emit_byte(g, OP_POP, line);
+	}
+	for (int slot = arity + 1; slot < g->slots; slot++) emit_byte(g, OP_NIL, line);
+}
+
+static void emit_block(Graph *g, int b, int next) {
+	Block *block = &g->blocks[b];
+	int line     = line_at(g, block->last);
+	block->label = g->out.count;
+	if (block->pop_first) emit_byte(g, OP_POP, line_at(g, block->start));
+	if (b == 0) emit_entry(g);
+	for (int i = 0; i < block->root_count; i++) emit_root(g, g->roots[block->first_root + i]);
+
+	switch (block->exit) {
+		case OP_RETURN:
+			emit_value(g, block->value, line);
+			emit_byte(g, OP_RETURN, line);
+			break;
+		case OP_JUMP_IF_FALSE:
+		case OP_JUMP_IF_TRUE: {
+			int fall   = block->succ[0];
+			int taken  = block->succ[1];
+			bool direct = g->blocks[taken].pop_first;
+			emit_value(g, block->value, line);
+			int branch = emit_jump(g, block->exit, line);
+			if (direct) add_patch(g, branch, taken);
+			emit_byte(g, OP_POP, line);
+			copy_edge(g, b, fall, line);
+			emit_goto(g, fall, direct && fall == next, line);
+			if (!direct) {
+				patch_jump(g, branch, g->out.count);
+				emit_byte(g, OP_POP, line);
+				copy_edge(g, b, taken, line);
+				emit_goto(g, taken, taken == next, line);
+			}
+			break;
+		}
+		default: {
+			int to = block->exit == OP_JUMP || block->exit == OP_LOOP ? block->succ[1] : block->succ[0];
+			copy_edge(g, b, to, line);
+			emit_goto(g, to, to == next, line);
+			break;
+		}
+	}
+}
+
+static void emit_local(Graph *g, uint8_t op, int slot, int line) {
+	if (slot >= UINT8_COUNT) g->failed = true;
+	emit_byte(g, op, line);
+	emit_byte(g, slot, line);
+}
+
+// Make the instance `n` kept as its fields, with those it has at `check`,
+// on top of the stack, which is slot `slot`.
+static void make_object(Graph *g, int n, int check, int slot, int line) {
+	Object *object = g->objects;
+	while (object->node != n) object++;
+	emit_byte(g, OP_CONSTANT, line);
+	emit_byte(g, object->klass, line);
+	emit_byte(g, OP_NEW, line);
+	for (int f = 0; f < object->count; f++) {
+		int store = field_value(g, n, object->fields[f], g->nodes[check].block, check);
+		if (store < 0) continue;
+		emit_local(g, OP_GET_LOCAL, slot, line);
+		emit_value(g, g->inputs[g->nodes[store].first + 1], line);
+		emit_byte(g, OP_SET_PROPERTY, line);
+		emit_byte(g, object->names[f], line);
+		emit_byte(g, OP_POP, line);
+	}
+}
+
+// Where a failed check leaves: the stack made what the original code has at
+// the call, all at once through the top as in copy_edge(), then a jump there.
+static void emit_exit(Graph *g, Exit *exit) {
+	Node *check = &g->nodes[exit->check];
+	int line    = g->sites[check->operand].line;
+	int depth   = check->args;
+	patch_jump(g, exit->at, g->out.count);
+	emit_byte(g, OP_POP, line);
+	int height = g->slots;
+	for (; height < depth; height++) emit_byte(g, OP_NIL, line);
+	for (int i = 0; i < depth; i++) {
+		int value = input(g, check, i);
+		int first = 0;
+		while (input(g, check, first) != value) first++;
+		if (!g->nodes[value].scalar) {
+			emit_value(g, value, line);
+		} else if (first < i) {
+			emit_local(g, OP_GET_LOCAL, height + first, line);
+		} else {
+			make_object(g, value, exit->check, height + i, line);
+		}
+	}
+	for (int i = depth - 1; i >= 0; i--) {
+		emit_local(g, OP_SET_LOCAL, i, line);
+		emit_byte(g, OP_POP, line);
+	}
+	for (; height > depth; height--) emit_byte(g, OP_POP, line);
+	exit->leave = emit_jump(g, OP_JUMP, line);
+}
+
+// The optimized code, where failed checks leave, a stub that drops a failed
+// check on entry, and the original.
+static bool emit_function(Graph *g) {
+	init_chunk(&g->out);
+	for (int b = 1; b < g->block_count; b++) {
+		Block *block = &g->blocks[b];
+		if (block->depth < 0 || block->pred_count != 1) continue;
+		Block *pred      = &g->blocks[g->preds[block->first_pred]];
+		block->pop_first = (pred->exit == OP_JUMP_IF_FALSE || pred->exit == OP_JUMP_IF_TRUE) && pred->succ[1] == b &&
+		                   pred->succ[0] != b;
+	}
+	for (int b = 0; b < g->block_count && !g->failed; b++) {
+		if (g->blocks[b].depth < 0) continue;
+		int next = b + 1;
+		while (next < g->block_count && g->blocks[next].depth < 0) next++;
+		emit_block(g, b, next);
+	}
+	for (int i = 0; i < g->patch_count; i++) {
+		patch_jump(g, g->patches[i].at, g->blocks[g->patches[i].block].label);
+	}
+	for (int i = 0; i < g->exit_count; i++) emit_exit(g, &g->exits[i]);
+	int line = line_at(g, 0);
+	if (g->deopt_count > 0) {
+		for (int i = 0; i < g->deopt_count; i++) patch_jump(g, g->deopts[i], g->out.count);
+		emit_byte(g, OP_POP, line);
+	}
+	g->original = g->out.count;
+	for (int offset = 0; offset < g->source->count; offset++) {
+		emit_byte(g, g->source->code[offset], chunk_line(g->source, offset));
+	}
+	for (int i = 0; i < g->exit_count; i++) {
+		patch_jump(g, g->exits[i].leave, g->original + g->sites[g->nodes[g->exits[i].check].operand].call);
+	}
+	return !g->failed;
+}
+
+// Swap the new chunk in. Frames already in the function go on in the copy of
+// the code they were running.
+static void install(Graph *g, int max_stack) {
+	ObjFunction *function = g->function;
+	Chunk old             = function->chunk;
+	finish_lines(&g->out.lines);
+	g->out.constants    = old.constants;
+	function->chunk     = g->out;
+	function->max_stack = max_stack;
+	function->original  = g->original;
+	write_barrier((Obj *)function);  // inlining adds constants
+	init_value_array(&old.constants);
+	init_chunk(&g->out);
+	for (int i = 0; i < g_vm.frame_count; i++) {
+		CallFrame *frame = &g_vm.frames[i];
+		if (frame->closure->function != function) continue;
+		frame->ip = function->chunk.code + g->original + (frame->ip - old.code);
+	}
+	free_chunk(&old);
+	free_traces(function->traces);
+	function->traces = NULL;
+	FREE_ARRAY(Inlined, function->inlined, function->inlined_count);
+	function->inlined       = GROW_ARRAY(Inlined, g->inlined, g->inlined_capacity, g->inlined_count);
+	function->inlined_count = g->inlined_count;
+	g->inlined              = NULL;
+	g->inlined_capacity     = 0;
+}
+
+static void free_graph(Graph *g) {
+	int count = g->code_count;
+	if (g->depths != NULL) FREE_ARRAY(int, g->depths, count);
+	if (g->block_at != NULL) FREE_ARRAY(int, g->block_at, count + 1);
+	if (g->blocks != NULL) FREE_ARRAY(Block, g->blocks, g->block_count);
+	if (g->preds != NULL) FREE_ARRAY(int, g->preds, 2 * g->block_count);
+	FREE_ARRAY(Node, g->nodes, g->node_capacity);
+	FREE_ARRAY(int, g->inputs, g->input_capacity);
+	FREE_ARRAY(bool, g->direct, g->input_capacity);
+	FREE_ARRAY(int, g->states, g->state_capacity);
+	FREE_ARRAY(int, g->stack, g->capacity);
+	FREE_ARRAY(bool, g->fresh, g->capacity);
+	if (g->roots != NULL) FREE_ARRAY(int, g->roots, g->node_count);
+	if (g->interfere != NULL) {
+		FREE_ARRAY(Bits, g->interfere, g->node_count * g->words);
+		FREE_ARRAY(Bits, g->members, g->node_count * g->words);
+		FREE_ARRAY(int, g->parent, g->node_count);
+		FREE_ARRAY(int, g->color, g->node_count);
+	}
+	FREE_ARRAY(Patch, g->patches, g->patch_capacity);
+	FREE_ARRAY(Inlined, g->inlined, g->inlined_capacity);
+	FREE_ARRAY(Exit, g->exits, g->exit_capacity);
+	FREE_ARRAY(Object, g->objects, g->object_capacity);
+	FREE_ARRAY(int, g->site_at, g->site_capacity);
+	if (g->sites != NULL) FREE_ARRAY(Site, g->sites, g->site_count);
+	// The spliced code shares the function's constants.
+	init_value_array(&g->spliced.constants);
+	free_chunk(&g->spliced);
+	if (g->deopts != NULL) FREE_ARRAY(int, g->deopts, g->function->arity + 1);
+	free_chunk(&g->out);
+}
+
+// Optimize a hot function in place. False when it's left as it was: it's a
+// script, too big, or does something the tier doesn't lift.
+bool optimize_function(ObjFunction *function) {
+	Chunk *chunk = &function->chunk;
+	if (function->name == NULL || function->aot != NULL || chunk->count == 0 || chunk->count > SSA_MAX_CODE) {
+		return false;
+	}
+	Graph g;
+	memset(&g, 0, sizeof(g));
+	g.function = function;
+	g.chunk    = chunk;
+	g.source   = chunk;
+	init_chunk(&g.spliced);
+	init_chunk(&g.out);
+	bool ok = build(&g);
+	if (ok) {
+		replace_scalars(&g);
+		infer_numbers(&g);
+		forward_loads(&g);
+		number_values(&g);
+		hoist(&g);
+		sweep(&g);
+		count_uses(&g);
+		choose_inlined(&g);
+		ok = allocate_slots(&g) && emit_function(&g);
+	}
+	int max_stack = 0;
+	if (ok) {
+		int error;
+		max_stack = max_stack_depth(&g.out, function->arity + 1, &error);
+		if (error >= 0 && g_debug.verify_stack) {
+			fprintf(stderr, "Stack check failed in optimized %s at %04d.\n", function->name->chars, error);
+		}
+		ok = error < 0;
+		// The copy of the original code may only be reached by frames already
+		// running it, which the walk from the start doesn't see.
+		if (function->max_stack > max_stack) max_stack = function->max_stack;
+	}
+	if (ok) {
+		install(&g, max_stack);
+		if (g_debug.print_code) disassemble_chunk(&function->chunk, function->name->chars);
+	}
+	free_graph(&g);
+	return ok;
+}
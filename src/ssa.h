@@ -0,0 +1,15 @@
+#ifndef clox_ssa_h
+#define clox_ssa_h
+
+#include "object.h"
+
+// Functions with more bytecode than this, or more values in SSA form, are
+// left as they are.
+#define SSA_MAX_CODE  4096
+#define SSA_MAX_NODES 2048
+// Callees with more bytecode than this aren't inlined.
+#define SSA_MAX_INLINE 64
+
+bool optimize_function(ObjFunction *function);
+
+#endif
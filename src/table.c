@@ -131,15 +131,6 @@ ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t
 	}
 }
 
-void table_rm_white(Table *table) {
-	for (int i = 0; i < table->capacity; i++) {
-		Entry *entry = &table->entries[i];
-		if (entry->key != NULL && !is_marked(&entry->key->obj)) {
-			tableDel(table, entry->key);
-		}
-	}
-}
-
 void mark_table(Table *table) {
 	for (int i = 0; i < table->capacity; i++) {
 		Entry *entry = &table->entries[i];
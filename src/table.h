@@ -22,7 +22,6 @@ bool tableSet(Table *table, ObjString *key, Value value);
 bool tableDel(Table *table, ObjString *key);
 void tableAddAll(Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
-void table_rm_white(Table *table);
 void mark_table(Table *table);
 
 #endif
@@ -60,6 +60,15 @@ void print_value(Value value) {
 #endif
 }
 
+// Writes what print_value() would print into `buffer`, truncated to `size`
+// bytes as snprintf() does, and returns its full length.
+int format_value(Value value, char *buffer, size_t size) {
+	if (IS_OBJ(value)) return formatObject(value, buffer, size);
+	if (IS_NUMBER(value)) return snprintf(buffer, size, "%g", AS_NUMBER(value));
+	if (IS_BOOL(value)) return snprintf(buffer, size, AS_BOOL(value) ? "true" : "false");
+	return snprintf(buffer, size, "nil");
+}
+
 bool values_equal(Value a, Value b) {
 #ifdef NAN_BOXING
 	if (IS_NUMBER(a) && IS_NUMBER(b)) {
@@ -84,41 +93,126 @@ bool values_equal(Value a, Value b) {
 }
 
 void initLines(Lignes *lines) {
-	lines->capacity = 0;
-	lines->count    = -1;
-	lines->runs     = NULL;
+	lines->capacity     = 0;
+	lines->count        = -1;
+	lines->runs         = NULL;
+	lines->packed       = NULL;
+	lines->samples      = NULL;
+	lines->packed_size  = 0;
+	lines->sample_count = 0;
+	lines->mapped       = false;
+	lines->stripped     = NULL;
+	lines->function     = 0;
 }
 
 void writeLines(Lignes *lines, int line) {
+	if (lines->count >= 0 && line == lines->runs[lines->count].lineNumber) {
+		lines->runs[lines->count].runLength += 1;
+		return;
+	}
+	// Only a new run needs room.
 	if (lines->capacity <= lines->count + 1) {
 		int old_capacity = lines->capacity;
 		lines->capacity  = GROW_CAPACITY(old_capacity);
 		lines->runs      = GROW_ARRAY(Run, lines->runs, old_capacity, lines->capacity);
 	}
-
-	if (lines->count == -1) {
-		lines->count              = 0;
-		lines->runs[0].lineNumber = line;
-		lines->runs[0].runLength  = 1;
-	} else if (line == lines->runs[lines->count].lineNumber) {
-		lines->runs[lines->count].runLength += 1;
-	} else {
-		lines->count++;
-		lines->runs[lines->count].lineNumber = line;
-		lines->runs[lines->count].runLength  = 1;
-	}
+	lines->count++;
+	lines->runs[lines->count].lineNumber = line;
+	lines->runs[lines->count].runLength  = 1;
 }
 
 void freeLines(Lignes *lines) {
 	FREE_ARRAY(Run, lines->runs, lines->capacity);
+	if (!lines->mapped) {
+		FREE_ARRAY(uint8_t, (uint8_t *)lines->packed, lines->packed_size);
+		FREE_ARRAY(LineSample, (LineSample *)lines->samples, lines->sample_count);
+	}
 	initLines(lines);
 }
 
-int getLineByNumber(Lignes *lines, int num) {
-	int idx = 0;
-	while (num - lines->runs[idx].runLength >= 0 && idx <= lines->count) {
-		num -= lines->runs[idx].runLength;
-		idx++;
+static int put_varint(uint8_t *out, uint32_t value) {
+	int size = 0;
+	while (value >= 0x80) {
+		out[size++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	out[size++] = (uint8_t)value;
+	return size;
+}
+
+// False when the bytes run out first, as they may in a damaged image.
+static bool get_varint(const uint8_t *packed, int size, int *position, uint32_t *value) {
+	*value = 0;
+	for (int shift = 0; shift < 35 && *position < size; shift += 7) {
+		uint8_t byte = packed[(*position)++];
+		*value |= (uint32_t)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) return true;
+	}
+	return false;
+}
+
+// Pack the runs once the chunk's code is final. The runs are freed.
+void finish_lines(Lignes *lines) {
+	int runs = lines->count + 1;
+	if (runs == 0 || lines->packed != NULL) return;
+	// Two varints of at most five bytes each per run.
+	uint8_t *packed     = ALLOCATE(uint8_t, runs * 10);
+	int sample_count    = (runs + LINE_SAMPLE - 1) / LINE_SAMPLE;
+	LineSample *samples = ALLOCATE(LineSample, sample_count);
+	int size            = 0;
+	int offset          = 0;
+	int previous        = 0;
+	for (int i = 0; i < runs; i++) {
+		Run *run = &lines->runs[i];
+		if (i % LINE_SAMPLE == 0) samples[i / LINE_SAMPLE] = (LineSample){offset, run->lineNumber, size, 0};
+		int32_t delta = run->lineNumber - previous;
+		size += put_varint(packed + size, (uint32_t)run->runLength);
+		size += put_varint(packed + size, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+		offset += run->runLength;
+		previous = run->lineNumber;
+	}
+	packed = GROW_ARRAY(uint8_t, packed, runs * 10, size);
+	FREE_ARRAY(Run, lines->runs, lines->capacity);
+	lines->capacity     = 0;
+	lines->count        = -1;
+	lines->runs         = NULL;
+	lines->packed       = packed;
+	lines->samples      = samples;
+	lines->packed_size  = size;
+	lines->sample_count = sample_count;
+}
+
+// The line of the instruction at `offset`, or -1 when there is none.
+int getLineByNumber(Lignes *lines, int offset) {
+	if (lines->packed == NULL) {
+		for (int i = 0; i <= lines->count; i++) {
+			if (offset < lines->runs[i].runLength) return lines->runs[i].lineNumber;
+			offset -= lines->runs[i].runLength;
+		}
+		return -1;
+	}
+	int low = 0, high = lines->sample_count - 1;
+	if (high < 0 || offset < lines->samples[0].offset) return -1;
+	while (low < high) {
+		int middle = (low + high + 1) / 2;
+		if (lines->samples[middle].offset <= offset) {
+			low = middle;
+		} else {
+			high = middle - 1;
+		}
+	}
+	const LineSample *sample = &lines->samples[low];
+	int start                = sample->offset;
+	int line                 = sample->line;
+	int position             = sample->position;
+	for (int i = 0; i < LINE_SAMPLE; i++) {
+		uint32_t length, delta;
+		if (!get_varint(lines->packed, lines->packed_size, &position, &length)) return -1;
+		if (!get_varint(lines->packed, lines->packed_size, &position, &delta)) return -1;
+		// The sample already holds the first run's line.
+		if (i > 0) line += (int32_t)((delta >> 1) ^ -(delta & 1));
+		if (offset - start < (int64_t)length) return line;
+		start += (int)length;
 	}
-	return lines->count - idx >= 0 ? lines->runs[idx].lineNumber : -1;
+	return -1;
 }
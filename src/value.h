@@ -78,10 +78,35 @@ typedef struct {
 	int runLength;
 } Run;
 
+// A finished line table keeps every LINE_SAMPLE-th run's start, so a lookup
+// binary searches the samples and then decodes at most that many runs.
+#define LINE_SAMPLE 16
+
+typedef struct {
+	int32_t offset;    // first instruction of the run
+	int32_t line;      // of the run
+	int32_t position;  // of the run in the packed bytes
+	int32_t padding;
+} LineSample;
+
+struct MappedImage;
+
+// Lines are kept as runs while the chunk is written. finish_lines() packs each
+// run into a varint of its length and a zigzag varint of its line minus the
+// previous run's, which is a byte or two for most runs.
 typedef struct {
 	int capacity;
-	int count;
+	int count;  // of the last run, -1 for none
 	Run *runs;
+	const uint8_t *packed;
+	const LineSample *samples;
+	int packed_size;
+	int sample_count;
+	bool mapped;  // packed and samples point into a bytecode image
+	// Set when the image was written without line information, which is then
+	// loaded from its side file the first time it is asked for.
+	struct MappedImage *stripped;
+	int function;
 } Lignes;
 
 
@@ -96,10 +121,12 @@ void init_value_array(ValueArray *array);
 void write_value_array(ValueArray *array, Value value);
 void free_value_array(ValueArray *array);
 void print_value(Value value);
+int format_value(Value value, char *buffer, size_t size);
 
 void initLines(Lignes *lines);
 void writeLines(Lignes *lines, int line);
 void freeLines(Lignes *lines);
+void finish_lines(Lignes *lines);
 int getLineByNumber(Lignes *lines, int num);
 
 #endif
@@ -8,26 +8,104 @@
 #include <string.h>
 #include <time.h>
 
+#include "aot.h"
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
+#include "module.h"
 #include "object.h"
+#include "ssa.h"
 #include "table.h"
 #include "value.h"
 
 VM g_vm;
-bool foundConstantLong = false;
 
 static Value clock_native(int arg_count, Value *args) {
 	return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+static double monotonic_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Hand out the next slice of fuel, taken from the budget up front so that the
+// budget stays exact without counting every tick.
+static void refuel() {
+	if (g_vm.budget < 0) {
+		g_vm.fuel = SAFEPOINT_INTERVAL;
+		return;
+	}
+	g_vm.fuel = g_vm.budget < SAFEPOINT_INTERVAL ? (int)g_vm.budget : SAFEPOINT_INTERVAL;
+	g_vm.budget -= g_vm.fuel;
+}
+
+void set_budget(int64_t ticks) {
+	g_vm.budget = ticks;
+	refuel();
+}
+
+void set_deadline(double seconds) {
+	g_vm.deadline = seconds > 0 ? monotonic_now() + seconds : 0;
+}
+
+// Polled only once the current slice is used up, returns true when the run has
+// to be suspended.
+static bool safepoint() {
+	if (g_vm.budget == 0) return true;
+	if (g_vm.deadline > 0 && monotonic_now() >= g_vm.deadline) return true;
+	refuel();
+	return false;
+}
+
+// A global the script declares const is, from its definition on, one for
+// every script the VM runs. The compiler checks g_vm.consts, and the name's
+// bit stops code compiled before, or elsewhere, from assigning it.
+static void declare_const(ObjFunction *script, ObjString *name) {
+	Value value;
+	if (!tableGet(&script->consts, name, &value)) return;
+	tableSet(&g_vm.consts, name, value);
+	set_is_const((Obj *)name, true);
+}
+
 static void resetStack() {
 	g_vm.stackCount    = 0;
 	g_vm.frame_count   = 0;
 	g_vm.open_upvalues = NULL;
+	g_vm.batch_count   = 0;
+	g_vm.batch_next    = 0;
+}
+
+static void print_frame(int line, ObjFunction *function) {
+	if (line < 0) {
+		fprintf(stderr, "[line ?] in ");
+	} else {
+		fprintf(stderr, "[line %d] in ", line);
+	}
+	if (function->name == NULL) {
+		fprintf(stderr, "script\n");
+	} else {
+		fprintf(stderr, "%s()\n", function->name->chars);
+	}
+}
+
+// The inlined code `instruction` is part of, if it's any.
+static Inlined *inlined_at(ObjFunction *function, int instruction) {
+	int low = 0, high = function->inlined_count;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (function->inlined[mid].end <= instruction) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low < function->inlined_count && function->inlined[low].start <= instruction) return &function->inlined[low];
+	return NULL;
 }
 
 static void runtimeError(const char *format, ...) {
@@ -40,12 +118,14 @@ static void runtimeError(const char *format, ...) {
 		CallFrame *frame      = &g_vm.frames[i];
 		ObjFunction *function = frame->closure->function;
 		size_t instruction    = frame->ip - function->chunk.code - 1;
-		fprintf(stderr, "[line %d] in ", getLineByNumber(&function->chunk.lines, instruction));
-		if (function->name == NULL) {
-			fprintf(stderr, "script\n");
-		} else {
-			fprintf(stderr, "%s()\n", function->name->chars);
+		int line              = chunk_line(&function->chunk, (int)instruction);
+		// A call the optimizing tier inlined still shows as a frame of its own.
+		Inlined *inlined = inlined_at(function, (int)instruction);
+		if (inlined != NULL) {
+			print_frame(line, inlined->callee);
+			line = inlined->line;
 		}
+		print_frame(line, function);
 	}
 	resetStack();
 }
@@ -59,38 +139,75 @@ static void define_native(const char *name, NativeFn function) {
 }
 
 void initVm() {
-	g_vm.stack           = NULL;
-	g_vm.stackCapacity   = 0;
-	g_vm.objects         = NULL;
-	g_vm.bytes_allocated = 0;
-	g_vm.next_gc         = 1024 * 1024;
-	g_vm.gray_count      = 0;
-	g_vm.gray_capacity   = 0;
-	g_vm.gray_stack      = NULL;
+	init_debug_flags();
+	g_vm.stack               = NULL;
+	g_vm.stackCapacity       = 0;
+	g_vm.objects             = NULL;
+	g_vm.young               = NULL;
+	g_vm.young_bytes         = 0;
+	g_vm.nursery_size        = NURSERY_SIZE;
+	g_vm.young_limit         = g_debug.log_gc ? 0 : NURSERY_SIZE;
+	g_vm.gc_phase            = GC_IDLE;
+	g_vm.sweeping            = NULL;
+	g_vm.remembered_count    = 0;
+	g_vm.remembered_capacity = 0;
+	g_vm.remembered          = NULL;
+	g_vm.bytes_allocated     = 0;
+	g_vm.next_gc             = g_debug.stress_gc ? 0 : 1024 * 1024;
+	g_vm.gray_count          = 0;
+	g_vm.gray_capacity       = 0;
+	g_vm.gray_stack          = NULL;
+	g_vm.deadline            = 0;
+	set_budget(-1);
 	initTable(&g_vm.globals);
 	initTable(&g_vm.strings);
+	initTable(&g_vm.modules);
+	initTable(&g_vm.consts);
 	g_vm.init_string = NULL;
-	g_vm.init_string = copyString("init", 4);
+	resetStack();
+	g_vm.stackCapacity = GROW_CAPACITY(0);
+	g_vm.stack         = GROW_ARRAY(Value, NULL, 0, g_vm.stackCapacity);
+	g_vm.init_string   = copyString("init", 4);
 	define_native("clock", clock_native);
 	resetStack();
 }
 
 void freeVm() {
+	if (g_debug.gc_stats) print_gc_stats();
 	FREE_ARRAY(Value, g_vm.stack, g_vm.stackCapacity);
 	freeTable(&g_vm.globals);
 	freeTable(&g_vm.strings);
+	freeTable(&g_vm.modules);
+	freeTable(&g_vm.consts);
 	g_vm.init_string = NULL;
 	freeObjects();
+	unmap_images();
 }
 
-void push(Value value) {
-	if (g_vm.stackCount + 1 > g_vm.stackCapacity) {
-		int oldCapacity    = g_vm.stackCapacity;
-		g_vm.stackCapacity = GROW_CAPACITY(oldCapacity);
-		g_vm.stack         = GROW_ARRAY(Value, g_vm.stack, oldCapacity, g_vm.stackCapacity);
+// Open upvalues point into the stack, so they move along with it.
+static void grow_stack(int capacity) {
+	int oldCapacity = g_vm.stackCapacity;
+	Value *oldStack = g_vm.stack;
+	while (g_vm.stackCapacity < capacity) {
+		g_vm.stackCapacity = GROW_CAPACITY(g_vm.stackCapacity);
 	}
+	g_vm.stack = GROW_ARRAY(Value, g_vm.stack, oldCapacity, g_vm.stackCapacity);
+	for (ObjUpValue *upvalue = g_vm.open_upvalues; upvalue != NULL; upvalue = upvalue->next) {
+		upvalue->location = g_vm.stack + (upvalue->location - oldStack);
+	}
+}
+
+// The stack always keeps a free slot, so the value is already rooted if growing
+// the stack triggers a collection.
+void push(Value value) {
 	g_vm.stack[g_vm.stackCount] = value;
 	g_vm.stackCount++;
+	if (g_vm.stackCount == g_vm.stackCapacity) grow_stack(g_vm.stackCapacity + 1);
+}
+
+// For the interpreter loop, whose frames had call() reserve their stack.
+static inline void push_unchecked(Value value) {
+	g_vm.stack[g_vm.stackCount++] = value;
 }
 
 Value pop() {
@@ -101,17 +218,31 @@ static Value peek(int distance) {
 	return g_vm.stack[g_vm.stackCount - 1 - distance];
 }
 
-static void push_slots(CallFrame *frame, int var_offset) {
-	if (frame->slots_count + 1 > frame->slots_capacity) {
-		int old_capacity      = frame->slots_capacity;
-		frame->slots_capacity = GROW_CAPACITY(old_capacity);
-		frame->slots          = GROW_ARRAY(int, frame->slots, old_capacity, frame->slots_capacity);
+// Count a call or backward branch; once the function is hot, optimize it and
+// translate it to machine code. The optimizer replaces the chunk, so it waits
+// while a trace is recorded, and the frame's ip must be saved around this.
+static inline void warm_up(ObjFunction *function) {
+	if (function->hotness >= 0 && ++function->hotness >= JIT_THRESHOLD) {
+		if (!g_debug.no_opt && recording()) return;
+		function->hotness = -1;
+		if (!g_debug.no_opt) optimize_function(function);
+		if (!g_debug.no_jit) jit_compile(function);
+	}
+}
+
+// Note which arguments weren't numbers, for the optimizer to speculate on the rest.
+static inline void profile_arguments(ObjFunction *function, Value *args, int arg_count) {
+	for (int i = 0; i < arg_count && i < 32; i++) {
+		if (!IS_NUMBER(args[i])) function->number_args &= ~(1u << i);
 	}
-	frame->slots[frame->slots_count] = var_offset;
-	frame->slots_count++;
 }
 
 static bool call(ObjClosure *closure, int arg_count) {
+	ObjFunction *function = closure->function;
+	if (function->source != NULL && !compile_body(function)) {
+		runtimeError("Could not compile body of %s().", function->name->chars);
+		return false;
+	}
 	if (arg_count != closure->function->arity) {
 		runtimeError("Expect %d arguments but got %d.", closure->function->arity, arg_count);
 		return false;
@@ -120,16 +251,48 @@ static bool call(ObjClosure *closure, int arg_count) {
 		runtimeError("Stack overflow on call_frames.");
 		return false;
 	}
-	CallFrame *frame      = &g_vm.frames[g_vm.frame_count++];
-	frame->closure        = closure;
-	frame->ip             = closure->function->chunk.code;
-	frame->slots          = NULL;
-	frame->slots_capacity = 0;
-	frame->slots_count    = 0;
-	push_slots(frame, g_vm.stackCount - arg_count);
+	// Warmed up first, so the call runs whatever code that leaves.
+	int base = g_vm.stackCount - arg_count - 1;
+	if (function->hotness >= 0) profile_arguments(function, &g_vm.stack[base + 1], arg_count);
+	warm_up(function);
+	// Room for everything the body pushes, plus the free slot push() keeps.
+	if (base + function->max_stack >= g_vm.stackCapacity) grow_stack(base + function->max_stack + 1);
+	CallFrame *frame = &g_vm.frames[g_vm.frame_count++];
+	frame->closure   = closure;
+	frame->ip        = function->chunk.code;
+	frame->base      = base;
 	return true;
 }
 
+// Start running the module at `path` in a new frame. A module is loaded once
+// per VM; importing it again just pushes nil, which is what its script returns.
+static bool import_module(ObjString *path) {
+	Value loaded;
+	if (tableGet(&g_vm.modules, path, &loaded)) {
+		push(NIL_VAL);
+		return true;
+	}
+	Source source;
+	if (!open_source(path->chars, &source)) {
+		runtimeError("Could not open module \"%s\".", path->chars);
+		return false;
+	}
+	ObjFunction *function = compile_cached(path->chars, source.chars, source.length);
+	close_source(&source);
+	if (function == NULL) {
+		runtimeError("Could not compile module \"%s\".", path->chars);
+		return false;
+	}
+	push(OBJ_VAL(function));
+	// Recorded once it compiles, so that a broken module is tried again on the
+	// next import, and before it runs, so that import cycles end.
+	tableSet(&g_vm.modules, path, BOOL_VAL(true));
+	ObjClosure *closure = new_closure(function);
+	pop();
+	push(OBJ_VAL(closure));
+	return call(closure, 0);
+}
+
 static bool call_value(Value callee, int arg_count) {
 	if (IS_OBJ(callee)) {
 		switch (OBJ_TYPE(callee)) {
@@ -230,6 +393,7 @@ static void close_upvalues(Value *last) {
 		upvalue->closed     = *upvalue->location;
 		upvalue->location   = &upvalue->closed;
 		g_vm.open_upvalues  = upvalue->next;
+		write_barrier((Obj *)upvalue);
 	}
 }
 
@@ -237,6 +401,7 @@ static void define_method(ObjString *name) {
 	Value method    = peek(0);
 	ObjClass *klass = AS_CLASS(peek(1));
 	tableSet(&klass->methods, name, method);
+	write_barrier((Obj *)klass);
 	pop();
 }
 
@@ -260,6 +425,32 @@ static void concatenate() {
 	push(OBJ_VAL(result));
 }
 
+// Joins the top `count` values into one string, sized up front so each part
+// is copied once and only the result is interned.
+static void build_string(int count) {
+	size_t length = 0;
+	for (int i = count - 1; i >= 0; i--) {
+		Value part = peek(i);
+		length += IS_STRING(part) ? AS_STRING(part)->length : format_value(part, NULL, 0);
+	}
+	char *chars = ALLOCATE(char, length + 1);
+	char *end   = chars;
+	for (int i = count - 1; i >= 0; i--) {
+		Value part = peek(i);
+		if (IS_STRING(part)) {
+			memcpy(end, AS_STRING(part)->chars, AS_STRING(part)->length);
+			end += AS_STRING(part)->length;
+		} else {
+			end += format_value(part, end, chars + length + 1 - end);
+		}
+	}
+	*end = '\0';
+
+	ObjString *result = takeString(chars, (int)length);
+	g_vm.stackCount -= count;
+	push(OBJ_VAL(result));
+}
+
 static void testStack(bool boolean) {
 	struct timespec start, end;
 	clock_gettime(CLOCK_MONOTONIC, &start);
@@ -275,20 +466,16 @@ static void testStack(bool boolean) {
 	// printf("RESULT: %f\n", exec_time_ns);
 }
 
-static void print_slots(CallFrame *frame) {
-	for (int i = 0; i < frame->slots_count; i++) {
-		printf("[%d]", frame->slots[i]);
-	}
-	printf("\n");
-}
-
-static InterpretResult run() {
+// Instantiated once plain and once for tracing, stack checks and recording
+// loops, see run(), so none of them adds anything to the plain dispatch loop.
+static inline __attribute__((always_inline)) InterpretResult run_loop(bool debug) {
 	CallFrame *frame     = &g_vm.frames[g_vm.frame_count - 1];
 	register uint8_t *ip = frame->ip;
 #define READ_BYTE() (*ip++)
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
 #define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+#define READ_UINT24() (ip += 3, (uint32_t)(ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)))
+#define CONSTANT_AT(index) (frame->closure->function->chunk.constants.values[index])
+#define STRING_AT(index) AS_STRING(CONSTANT_AT(index))
 // Une astuce macro habituelle
 #define BINARY_OP(value_type, op)                     \
 	do {                                                \
@@ -299,87 +486,169 @@ static InterpretResult run() {
 		}                                                 \
 		double b = AS_NUMBER(pop());                      \
 		double a = AS_NUMBER(pop());                      \
-		push(value_type(a op b));                         \
+		push_unchecked(value_type(a op b));               \
+	} while (false)
+// For ops whose operands the compiler has proven to be numbers.
+#define NUMBER_OP(value_type, op)                \
+	do {                                           \
+		double b = AS_NUMBER(pop());                 \
+		Value *a = &g_vm.stack[g_vm.stackCount - 1]; \
+		*a       = value_type(AS_NUMBER(*a) op b);   \
+	} while (false)
+// Taken on backward branches and calls only, so the common path is one decrement.
+#define SAFEPOINT()                              \
+	do {                                           \
+		if (--g_vm.fuel <= 0 && safepoint()) {       \
+			frame->ip = ip;                            \
+			return INTERPRET_SUSPENDED;                \
+		}                                            \
+	} while (false)
+// After calls, returns and backward branches, the frame goes on in machine
+// code if it has some, up to the next instruction that it leaves to us.
+#define ENTER_NATIVE()                                             \
+	do {                                                             \
+		ObjFunction *function = frame->closure->function;              \
+		if (debug) {                                                   \
+		} else if (function->aot != NULL) {                            \
+			ip = function->chunk.code + run_aot(function, frame, ip);    \
+		} else if (function->native != NULL) {                         \
+			ip = function->chunk.code + run_native(function, frame, ip); \
+		}                                                              \
 	} while (false)
 
 	for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-		printf("			");
-		for (Value *slot = g_vm.stack; slot < g_vm.stack + g_vm.stackCount; slot++) {
-			printf("[ ");
-			print_value(*slot);
-			printf(" ]");
+		if (debug && recording() && !record(frame, ip)) {
+			frame->ip = ip;
+			return INTERPRET_SWITCH;
+		}
+		if (debug && g_debug.verify_stack && g_vm.stackCount - frame->base > frame->closure->function->max_stack) {
+			frame->ip = ip;
+			runtimeError("Stack check failed: depth %d is over %d.", g_vm.stackCount - frame->base,
+			             frame->closure->function->max_stack);
+			return INTERPRET_RUNTIME_ERROR;
 		}
-		printf("\n");
-		int offset      = (int)(frame->ip - frame->closure->function->chunk.code);
-		int prevInstruc = frame->closure->function->chunk.code[offset - 2];
-		if (prevInstruc == OP_CONSTANT_LONG && foundConstantLong) {
-			// this flag is use to assert prevInstruc is a opCode not a number 7
-			// opcode byte byte byte
-			ip += 2;
-			foundConstantLong = false;
+		if (debug && g_debug.trace_execution) {
+			printf("			");
+			for (Value *slot = g_vm.stack; slot < g_vm.stack + g_vm.stackCount; slot++) {
+				printf("[ ");
+				print_value(*slot);
+				printf(" ]");
+			}
+			printf("\n");
+			disassemble_instruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
 		}
-		disassemble_instruction(&frame->closure->function->chunk, (int)(ip - frame->closure->function->chunk.code));
-#endif
+		// Indexed instructions read a one-byte index and then fall into the label
+		// that OP_WIDE jumps to with a 24-bit one.
+		uint32_t index;
+		bool wide;
 		uint8_t instruction;
 		switch (instruction = READ_BYTE()) {
-			case OP_CONSTANT: {
-				Value constant = READ_CONSTANT();
-				push(constant);
-				break;
-			}
-			case OP_CONSTANT_LONG: {
-				foundConstantLong = true;
-				Value constant    = READ_CONSTANT();
-				push(constant);
+			case OP_CONSTANT:
+				index = READ_BYTE();
+			constant:
+				push_unchecked(CONSTANT_AT(index));
 				break;
-			}
+			case OP_WIDE:
+				instruction = READ_BYTE();
+				index       = READ_UINT24();
+				switch (instruction) {
+					case OP_CONSTANT:
+						goto constant;
+					case OP_GET_LOCAL:
+						goto get_local;
+					case OP_SET_LOCAL:
+						goto set_local;
+					case OP_GET_GLOBAL:
+						goto get_global;
+					case OP_DEFINE_GLOBAL:
+						goto define_global;
+					case OP_SET_GLOBAL:
+						goto set_global;
+					case OP_GET_UPVALUE:
+						goto get_upvalue;
+					case OP_SET_UPVALUE:
+						goto set_upvalue;
+					case OP_GET_PROPERTY:
+						goto get_property;
+					case OP_SET_PROPERTY:
+						goto set_property;
+					case OP_GET_SUPER:
+						goto get_super;
+					case OP_INVOKE:
+						goto invoke;
+					case OP_SUPER_INVOKE:
+						goto super_invoke;
+					case OP_CLOSURE:
+						wide = true;
+						goto closure;
+					case OP_CLASS:
+						goto class;
+					case OP_METHOD:
+						goto method;
+					case OP_IMPORT:
+						goto import;
+				}
+				frame->ip = ip;
+				runtimeError("Unknown wide instruction %d.", instruction);
+				return INTERPRET_RUNTIME_ERROR;
 			case OP_NIL:
-				push(NIL_VAL);
+				push_unchecked(NIL_VAL);
 				break;
 			case OP_TRUE:
-				push(BOOL_VAL(true));
+				push_unchecked(BOOL_VAL(true));
 				break;
 			case OP_FALSE:
-				push(BOOL_VAL(false));
+				push_unchecked(BOOL_VAL(false));
 				break;
 			case OP_POP:
 				pop();
 				break;
-			case OP_GET_LOCAL: {
-				uint8_t slot = READ_BYTE();
-				if (slot >= frame->slots_count) {
-					push(g_vm.stack[frame->slots[frame->slots_count - 1] + slot - frame->slots_count]);
-				} else {
-					push(g_vm.stack[frame->slots[slot] - 1]);
-				}
+			case OP_GET_LOCAL:
+				index = READ_BYTE();
+			get_local:
+				push_unchecked(g_vm.stack[frame->base + index]);
 				break;
-			}
-			case OP_SET_LOCAL: {
-				uint8_t slot = READ_BYTE();
-				// FIXME
-				push_slots(frame, g_vm.stackCount - 1);
+			case OP_SET_LOCAL:
+				index = READ_BYTE();
+			set_local:
+				g_vm.stack[frame->base + index] = peek(0);
 				break;
-			}
-			case OP_GET_GLOBAL: {
-				ObjString *name = READ_STRING();
+			case OP_GET_GLOBAL:
+				index = READ_BYTE();
+			get_global: {
+				ObjString *name = STRING_AT(index);
 				Value value;
 				if (!tableGet(&g_vm.globals, name, &value)) {
 					frame->ip = ip;
 					runtimeError("Undefined variable '%s'.", name->chars);
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				push(value);
+				push_unchecked(value);
 				break;
 			}
-			case OP_DEFINE_GLOBAL: {
-				ObjString *name = READ_STRING();
+			case OP_DEFINE_GLOBAL:
+				index = READ_BYTE();
+			define_global: {
+				ObjString *name = STRING_AT(index);
+				if (is_const((Obj *)name)) {
+					frame->ip = ip;
+					runtimeError("Can't redefine constant '%s'.", name->chars);
+					return INTERPRET_RUNTIME_ERROR;
+				}
+				if (frame->closure->function->consts.count > 0) declare_const(frame->closure->function, name);
 				tableSet(&g_vm.globals, name, peek(0));
 				pop();  // make sure the value be though gc
 				break;
 			}
-			case OP_SET_GLOBAL: {
-				ObjString *name = READ_STRING();
+			case OP_SET_GLOBAL:
+				index = READ_BYTE();
+			set_global: {
+				ObjString *name = STRING_AT(index);
+				if (is_const((Obj *)name)) {
+					frame->ip = ip;
+					runtimeError("Can't assign to constant '%s'.", name->chars);
+					return INTERPRET_RUNTIME_ERROR;
+				}
 				if (tableSet(&g_vm.globals, name, peek(0))) {
 					tableDel(&g_vm.globals, name);
 					frame->ip = ip;
@@ -388,50 +657,65 @@ static InterpretResult run() {
 				}
 				break;
 			}
-			case OP_GET_UPVALUE: {
-				uint8_t slot = READ_BYTE();
-				push(*frame->closure->upvalues[slot]->location);
+			case OP_GET_UPVALUE:
+				index = READ_BYTE();
+			get_upvalue:
+				push_unchecked(*frame->closure->upvalues[index]->location);
 				break;
-			}
-			case OP_SET_UPVALUE: {
-				uint8_t slot                              = READ_BYTE();
-				*frame->closure->upvalues[slot]->location = peek(0);
+			case OP_SET_UPVALUE:
+				index = READ_BYTE();
+			set_upvalue: {
+				// A closed upvalue holds the value itself.
+				ObjUpValue *upvalue = frame->closure->upvalues[index];
+				*upvalue->location  = peek(0);
+				write_barrier((Obj *)upvalue);
 				break;
 			}
-			case OP_GET_PROPERTY: {
+			case OP_GET_PROPERTY:
+				index = READ_BYTE();
+			get_property: {
 				if (!IS_INSTANCE(peek(0))) {
+					frame->ip = ip;
 					runtimeError("Only instance have properties.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				ObjInstance *instance = AS_INSTANCE(peek(0));
-				ObjString *name       = READ_STRING();
+				ObjString *name       = STRING_AT(index);
 
 				Value value;
 				if (tableGet(&instance->fields, name, &value)) {
 					pop();
-					push(value);
+					push_unchecked(value);
 					break;
 				}
+				frame->ip = ip;
 				if (!bind_method(instance->klass, name)) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				break;
 			}
-			case OP_SET_PROPERTY: {
+			case OP_SET_PROPERTY:
+				index = READ_BYTE();
+			set_property: {
 				if (!IS_INSTANCE(peek(1))) {
+					frame->ip = ip;
 					runtimeError("Only instance have fields.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				ObjInstance *instance = AS_INSTANCE(peek(1));
-				tableSet(&instance->fields, READ_STRING(), peek(0));
+				tableSet(&instance->fields, STRING_AT(index), peek(0));
+				write_barrier((Obj *)instance);
 				Value value = pop();
 				pop();
-				push(value);
+				push_unchecked(value);
 				break;
 			}
-			case OP_GET_SUPER: {
-				ObjString *name      = READ_STRING();
+			case OP_GET_SUPER:
+				index = READ_BYTE();
+			get_super: {
+				ObjString *name      = STRING_AT(index);
 				ObjClass *superclass = AS_CLASS(pop());
+				frame->ip            = ip;
 				if (!bind_method(superclass, name)) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
@@ -440,7 +724,7 @@ static InterpretResult run() {
 			case OP_EQUAL: {
 				Value b = pop();
 				Value a = pop();
-				push(BOOL_VAL(values_equal(a, b)));
+				push_unchecked(BOOL_VAL(values_equal(a, b)));
 				break;
 			}
 			case OP_GREATER:
@@ -455,7 +739,7 @@ static InterpretResult run() {
 				} else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
 					double b = AS_NUMBER(pop());
 					double a = AS_NUMBER(pop());
-					push(NUMBER_VAL(a + b));
+					push_unchecked(NUMBER_VAL(a + b));
 				} else {
 					frame->ip = ip;
 					runtimeError("Operands must be two numbers or two strings.");
@@ -473,7 +757,7 @@ static InterpretResult run() {
 				BINARY_OP(NUMBER_VAL, /);
 				break;
 			case OP_NOT:
-				push(BOOL_VAL(isFalsey(pop())));
+				push_unchecked(BOOL_VAL(isFalsey(pop())));
 				break;
 			case OP_NEGATE:
 				if (!IS_NUMBER(peek(0))) {
@@ -499,9 +783,30 @@ static InterpretResult run() {
 				if (isFalsey(peek(0))) ip += offset;
 				break;
 			}
+			case OP_JUMP_IF_TRUE: {
+				uint16_t offset = READ_SHORT();
+				if (!isFalsey(peek(0))) ip += offset;
+				break;
+			}
 			case OP_LOOP: {
 				uint16_t offset = READ_SHORT();
 				ip -= offset;
+				SAFEPOINT();
+				ObjFunction *function = frame->closure->function;
+				if (!debug && !g_debug.no_trace && function->aot == NULL) {
+					Trace *trace = loop_trace(function, (int)(ip - function->chunk.code));
+					if (trace->code != NULL) {
+						ip = function->chunk.code + run_trace(trace, frame);
+					} else if (!trace->failed && ++trace->hits == TRACE_THRESHOLD) {
+						start_recording(trace, frame);
+						frame->ip = ip;
+						return INTERPRET_SWITCH;
+					}
+				}
+				frame->ip = ip;
+				warm_up(function);
+				ip = frame->ip;
+				ENTER_NATIVE();
 				break;
 			}
 			case OP_CALL: {
@@ -512,40 +817,59 @@ static InterpretResult run() {
 				}
 				frame = &g_vm.frames[g_vm.frame_count - 1];
 				ip    = frame->ip;
+				SAFEPOINT();
+				ENTER_NATIVE();
 				break;
 			}
-			case OP_INVOKE: {
-				ObjString *method = READ_STRING();
+			case OP_INVOKE:
+				index = READ_BYTE();
+			invoke: {
+				ObjString *method = STRING_AT(index);
 				int arg_count     = READ_BYTE();
+				frame->ip         = ip;
 				if (!invoke(method, arg_count)) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				frame = &g_vm.frames[g_vm.frame_count - 1];
+				ip    = frame->ip;
+				SAFEPOINT();
+				ENTER_NATIVE();
 				break;
 			}
-			case OP_SUPER_INVOKE: {
-				ObjString *method    = READ_STRING();
+			case OP_SUPER_INVOKE:
+				index = READ_BYTE();
+			super_invoke: {
+				ObjString *method    = STRING_AT(index);
 				int arg_count        = READ_BYTE();
 				ObjClass *superclass = AS_CLASS(pop());
+				frame->ip            = ip;
 				if (!invoke_from_class(superclass, method, arg_count)) {
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				frame = &g_vm.frames[g_vm.frame_count - 1];
+				ip    = frame->ip;
+				SAFEPOINT();
+				ENTER_NATIVE();
 				break;
 			}
-			case OP_CLOSURE: {
-				ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+			case OP_CLOSURE:
+				index = READ_BYTE();
+				wide  = false;
+			closure: {
+				ObjFunction *function = AS_FUNCTION(CONSTANT_AT(index));
 				ObjClosure *closure   = new_closure(function);
-				push(OBJ_VAL(closure));
+				push_unchecked(OBJ_VAL(closure));
 				for (int i = 0; i < closure->upvalue_count; i++) {
 					uint8_t is_local = READ_BYTE();
-					uint8_t index    = READ_BYTE();
+					uint32_t slot    = wide ? READ_UINT24() : READ_BYTE();
 					if (is_local) {
-						closure->upvalues[i] = capture_upvalue(&g_vm.stack[frame->slots[0] + index - 1]);
+						closure->upvalues[i] = capture_upvalue(&g_vm.stack[frame->base + slot]);
 					} else {
-						closure->upvalues[i] = frame->closure->upvalues[index];
+						closure->upvalues[i] = frame->closure->upvalues[slot];
 					}
 				}
+				// Capturing may have collected, and promoted the closure.
+				write_barrier((Obj *)closure);
 				break;
 			}
 			case OP_CLOSE_UPVALUE:
@@ -554,50 +878,115 @@ static InterpretResult run() {
 				break;
 			case OP_RETURN: {
 				Value result = pop();
-				close_upvalues(&g_vm.stack[frame->slots[0] - 1]);
+				close_upvalues(&g_vm.stack[frame->base]);
 				g_vm.frame_count--;
 				if (g_vm.frame_count == 0) {
 					pop();
 					return INTERPRET_OK;
 				}
 
-				g_vm.stackCount = frame->slots[0] - 1;
+				g_vm.stackCount = frame->base;
 
-				push(result);
+				push_unchecked(result);
 				frame = &g_vm.frames[g_vm.frame_count - 1];
 				ip    = frame->ip;
+				ENTER_NATIVE();
 				break;
 			}
 			case OP_CLASS:
-				push(OBJ_VAL(new_class(READ_STRING())));
+				index = READ_BYTE();
+			class:
+				push_unchecked(OBJ_VAL(new_class(STRING_AT(index))));
 				break;
 			case OP_INHERIT: {
 				Value superclass = peek(1);
 				if (!IS_CLASS(superclass)) {
+					frame->ip = ip;
 					runtimeError("Superclass mst be a class.");
 					return INTERPRET_RUNTIME_ERROR;
 				}
 				ObjClass *subclass = AS_CLASS(peek(0));
 				tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+				write_barrier((Obj *)subclass);
 				pop();
 				break;
 			}
 			case OP_METHOD:
-				define_method(READ_STRING());
+				index = READ_BYTE();
+			method:
+				define_method(STRING_AT(index));
+				break;
+			case OP_IMPORT:
+				index = READ_BYTE();
+			import:
+				frame->ip = ip;
+				if (!import_module(STRING_AT(index))) return INTERPRET_RUNTIME_ERROR;
+				frame = &g_vm.frames[g_vm.frame_count - 1];
+				ip    = frame->ip;
+				break;
+			case OP_BUILD_STRING:
+				build_string(READ_BYTE());
+				break;
+			case OP_ADD_NUMBER:
+				NUMBER_OP(NUMBER_VAL, +);
+				break;
+			case OP_SUBTRACT_NUMBER:
+				NUMBER_OP(NUMBER_VAL, -);
+				break;
+			case OP_MULTIPLY_NUMBER:
+				NUMBER_OP(NUMBER_VAL, *);
+				break;
+			case OP_DIVIDE_NUMBER:
+				NUMBER_OP(NUMBER_VAL, /);
+				break;
+			case OP_NEGATE_NUMBER: {
+				Value *a = &g_vm.stack[g_vm.stackCount - 1];
+				*a       = NUMBER_VAL(-AS_NUMBER(*a));
+				break;
+			}
+			case OP_GREATER_NUMBER:
+				NUMBER_OP(BOOL_VAL, >);
+				break;
+			case OP_LESS_NUMBER:
+				NUMBER_OP(BOOL_VAL, <);
+				break;
+			case OP_IS_NUMBER:
+				push_unchecked(BOOL_VAL(IS_NUMBER(g_vm.stack[frame->base + READ_BYTE()])));
+				break;
+			case OP_NEW:
+				// The class stays on the stack while the instance is allocated.
+				g_vm.stack[g_vm.stackCount - 1] = OBJ_VAL(new_instance(AS_CLASS(peek(0))));
 				break;
 		}
 	}
 #undef READ_BYTE
 #undef READ_SHORT
-#undef READ_CONSTANT
-#undef READ_STRING
+#undef READ_UINT24
+#undef CONSTANT_AT
+#undef STRING_AT
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef SAFEPOINT
+#undef ENTER_NATIVE
 }
 
-InterpretResult interpret(const char *src) {
-	ObjFunction *function = compile(src);
-	if (function == NULL) return INTERPRET_COMPILE_ERROR;
+static InterpretResult run_debug() {
+	return run_loop(true);
+}
+
+static InterpretResult run() {
+	for (;;) {
+		bool debug             = g_debug.trace_execution || g_debug.verify_stack || recording();
+		InterpretResult result = debug ? run_debug() : run_loop(false);
+		if (result != INTERPRET_SWITCH) {
+			stop_recording();
+			return result;
+		}
+	}
+}
 
+static InterpretResult run_script(ObjFunction *function) {
+	if (function == NULL) return INTERPRET_COMPILE_ERROR;
 	push(OBJ_VAL(function));
 	ObjClosure *closure = new_closure(function);
 	pop();  // for GC
@@ -605,3 +994,80 @@ InterpretResult interpret(const char *src) {
 	call(closure, 0);
 	return run();
 }
+
+InterpretResult interpret(const char *src) {
+	return interpret_source(src, strlen(src), 1);
+}
+
+// `line` is where `src` starts, for a source that arrives in parts.
+InterpretResult interpret_source(const char *src, size_t length, int line) {
+	// A new script discards whatever run is still suspended.
+	if (g_vm.frame_count != 0) resetStack();
+	return run_script(compile(src, length, line));
+}
+
+// Like interpret(), going through the bytecode cache kept next to `path`.
+InterpretResult interpret_file(const char *path, const char *src, size_t length) {
+	if (g_vm.frame_count != 0) resetStack();
+	return run_script(compile_cached(path, src, length));
+}
+
+// Like interpret_file(), running the C that `library` was built from, see
+// emit_c(), in place of the script's bytecode.
+InterpretResult interpret_aot(const char *path, const char *library, const char *src, size_t length) {
+	if (g_vm.frame_count != 0) resetStack();
+	ObjFunction *function = compile_cached(path, src, length);
+	if (function != NULL) load_aot(library, function);
+	return run_script(function);
+}
+
+// Grow the stack so that `count` more pushes cannot reallocate it, and so
+// cannot collect objects that only become roots once pushed.
+static void reserve_stack(int count) {
+	if (g_vm.stackCount + count >= g_vm.stackCapacity) grow_stack(g_vm.stackCount + count + 1);
+}
+
+// Run several scripts in order against the same globals, after compiling all
+// of them at once on up to `threads` threads.
+// Run what is left of a batch once the script before has given `result`. A
+// suspended script keeps the batch, and the functions below it, for resume().
+static InterpretResult run_batch(InterpretResult result) {
+	if (g_vm.batch_count == 0) return result;
+	while (result == INTERPRET_OK && g_vm.batch_next < g_vm.batch_count) {
+		ObjClosure *closure = new_closure(AS_FUNCTION(g_vm.stack[g_vm.batch_base + g_vm.batch_next++]));
+		push(OBJ_VAL(closure));
+		call(closure, 0);
+		result = run();
+	}
+	if (result == INTERPRET_SUSPENDED) return result;
+	if (result == INTERPRET_OK) g_vm.stackCount = g_vm.batch_base;
+	g_vm.batch_count = 0;
+	g_vm.batch_next  = 0;
+	return result;
+}
+
+InterpretResult interpret_all(const char **sources, const size_t *lengths, int count, int threads) {
+	if (g_vm.frame_count != 0) resetStack();
+	reserve_stack(count);
+	ObjFunction **functions = ALLOCATE(ObjFunction *, count);
+	bool compiled           = compile_all(sources, lengths, count, functions, threads);
+	int base                = g_vm.stackCount;
+	for (int i = 0; i < count; i++) {
+		push(functions[i] != NULL ? OBJ_VAL(functions[i]) : NIL_VAL);
+	}
+	FREE_ARRAY(ObjFunction *, functions, count);
+	if (!compiled) {
+		g_vm.stackCount = base;
+		return INTERPRET_COMPILE_ERROR;
+	}
+
+	g_vm.batch_base  = base;
+	g_vm.batch_count = count;
+	g_vm.batch_next  = 0;
+	return run_batch(INTERPRET_OK);
+}
+
+InterpretResult resume() {
+	if (g_vm.frame_count == 0) return INTERPRET_OK;
+	return run_batch(run());
+}
@@ -8,15 +8,22 @@
 
 #define FRAMES_MAX 64
 //#define STACK_MAX (FRAMES_MAX * UINT8_*_COUNT)
+// Backward branches and calls between two safepoint polls.
+#define SAFEPOINT_INTERVAL 1024
 
-typedef struct {
+typedef struct CallFrame {
 	ObjClosure *closure;
 	uint8_t *ip;
-	int *slots;
-	int slots_count;
-	int slots_capacity;
+	int base;  // stack index of slot zero
 } CallFrame;
 
+// Where a major collection is, see collect_step().
+typedef enum {
+	GC_IDLE,
+	GC_MARKING,
+	GC_SWEEPING,
+} GcPhase;
+
 typedef struct {
 	CallFrame frames[FRAMES_MAX];
 	int frame_count;
@@ -25,20 +32,44 @@ typedef struct {
 	int stackCount;
 	Table globals;
 	Table strings;
+	Table modules;  // paths already imported
+	// Globals declared const so far, with their values when known at compile
+	// time. The compiler inlines and protects them in every script after.
+	Table consts;
 	ObjString *init_string;
 	ObjUpValue *open_upvalues;
 	size_t bytes_allocated;
 	size_t next_gc;
-	Obj *objects;
+	Obj *objects;         // the old generation
+	Obj *young;           // the nursery: objects allocated since the last collection
+	size_t young_bytes;   // what the nursery's objects take
+	size_t nursery_size;  // young_bytes that set off a minor collection, see NURSERY_SIZE
+	size_t young_limit;   // young_bytes from which objects are allocated on the slow path
+	GcPhase gc_phase;
+	Obj *sweeping;        // old objects the sweep has yet to reach
+	// Old objects that may point into the nursery, see write_barrier().
+	int remembered_count;
+	int remembered_capacity;
+	Obj **remembered;
 	int gray_count;
 	int gray_capacity;
 	Obj **gray_stack;
+	int fuel;         // ticks left before the next safepoint poll
+	int64_t budget;   // ticks left for the whole run, -1 means unlimited
+	double deadline;  // CLOCK_MONOTONIC seconds, 0 means none
+	// The scripts of interpret_all(), kept on the stack from batch_base, and
+	// the next one to run, so that resume() can carry on with the rest.
+	int batch_base;
+	int batch_count;
+	int batch_next;
 } VM;
 
 typedef enum {
 	INTERPRET_OK,
 	INTERPRET_COMPILE_ERROR,
-	INTERPRET_RUNTIME_ERROR
+	INTERPRET_RUNTIME_ERROR,
+	INTERPRET_SUSPENDED,
+	INTERPRET_SWITCH  // only within run(), which picks its dispatch loop again
 } InterpretResult;
 
 extern VM g_vm;
@@ -46,6 +77,13 @@ extern VM g_vm;
 void initVm();
 void freeVm();
 InterpretResult interpret(const char *src);
+InterpretResult interpret_source(const char *src, size_t length, int line);
+InterpretResult interpret_file(const char *path, const char *src, size_t length);
+InterpretResult interpret_aot(const char *path, const char *library, const char *src, size_t length);
+InterpretResult interpret_all(const char **sources, const size_t *lengths, int count, int threads);
+InterpretResult resume();
+void set_budget(int64_t ticks);
+void set_deadline(double seconds);
 void push(Value value);
 Value pop();
 
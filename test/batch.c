@@ -0,0 +1,32 @@
+// Runs two scripts as one batch on a budget small enough to suspend both,
+// resuming until the batch is done, see interpret_all() and resume().
+#include <stdio.h>
+#include <string.h>
+
+#include "vm.h"
+
+#define BUDGET 100
+
+static const char *first  = "var total = 0;\n"
+                            "for (var i = 0; i < 1000; i = i + 1) total = total + i;\n"
+                            "print total;\n";
+static const char *second = "fun count(n) { if (n > 0) count(n - 1); }\n"
+                            "for (var i = 0; i < 100; i = i + 1) count(10);\n"
+                            "print total * 2;\n";
+
+int main() {
+	initVm();
+	const char *sources[] = {first, second};
+	size_t lengths[]      = {strlen(first), strlen(second)};
+	int suspended         = 0;
+	set_budget(BUDGET);
+	InterpretResult result = interpret_all(sources, lengths, 2, 1);
+	while (result == INTERPRET_SUSPENDED) {
+		suspended++;
+		set_budget(BUDGET);
+		result = resume();
+	}
+	printf("result %d, %s\n", result, suspended > 1 ? "suspended more than once" : "suspended at most once");
+	freeVm();
+	return result;
+}
@@ -0,0 +1,18 @@
+#!/bin/bash
+# Times each script under test/bench with the peephole pass on and off, best
+# of three. The scripts print their own running time last. Only the
+# interpreter runs, as the other tiers would hide the bytecode's differences.
+# usage: test/bench.sh [clox]
+cd "$(dirname "$0")/.."
+clox=${1:-./clox}
+export CLOX_NO_CACHE=1 CLOX_NO_JIT=1 CLOX_NO_TRACE=1 CLOX_NO_OPT=1
+
+best_of_three() {
+	for run in 1 2 3; do
+		CLOX_NO_PEEPHOLE=$1 "$clox" "$script" | tail -n 1
+	done | sort -g | head -n 1
+}
+
+for script in test/bench/*.lox; do
+	printf "%-22s on %8.3fs  off %8.3fs\n" "$script" "$(best_of_three 0)" "$(best_of_three 1)"
+done
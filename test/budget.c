@@ -0,0 +1,32 @@
+// Runs a loop on a budget, resuming it until it is done, then a loop that
+// never ends under a deadline, see set_budget(), set_deadline() and resume().
+#include <stdio.h>
+
+#include "vm.h"
+
+#define BUDGET 100
+
+static const char *counted = "var total = 0;\n"
+                             "for (var i = 0; i < 1000; i = i + 1) total = total + i;\n"
+                             "print total;\n";
+static const char *endless = "while (true) {}\n";
+
+int main() {
+	initVm();
+	int suspended = 0;
+	set_budget(BUDGET);
+	InterpretResult result = interpret(counted);
+	while (result == INTERPRET_SUSPENDED) {
+		suspended++;
+		set_budget(BUDGET);
+		result = resume();
+	}
+	printf("budget: result %d after %d suspensions\n", result, suspended);
+
+	set_budget(-1);
+	set_deadline(0.05);
+	result = interpret(endless);
+	printf("deadline: result %d\n", result);
+	freeVm();
+	return 0;
+}
@@ -0,0 +1,104 @@
+#!/bin/bash
+# Runs the tests under test/ against a clox built from src/, or the one given.
+# Extra flags for the build, say -fsanitize=address, go in CFLAGS.
+# Each test.lox has its expected output, stdout then stderr, in test.out.
+# Rewrite the .out files from the current build with UPDATE=1.
+# usage: test/run.sh [clox]
+cd "$(dirname "$0")/.."
+build=$(mktemp -d)
+trap 'rm -rf "$build"' EXIT
+clox=$1
+if [ -z "$clox" ]; then
+	clox=$build/clox
+	gcc -O2 $CFLAGS -o "$clox" src/*.c -lpthread || exit 1
+fi
+export CLOX_NO_CACHE=1
+failed=0
+
+# check NAME EXPECTED COMMAND...: runs COMMAND and compares what it prints.
+check() {
+	local name=$1 expected=$2
+	shift 2
+	local actual
+	actual=$("$@" 2>&1)
+	if [ -n "$UPDATE" ]; then
+		printf "%s\n" "$actual" > "$expected"
+	elif [ "$actual" != "$(cat "$expected")" ]; then
+		echo "FAIL $name"
+		diff <(cat "$expected") <(printf "%s\n" "$actual") | head -n 20
+		failed=1
+	fi
+}
+
+# The peephole pass, by the code it leaves.
+for test in test/peephole/*.lox; do
+	check "$test" "${test%.lox}.out" env CLOX_PRINT_CODE=1 "$clox" "$test"
+done
+
+# Stack depths, checked by CLOX_VERIFY_STACK in the interpreter, for the code
+# the optimizing tier leaves and for ahead-of-time compiled scripts. The
+# checks keep machine code from being entered, so those tiers also run once
+# without them.
+for test in test/stack/*.lox; do
+	expected=${test%.lox}.out
+	check "$test (interpreter)" "$expected" env CLOX_VERIFY_STACK=1 CLOX_NO_JIT=1 CLOX_NO_TRACE=1 CLOX_NO_OPT=1 "$clox" "$test"
+	check "$test (jit)" "$expected" env CLOX_VERIFY_STACK=1 "$clox" "$test"
+	check "$test (jit, unchecked)" "$expected" "$clox" "$test"
+	library=$build/$(basename "$test" .lox).so
+	if ! "$clox" --emit-c "$build/aot.c" "$test" || ! gcc -O2 $CFLAGS -shared -fPIC -Isrc -o "$library" "$build/aot.c"; then
+		echo "FAIL $test (aot build)"
+		failed=1
+		continue
+	fi
+	check "$test (aot)" "$expected" env CLOX_VERIFY_STACK=1 "$clox" --aot "$library" "$test"
+	check "$test (aot, unchecked)" "$expected" "$clox" --aot "$library" "$test"
+done
+
+# Runtime errors report the line they happen on, inlined code included.
+for test in test/errors/*.lox; do
+	check "$test (interpreter)" "${test%.lox}.out" env CLOX_NO_JIT=1 CLOX_NO_TRACE=1 CLOX_NO_OPT=1 "$clox" "$test"
+	check "$test" "${test%.lox}.out" "$clox" "$test"
+done
+
+# Values inferred to be numbers, or not, once folding has rewound the code.
+for test in test/numbers/*.lox; do
+	check "$test (interpreter)" "${test%.lox}.out" env CLOX_NO_JIT=1 CLOX_NO_TRACE=1 CLOX_NO_OPT=1 "$clox" "$test"
+	check "$test" "${test%.lox}.out" "$clox" "$test"
+done
+
+# Compile errors, the same whether top-level bodies are deferred or not.
+for test in test/compiler/*.lox; do
+	check "$test" "${test%.lox}.out" "$clox" "$test"
+	check "$test (eager)" "${test%.lox}.out" env CLOX_EAGER_COMPILE=1 "$clox" "$test"
+done
+
+# A syntax error in a deferred body, reported on the first call without the
+# cache, and before anything runs when every body is compiled up front, as
+# the cache does.
+check "test/deferred/body.lox" test/deferred/body.out "$clox" test/deferred/body.lox
+check "test/deferred/body.lox (eager)" test/deferred/body.eager.out env CLOX_EAGER_COMPILE=1 "$clox" test/deferred/body.lox
+cp test/deferred/body.lox "$build/body.lox"
+check "test/deferred/body.lox (cached)" test/deferred/body.eager.out env -u CLOX_NO_CACHE "$clox" "$build/body.lox"
+
+# A module that fails to compile is compiled again on the next import.
+check "test/imports/retry.lox" test/imports/retry.out sh -c '"$1" < test/imports/retry.lox' sh "$clox"
+
+# Several files compiled on more threads than CI machines have CPUs, so
+# that the workers' heaps get merged, with and without collections between.
+check "test/files" test/files/parts.out env CLOX_THREADS=4 "$clox" test/files/*.lox
+check "test/files (stress)" test/files/parts.out env CLOX_THREADS=4 CLOX_STRESS_GC=1 "$clox" test/files/*.lox
+
+# A const declared by one file, assigned or declared again by the next.
+for test in test/consts/assign.lox test/consts/redeclare.lox; do
+	check "$test" "${test%.lox}.out" "$clox" test/consts/first.lox "$test"
+done
+
+# Embedding: a script and then a batch of scripts suspended by their budget
+# and resumed, and a script suspended by its deadline.
+for test in test/budget.c test/batch.c; do
+	gcc -O2 $CFLAGS -Isrc -o "$build/embed" "$test" $(ls src/*.c | grep -v main.c) -lpthread || exit 1
+	check "$test" "${test%.c}.out" "$build/embed"
+done
+
+[ $failed = 0 ] && echo "all tests passed"
+exit $failed